@@ -0,0 +1,89 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "log.h"
+
+static const char* partNames[BENCH_PARTS] = {
+   "eval", "render", "trace", "ipc"
+};
+
+struct bench* bench_open() {
+   struct bench* b = (struct bench*) calloc(1, sizeof(struct bench));
+   b->startNs = bench_now();
+   return b;
+}
+
+void bench_free(struct bench* b) {
+   free(b);
+}
+
+int bench_report(struct bench* b, const struct bench_result* res,
+                 const char* filename, const char* prefix) {
+   const double seconds = (bench_now() - b->startNs) / 1e9;
+   const double evals = b->calls[BENCH_EVAL];
+   double partSeconds[BENCH_PARTS];
+   double other = seconds;
+   for (int i = 0; i < BENCH_PARTS; i++) {
+      partSeconds[i] = b->ns[i] / 1e9;
+      other -= partSeconds[i];
+   }
+
+   printf ("%sBenchmark: %.1f frames, %llu cycles in %.2fs, "
+           "%.0f cycles/s, %.0f evals/s\n", prefix, res->frames,
+           (unsigned long long) res->cycles, seconds,
+           res->cycles / seconds, evals / seconds);
+   printf ("%s  ", prefix);
+   for (int i = 0; i < BENCH_PARTS; i++)
+      printf (" %s %.1f%%", partNames[i],
+              100.0 * partSeconds[i] / seconds);
+   printf (" other %.1f%%\n", 100.0 * other / seconds);
+
+   if (!filename)
+      return 0;
+
+   FILE* fp = fopen(filename, "a");
+   if (!fp) {
+      LOG(LOG_ERROR, "can't open %s", filename);
+      return 1;
+   }
+   // A new file starts with the column names
+   fseek(fp, 0, SEEK_END);
+   if (ftell(fp) == 0) {
+      fprintf(fp, "time,label,chip,frames,cycles,evals,seconds,"
+              "cycles_per_s,evals_per_s");
+      for (int i = 0; i < BENCH_PARTS; i++)
+         fprintf(fp, ",%s_s", partNames[i]);
+      fprintf(fp, "\n");
+   }
+   fprintf(fp, "%lld,%s,%d,%.1f,%llu,%llu,%.3f,%.0f,%.0f",
+           (long long) time(NULL), res->label ? res->label : "",
+           res->chip, res->frames, (unsigned long long) res->cycles,
+           (unsigned long long) b->calls[BENCH_EVAL], seconds,
+           res->cycles / seconds, evals / seconds);
+   for (int i = 0; i < BENCH_PARTS; i++)
+      fprintf(fp, ",%.3f", partSeconds[i]);
+   fprintf(fp, "\n");
+   if (fclose(fp)) {
+      LOG(LOG_ERROR, "can't write %s", filename);
+      return 1;
+   }
+   return 0;
+}
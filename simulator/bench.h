@@ -0,0 +1,65 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef VICII_BENCH_H
+#define VICII_BENCH_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Where a --bench run spends its time. Each part is timed around the
+// calls that do it, so what is left over is the loop itself (checks,
+// stim, the reference model and so on).
+
+#define BENCH_EVAL   0  // top->eval()
+#define BENCH_RENDER 1  // pixels, window updates and frame files
+#define BENCH_TRACE  2  // waveform dumps
+#define BENCH_IPC    3  // waiting for and answering VICE
+#define BENCH_PARTS  4
+
+struct bench {
+   uint64_t startNs;
+   uint64_t ns[BENCH_PARTS];
+   uint64_t calls[BENCH_PARTS];
+};
+
+// What a run did, for bench_report()
+struct bench_result {
+   const char* label;
+   int chip;
+   uint64_t cycles;
+   double frames;
+};
+
+static inline uint64_t bench_now() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Starts the clock
+struct bench* bench_open();
+
+// Prints the summary (each line starting with prefix) and, if filename
+// isn't NULL, appends a line to it. The file gets a header line when
+// it is new. Returns 1 on error.
+int bench_report(struct bench* b, const struct bench_result* res,
+                 const char* filename, const char* prefix);
+
+void bench_free(struct bench* b);
+
+#endif
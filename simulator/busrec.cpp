@@ -0,0 +1,221 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "busrec.h"
+#include "log.h"
+
+static struct busrec* newBusrec(FILE* fp, bool replay) {
+   struct busrec* br = (struct busrec*) malloc(sizeof(struct busrec));
+   br->fp = fp;
+   br->replay = replay;
+   br->steps = 0;
+   br->mismatches = 0;
+   memset(br->lastRegs, 0, sizeof(br->lastRegs));
+   memset(br->expectedRegs, 0, sizeof(br->expectedRegs));
+   return br;
+}
+
+struct busrec* busrec_open_record(const char* filename, int chip) {
+   FILE* fp = fopen(filename, "wb");
+   if (!fp) {
+      LOG(LOG_ERROR, "can't open %s for writing", filename);
+      return NULL;
+   }
+
+   struct busrec_header hdr;
+   memcpy(hdr.magic, BUSREC_MAGIC, 4);
+   hdr.version = BUSREC_VERSION;
+   hdr.chip = chip;
+   hdr.stateSize = sizeof(struct vicii_state);
+   fwrite(&hdr, sizeof(hdr), 1, fp);
+   return newBusrec(fp, false);
+}
+
+struct busrec* busrec_open_replay(const char* filename, int chip) {
+   FILE* fp = fopen(filename, "rb");
+   if (!fp) {
+      LOG(LOG_ERROR, "can't open %s", filename);
+      return NULL;
+   }
+
+   struct busrec_header hdr;
+   if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+          memcmp(hdr.magic, BUSREC_MAGIC, 4) != 0 ||
+          hdr.version != BUSREC_VERSION) {
+      LOG(LOG_ERROR, "%s is not a bus recording", filename);
+      fclose(fp);
+      return NULL;
+   }
+   if (hdr.stateSize != sizeof(struct vicii_state)) {
+      LOG(LOG_ERROR, "%s was recorded with a different vicii_state",
+          filename);
+      fclose(fp);
+      return NULL;
+   }
+   if ((int) hdr.chip != chip) {
+      LOG(LOG_ERROR, "%s was recorded for chip %u, not %d",
+          filename, hdr.chip, chip);
+      fclose(fp);
+      return NULL;
+   }
+   return newBusrec(fp, true);
+}
+
+void busrec_close(struct busrec* br) {
+   fclose(br->fp);
+   free(br);
+}
+
+void busrec_step_in(struct busrec* br, const struct vicii_state* state) {
+   // Batching is just how the steps got here, replay doesn't need it
+   if (state->flags & VICII_OP_SYNC_STATE) {
+      struct vicii_state tmp = *state;
+      tmp.flags &= ~VICII_OP_BATCH;
+      fputc('S', br->fp);
+      fwrite(&tmp, sizeof(tmp), 1, br->fp);
+   } else {
+      struct busrec_in in;
+      in.flags = state->flags & ~VICII_OP_BATCH;
+      in.addr_to_sim = state->addr_to_sim;
+      in.data_to_sim = state->data_to_sim;
+      in.ce = state->ce;
+      in.rw = state->rw;
+      in.lp = state->lp;
+      in.pad = 0;
+      fputc('I', br->fp);
+      fwrite(&in, sizeof(in), 1, br->fp);
+   }
+}
+
+// Fill out from state and list the registers that changed since the
+// last step in deltas. Returns the number of deltas.
+static int makeOut(const struct vicii_state* state,
+                   unsigned char* lastRegs, struct busrec_out* out,
+                   unsigned char deltas[64][2]) {
+   out->irq = state->irq;
+   out->ba = state->ba;
+   out->aec = state->aec;
+   out->addr_from_sim = state->addr_from_sim;
+   out->data_from_sim = state->data_from_sim;
+   out->xpos = state->xpos;
+   out->raster_line = state->raster_line;
+   out->cycle_num = state->cycle_num;
+   memset(out->pad, 0, sizeof(out->pad));
+
+   int n = 0;
+   for (int r = 0; r < 64; r++) {
+      if (state->fpga_reg[r] != lastRegs[r]) {
+         deltas[n][0] = r;
+         deltas[n][1] = state->fpga_reg[r];
+         lastRegs[r] = state->fpga_reg[r];
+         n++;
+      }
+   }
+   out->num_reg_deltas = n;
+   return n;
+}
+
+void busrec_step_out(struct busrec* br, const struct vicii_state* state) {
+   struct busrec_out out;
+   unsigned char deltas[64][2];
+   int n = makeOut(state, br->lastRegs, &out, deltas);
+   fputc('O', br->fp);
+   fwrite(&out, sizeof(out), 1, br->fp);
+   fwrite(deltas, 2, n, br->fp);
+   br->steps++;
+}
+
+int busrec_next_in(struct busrec* br, struct vicii_state* state) {
+   int type = fgetc(br->fp);
+   if (type == EOF)
+      return 1;
+
+   if (type == 'S') {
+      if (fread(state, sizeof(struct vicii_state), 1, br->fp) != 1) {
+         LOG(LOG_ERROR, "truncated bus recording");
+         return 1;
+      }
+   } else if (type == 'I') {
+      struct busrec_in in;
+      if (fread(&in, sizeof(in), 1, br->fp) != 1) {
+         LOG(LOG_ERROR, "truncated bus recording");
+         return 1;
+      }
+      state->flags = in.flags;
+      state->addr_to_sim = in.addr_to_sim;
+      state->data_to_sim = in.data_to_sim;
+      state->ce = in.ce;
+      state->rw = in.rw;
+      state->lp = in.lp;
+   } else {
+      LOG(LOG_ERROR, "bad bus record type %d at step %llu", type,
+          (unsigned long long) br->steps);
+      return 1;
+   }
+   return 0;
+}
+
+int busrec_check_in(struct busrec* br, const struct vicii_state* state) {
+   struct vicii_state ref;
+   if (busrec_next_in(br, &ref))
+      return -1;
+
+   // Capture flags are up to whoever is driving VICE this time
+   const unsigned int stepFlags = VICII_OP_BUS_ACCESS | VICII_OP_SYNC_STATE;
+   if ((ref.flags & stepFlags) != (state->flags & stepFlags) ||
+          ref.addr_to_sim != state->addr_to_sim ||
+          ref.data_to_sim != state->data_to_sim ||
+          ref.ce != state->ce || ref.rw != state->rw || ref.lp != state->lp)
+      return 1;
+   return 0;
+}
+
+int busrec_check_out(struct busrec* br, const struct vicii_state* state) {
+   struct busrec_out* exp = &br->expected;
+   unsigned char deltas[64][2];
+
+   if (fgetc(br->fp) != 'O' ||
+          fread(exp, sizeof(*exp), 1, br->fp) != 1 ||
+          exp->num_reg_deltas > 64 ||
+          fread(deltas, 2, exp->num_reg_deltas, br->fp) !=
+             exp->num_reg_deltas) {
+      LOG(LOG_ERROR, "bad or truncated bus recording at step %llu",
+          (unsigned long long) br->steps);
+      br->mismatches++;
+      return 1;
+   }
+   for (int i = 0; i < exp->num_reg_deltas; i++)
+      br->expectedRegs[deltas[i][0] & 63] = deltas[i][1];
+
+   makeOut(state, br->lastRegs, &br->actual, deltas);
+   br->steps++;
+
+   struct busrec_out* act = &br->actual;
+   if (exp->irq != act->irq || exp->ba != act->ba || exp->aec != act->aec ||
+          exp->addr_from_sim != act->addr_from_sim ||
+          exp->data_from_sim != act->data_from_sim ||
+          exp->xpos != act->xpos || exp->raster_line != act->raster_line ||
+          exp->cycle_num != act->cycle_num ||
+          memcmp(br->expectedRegs, state->fpga_reg, 64) != 0) {
+      br->mismatches++;
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,112 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef VICII_BUSREC_H
+#define VICII_BUSREC_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+extern "C" {
+#include "vicii_ipc.h"
+}
+
+// Record and replay of the VICE side of a shadowing session.
+//
+// A recording is a header followed by one pair of records per step
+// (4 dot4x ticks, one exchange or one batch entry):
+//
+//    'S' + struct vicii_state     sync step, the full state VICE sent
+//    'I' + struct busrec_in       any other step, just the bus inputs
+//    'O' + struct busrec_out      what the simulator answered, followed
+//          + reg/value pairs      by the fpga_reg entries that changed
+//
+// Replaying feeds the inputs back to the model without VICE and
+// compares each step's answer with the recorded one.
+
+#define BUSREC_MAGIC "KWBR"
+#define BUSREC_VERSION 2
+
+struct busrec_header {
+   char magic[4];
+   uint32_t version;
+   uint32_t chip;
+   uint32_t stateSize;  // sizeof(struct vicii_state) when recorded
+};
+
+struct busrec_in {
+   uint32_t flags;
+   uint16_t addr_to_sim;
+   uint16_t data_to_sim;
+   uint8_t ce;
+   uint8_t rw;
+   uint8_t lp;
+   uint8_t pad;
+};
+
+struct busrec_out {
+   uint8_t irq;
+   uint8_t ba;
+   uint8_t aec;
+   uint8_t num_reg_deltas;
+   uint16_t addr_from_sim;
+   uint16_t data_from_sim;
+   // Where the simulator was at the end of the step
+   uint16_t xpos;
+   uint16_t raster_line;
+   uint8_t cycle_num;
+   uint8_t pad[3];
+};
+
+struct busrec {
+   FILE* fp;
+   bool replay;
+   uint64_t steps;
+   uint64_t mismatches;
+   unsigned char lastRegs[64];  // fpga_reg at the end of the last step
+
+   // Replay only
+   struct busrec_out expected;
+   struct busrec_out actual;
+   unsigned char expectedRegs[64];
+};
+
+// Return NULL on error
+struct busrec* busrec_open_record(const char* filename, int chip);
+struct busrec* busrec_open_replay(const char* filename, int chip);
+
+void busrec_close(struct busrec* br);
+
+// Recording. Call busrec_step_in() when a step's inputs are in state
+// and busrec_step_out() when its outputs are.
+void busrec_step_in(struct busrec* br, const struct vicii_state* state);
+void busrec_step_out(struct busrec* br, const struct vicii_state* state);
+
+// Replaying or comparing. Loads the next step's inputs into state.
+// Returns 1 at the end of the recording or on error.
+int busrec_next_in(struct busrec* br, struct vicii_state* state);
+
+// Comparing. Reads the next step from the recording and checks its
+// bus inputs match the ones in state. Returns 0 if they match, 1 if
+// not and -1 at the end of the recording or on error.
+int busrec_check_in(struct busrec* br, const struct vicii_state* state);
+
+// Replaying or comparing. Compares the simulator's answer for the step
+// in state with the recorded one. Returns 1 if they differ; the two are left in
+// br->expected/br->actual and br->expectedRegs.
+int busrec_check_out(struct busrec* br, const struct vicii_state* state);
+
+#endif
@@ -42,6 +42,16 @@
 #define PAL_HALF_4X_COLOR_PS 28194 // half the period of 17.734475Mhz
 #define PAL_HALF_16X_COLOR_PS 7048 // half the period of col16x
 
+// Exact number of col16x half periods in 4 dot4x half periods.
+// (col16x is 9/4 of dot4x for PAL and 7/4 of dot4x for NTSC)
+#define PAL_COL16X_PER_4_DOT4X 9
+#define NTSC_COL16X_PER_4_DOT4X 7
+
+// Ticks after phi falls before the CPU lets go of ce and rw. The same
+// as what the VICE hook does for -z, so --load and --stim step the bus
+// the way VICE does.
+#define BUS_RELEASE_TICKS 4
+
 // Must match fpga design being simulated
 #define NTSC_6567R56A_NUM_CYCLES 64
 #define NTSC_6567R56A_MAX_DOT_X 511 // 64 cycles per line
@@ -0,0 +1,805 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <string.h>
+
+#include "cpu6510.h"
+
+// Addressing modes. Each one is a fixed sequence of bus cycles; see
+// cpu_tick(). The stack and flow instructions get their own.
+enum {
+   M_IMP, M_IMM, M_ZP, M_ZPX, M_ZPY, M_ABS, M_ABX, M_ABY, M_IZX, M_IZY,
+   M_REL, M_JMP, M_JMPI, M_JSR, M_RTS, M_RTI, M_BRK, M_PUSH, M_PULL,
+   M_JAM
+};
+
+enum {
+   // Reads
+   O_LDA, O_LDX, O_LDY, O_LAX, O_ORA, O_AND, O_EOR, O_ADC, O_SBC, O_CMP,
+   O_CPX, O_CPY, O_BIT, O_NOP, O_ANC, O_ALR, O_ARR, O_SBX, O_LAS, O_ANE,
+   O_LXA,
+   // Writes
+   O_STA, O_STX, O_STY, O_SAX, O_SHA, O_SHX, O_SHY, O_TAS,
+   // Read, modify, write (or the accumulator for M_IMP)
+   O_ASL, O_LSR, O_ROL, O_ROR, O_INC, O_DEC, O_SLO, O_RLA, O_SRE, O_RRA,
+   O_DCP, O_ISC,
+   // Implied
+   O_TAX, O_TAY, O_TXA, O_TYA, O_TSX, O_TXS, O_INX, O_INY, O_DEX, O_DEY,
+   O_CLC, O_SEC, O_CLI, O_SEI, O_CLV, O_CLD, O_SED,
+   // Branches, by flag and value
+   O_BPL, O_BMI, O_BVC, O_BVS, O_BCC, O_BCS, O_BNE, O_BEQ,
+   // Stack
+   O_PHA, O_PHP, O_PLA, O_PLP,
+   O_NONE
+};
+
+#define IS_WRITE(op) ((op) >= O_STA && (op) <= O_TAS)
+#define IS_RMW(op) ((op) >= O_ASL && (op) <= O_ISC)
+
+// Mode and operation for every opcode
+static const uint8_t opTable[256][2] = {
+   /* 00 */ {M_BRK,O_NONE}, {M_IZX,O_ORA}, {M_JAM,O_NONE}, {M_IZX,O_SLO},
+   /* 04 */ {M_ZP,O_NOP},   {M_ZP,O_ORA},  {M_ZP,O_ASL},   {M_ZP,O_SLO},
+   /* 08 */ {M_PUSH,O_PHP}, {M_IMM,O_ORA}, {M_IMP,O_ASL},  {M_IMM,O_ANC},
+   /* 0c */ {M_ABS,O_NOP},  {M_ABS,O_ORA}, {M_ABS,O_ASL},  {M_ABS,O_SLO},
+   /* 10 */ {M_REL,O_BPL},  {M_IZY,O_ORA}, {M_JAM,O_NONE}, {M_IZY,O_SLO},
+   /* 14 */ {M_ZPX,O_NOP},  {M_ZPX,O_ORA}, {M_ZPX,O_ASL},  {M_ZPX,O_SLO},
+   /* 18 */ {M_IMP,O_CLC},  {M_ABY,O_ORA}, {M_IMP,O_NOP},  {M_ABY,O_SLO},
+   /* 1c */ {M_ABX,O_NOP},  {M_ABX,O_ORA}, {M_ABX,O_ASL},  {M_ABX,O_SLO},
+   /* 20 */ {M_JSR,O_NONE}, {M_IZX,O_AND}, {M_JAM,O_NONE}, {M_IZX,O_RLA},
+   /* 24 */ {M_ZP,O_BIT},   {M_ZP,O_AND},  {M_ZP,O_ROL},   {M_ZP,O_RLA},
+   /* 28 */ {M_PULL,O_PLP}, {M_IMM,O_AND}, {M_IMP,O_ROL},  {M_IMM,O_ANC},
+   /* 2c */ {M_ABS,O_BIT},  {M_ABS,O_AND}, {M_ABS,O_ROL},  {M_ABS,O_RLA},
+   /* 30 */ {M_REL,O_BMI},  {M_IZY,O_AND}, {M_JAM,O_NONE}, {M_IZY,O_RLA},
+   /* 34 */ {M_ZPX,O_NOP},  {M_ZPX,O_AND}, {M_ZPX,O_ROL},  {M_ZPX,O_RLA},
+   /* 38 */ {M_IMP,O_SEC},  {M_ABY,O_AND}, {M_IMP,O_NOP},  {M_ABY,O_RLA},
+   /* 3c */ {M_ABX,O_NOP},  {M_ABX,O_AND}, {M_ABX,O_ROL},  {M_ABX,O_RLA},
+   /* 40 */ {M_RTI,O_NONE}, {M_IZX,O_EOR}, {M_JAM,O_NONE}, {M_IZX,O_SRE},
+   /* 44 */ {M_ZP,O_NOP},   {M_ZP,O_EOR},  {M_ZP,O_LSR},   {M_ZP,O_SRE},
+   /* 48 */ {M_PUSH,O_PHA}, {M_IMM,O_EOR}, {M_IMP,O_LSR},  {M_IMM,O_ALR},
+   /* 4c */ {M_JMP,O_NONE}, {M_ABS,O_EOR}, {M_ABS,O_LSR},  {M_ABS,O_SRE},
+   /* 50 */ {M_REL,O_BVC},  {M_IZY,O_EOR}, {M_JAM,O_NONE}, {M_IZY,O_SRE},
+   /* 54 */ {M_ZPX,O_NOP},  {M_ZPX,O_EOR}, {M_ZPX,O_LSR},  {M_ZPX,O_SRE},
+   /* 58 */ {M_IMP,O_CLI},  {M_ABY,O_EOR}, {M_IMP,O_NOP},  {M_ABY,O_SRE},
+   /* 5c */ {M_ABX,O_NOP},  {M_ABX,O_EOR}, {M_ABX,O_LSR},  {M_ABX,O_SRE},
+   /* 60 */ {M_RTS,O_NONE}, {M_IZX,O_ADC}, {M_JAM,O_NONE}, {M_IZX,O_RRA},
+   /* 64 */ {M_ZP,O_NOP},   {M_ZP,O_ADC},  {M_ZP,O_ROR},   {M_ZP,O_RRA},
+   /* 68 */ {M_PULL,O_PLA}, {M_IMM,O_ADC}, {M_IMP,O_ROR},  {M_IMM,O_ARR},
+   /* 6c */ {M_JMPI,O_NONE},{M_ABS,O_ADC}, {M_ABS,O_ROR},  {M_ABS,O_RRA},
+   /* 70 */ {M_REL,O_BVS},  {M_IZY,O_ADC}, {M_JAM,O_NONE}, {M_IZY,O_RRA},
+   /* 74 */ {M_ZPX,O_NOP},  {M_ZPX,O_ADC}, {M_ZPX,O_ROR},  {M_ZPX,O_RRA},
+   /* 78 */ {M_IMP,O_SEI},  {M_ABY,O_ADC}, {M_IMP,O_NOP},  {M_ABY,O_RRA},
+   /* 7c */ {M_ABX,O_NOP},  {M_ABX,O_ADC}, {M_ABX,O_ROR},  {M_ABX,O_RRA},
+   /* 80 */ {M_IMM,O_NOP},  {M_IZX,O_STA}, {M_IMM,O_NOP},  {M_IZX,O_SAX},
+   /* 84 */ {M_ZP,O_STY},   {M_ZP,O_STA},  {M_ZP,O_STX},   {M_ZP,O_SAX},
+   /* 88 */ {M_IMP,O_DEY},  {M_IMM,O_NOP}, {M_IMP,O_TXA},  {M_IMM,O_ANE},
+   /* 8c */ {M_ABS,O_STY},  {M_ABS,O_STA}, {M_ABS,O_STX},  {M_ABS,O_SAX},
+   /* 90 */ {M_REL,O_BCC},  {M_IZY,O_STA}, {M_JAM,O_NONE}, {M_IZY,O_SHA},
+   /* 94 */ {M_ZPX,O_STY},  {M_ZPX,O_STA}, {M_ZPY,O_STX},  {M_ZPY,O_SAX},
+   /* 98 */ {M_IMP,O_TYA},  {M_ABY,O_STA}, {M_IMP,O_TXS},  {M_ABY,O_TAS},
+   /* 9c */ {M_ABX,O_SHY},  {M_ABX,O_STA}, {M_ABY,O_SHX},  {M_ABY,O_SHA},
+   /* a0 */ {M_IMM,O_LDY},  {M_IZX,O_LDA}, {M_IMM,O_LDX},  {M_IZX,O_LAX},
+   /* a4 */ {M_ZP,O_LDY},   {M_ZP,O_LDA},  {M_ZP,O_LDX},   {M_ZP,O_LAX},
+   /* a8 */ {M_IMP,O_TAY},  {M_IMM,O_LDA}, {M_IMP,O_TAX},  {M_IMM,O_LXA},
+   /* ac */ {M_ABS,O_LDY},  {M_ABS,O_LDA}, {M_ABS,O_LDX},  {M_ABS,O_LAX},
+   /* b0 */ {M_REL,O_BCS},  {M_IZY,O_LDA}, {M_JAM,O_NONE}, {M_IZY,O_LAX},
+   /* b4 */ {M_ZPX,O_LDY},  {M_ZPX,O_LDA}, {M_ZPY,O_LDX},  {M_ZPY,O_LAX},
+   /* b8 */ {M_IMP,O_CLV},  {M_ABY,O_LDA}, {M_IMP,O_TSX},  {M_ABY,O_LAS},
+   /* bc */ {M_ABX,O_LDY},  {M_ABX,O_LDA}, {M_ABY,O_LDX},  {M_ABY,O_LAX},
+   /* c0 */ {M_IMM,O_CPY},  {M_IZX,O_CMP}, {M_IMM,O_NOP},  {M_IZX,O_DCP},
+   /* c4 */ {M_ZP,O_CPY},   {M_ZP,O_CMP},  {M_ZP,O_DEC},   {M_ZP,O_DCP},
+   /* c8 */ {M_IMP,O_INY},  {M_IMM,O_CMP}, {M_IMP,O_DEX},  {M_IMM,O_SBX},
+   /* cc */ {M_ABS,O_CPY},  {M_ABS,O_CMP}, {M_ABS,O_DEC},  {M_ABS,O_DCP},
+   /* d0 */ {M_REL,O_BNE},  {M_IZY,O_CMP}, {M_JAM,O_NONE}, {M_IZY,O_DCP},
+   /* d4 */ {M_ZPX,O_NOP},  {M_ZPX,O_CMP}, {M_ZPX,O_DEC},  {M_ZPX,O_DCP},
+   /* d8 */ {M_IMP,O_CLD},  {M_ABY,O_CMP}, {M_IMP,O_NOP},  {M_ABY,O_DCP},
+   /* dc */ {M_ABX,O_NOP},  {M_ABX,O_CMP}, {M_ABX,O_DEC},  {M_ABX,O_DCP},
+   /* e0 */ {M_IMM,O_CPX},  {M_IZX,O_SBC}, {M_IMM,O_NOP},  {M_IZX,O_ISC},
+   /* e4 */ {M_ZP,O_CPX},   {M_ZP,O_SBC},  {M_ZP,O_INC},   {M_ZP,O_ISC},
+   /* e8 */ {M_IMP,O_INX},  {M_IMM,O_SBC}, {M_IMP,O_NOP},  {M_IMM,O_SBC},
+   /* ec */ {M_ABS,O_CPX},  {M_ABS,O_SBC}, {M_ABS,O_INC},  {M_ABS,O_ISC},
+   /* f0 */ {M_REL,O_BEQ},  {M_IZY,O_SBC}, {M_JAM,O_NONE}, {M_IZY,O_ISC},
+   /* f4 */ {M_ZPX,O_NOP},  {M_ZPX,O_SBC}, {M_ZPX,O_INC},  {M_ZPX,O_ISC},
+   /* f8 */ {M_IMP,O_SED},  {M_ABY,O_SBC}, {M_IMP,O_NOP},  {M_ABY,O_ISC},
+   /* fc */ {M_ABX,O_NOP},  {M_ABX,O_SBC}, {M_ABX,O_INC},  {M_ABX,O_ISC},
+};
+
+// Magic constant for ANE and LXA. Varies between chips, this is what
+// most C64s (and VICE) use.
+#define ANE_MAGIC 0xee
+
+// Cycle numbers for the shared effective address tail
+#define T_READ 100
+#define T_WRITE 110
+#define T_RMW 120
+
+#define INTR_IRQ 1
+#define INTR_NMI 2
+
+#define RD(a) do { cpu->addr = (a); cpu->rw = true; } while (0)
+#define WR(a, v) do { cpu->addr = (a); cpu->dout = (v); cpu->rw = false; } \
+   while (0)
+
+static inline void setNZ(struct cpu6510* cpu, uint8_t v) {
+   cpu->p = (cpu->p & ~(CPU_FLAG_N | CPU_FLAG_Z)) |
+      (v & CPU_FLAG_N) | (v ? 0 : CPU_FLAG_Z);
+}
+
+static inline void setFlag(struct cpu6510* cpu, uint8_t flag, bool on) {
+   if (on)
+      cpu->p |= flag;
+   else
+      cpu->p &= ~flag;
+}
+
+static void compare(struct cpu6510* cpu, uint8_t reg, uint8_t v) {
+   setFlag(cpu, CPU_FLAG_C, reg >= v);
+   setNZ(cpu, reg - v);
+}
+
+// NMOS decimal mode included. N, V and Z come from the binary result
+// the way the 6510 computes them.
+static void adc(struct cpu6510* cpu, uint8_t v) {
+   unsigned int c = cpu->p & CPU_FLAG_C;
+   unsigned int bin = cpu->a + v + c;
+   if (!(cpu->p & CPU_FLAG_D)) {
+      setFlag(cpu, CPU_FLAG_C, bin > 0xff);
+      setFlag(cpu, CPU_FLAG_V, ~(cpu->a ^ v) & (cpu->a ^ bin) & 0x80);
+      cpu->a = bin;
+      setNZ(cpu, cpu->a);
+      return;
+   }
+
+   unsigned int lo = (cpu->a & 0x0f) + (v & 0x0f) + c;
+   if (lo > 9)
+      lo += 6;
+   unsigned int r;
+   if (lo <= 0x0f)
+      r = (lo & 0x0f) + (cpu->a & 0xf0) + (v & 0xf0);
+   else
+      r = (lo & 0x0f) + (cpu->a & 0xf0) + (v & 0xf0) + 0x10;
+   setFlag(cpu, CPU_FLAG_Z, !(bin & 0xff));
+   setFlag(cpu, CPU_FLAG_N, r & 0x80);
+   setFlag(cpu, CPU_FLAG_V, ((cpu->a ^ r) & 0x80) && !((cpu->a ^ v) & 0x80));
+   if ((r & 0x1f0) > 0x90)
+      r += 0x60;
+   setFlag(cpu, CPU_FLAG_C, (r & 0xff0) > 0xf0);
+   cpu->a = r;
+}
+
+static void sbc(struct cpu6510* cpu, uint8_t v) {
+   unsigned int borrow = (cpu->p & CPU_FLAG_C) ? 0 : 1;
+   unsigned int bin = cpu->a - v - borrow;
+   if (!(cpu->p & CPU_FLAG_D)) {
+      setFlag(cpu, CPU_FLAG_C, bin < 0x100);
+      setFlag(cpu, CPU_FLAG_V, (cpu->a ^ v) & (cpu->a ^ bin) & 0x80);
+      cpu->a = bin;
+      setNZ(cpu, cpu->a);
+      return;
+   }
+
+   unsigned int r = (cpu->a & 0x0f) - (v & 0x0f) - borrow;
+   if (r & 0x10)
+      r = ((r - 6) & 0x0f) | ((cpu->a & 0xf0) - (v & 0xf0) - 0x10);
+   else
+      r = (r & 0x0f) | ((cpu->a & 0xf0) - (v & 0xf0));
+   if (r & 0x100)
+      r -= 0x60;
+   setFlag(cpu, CPU_FLAG_C, bin < 0x100);
+   setFlag(cpu, CPU_FLAG_V, (cpu->a ^ v) & (cpu->a ^ bin) & 0x80);
+   setNZ(cpu, bin);
+   cpu->a = r;
+}
+
+static void arr(struct cpu6510* cpu, uint8_t v) {
+   uint8_t t = cpu->a & v;
+   uint8_t r = (t >> 1) | ((cpu->p & CPU_FLAG_C) << 7);
+   if (!(cpu->p & CPU_FLAG_D)) {
+      cpu->a = r;
+      setNZ(cpu, r);
+      setFlag(cpu, CPU_FLAG_C, r & 0x40);
+      setFlag(cpu, CPU_FLAG_V, ((r >> 6) ^ (r >> 5)) & 1);
+      return;
+   }
+
+   setFlag(cpu, CPU_FLAG_N, cpu->p & CPU_FLAG_C);
+   setFlag(cpu, CPU_FLAG_Z, !r);
+   setFlag(cpu, CPU_FLAG_V, (t ^ r) & 0x40);
+   if ((t & 0x0f) + (t & 0x01) > 5)
+      r = (r & 0xf0) | ((r + 6) & 0x0f);
+   bool c = (t >> 4) + ((t >> 4) & 0x01) > 5;
+   if (c)
+      r += 0x60;
+   setFlag(cpu, CPU_FLAG_C, c);
+   cpu->a = r;
+}
+
+static void execRead(struct cpu6510* cpu, int op, uint8_t v) {
+   switch (op) {
+      case O_LDA: cpu->a = v; setNZ(cpu, v); break;
+      case O_LDX: cpu->x = v; setNZ(cpu, v); break;
+      case O_LDY: cpu->y = v; setNZ(cpu, v); break;
+      case O_LAX: cpu->a = cpu->x = v; setNZ(cpu, v); break;
+      case O_ORA: cpu->a |= v; setNZ(cpu, cpu->a); break;
+      case O_AND: cpu->a &= v; setNZ(cpu, cpu->a); break;
+      case O_EOR: cpu->a ^= v; setNZ(cpu, cpu->a); break;
+      case O_ADC: adc(cpu, v); break;
+      case O_SBC: sbc(cpu, v); break;
+      case O_CMP: compare(cpu, cpu->a, v); break;
+      case O_CPX: compare(cpu, cpu->x, v); break;
+      case O_CPY: compare(cpu, cpu->y, v); break;
+      case O_BIT:
+         setFlag(cpu, CPU_FLAG_Z, !(cpu->a & v));
+         setFlag(cpu, CPU_FLAG_N, v & 0x80);
+         setFlag(cpu, CPU_FLAG_V, v & 0x40);
+         break;
+      case O_ANC:
+         cpu->a &= v;
+         setNZ(cpu, cpu->a);
+         setFlag(cpu, CPU_FLAG_C, cpu->a & 0x80);
+         break;
+      case O_ALR:
+         cpu->a &= v;
+         setFlag(cpu, CPU_FLAG_C, cpu->a & 1);
+         cpu->a >>= 1;
+         setNZ(cpu, cpu->a);
+         break;
+      case O_ARR: arr(cpu, v); break;
+      case O_SBX: {
+         uint8_t ax = cpu->a & cpu->x;
+         setFlag(cpu, CPU_FLAG_C, ax >= v);
+         cpu->x = ax - v;
+         setNZ(cpu, cpu->x);
+         break;
+      }
+      case O_LAS:
+         cpu->a = cpu->x = cpu->s = v & cpu->s;
+         setNZ(cpu, cpu->a);
+         break;
+      case O_ANE:
+         cpu->a = (cpu->a | ANE_MAGIC) & cpu->x & v;
+         setNZ(cpu, cpu->a);
+         break;
+      case O_LXA:
+         cpu->a = cpu->x = (cpu->a | ANE_MAGIC) & v;
+         setNZ(cpu, cpu->a);
+         break;
+      default:
+         break;
+   }
+}
+
+static uint8_t execRMW(struct cpu6510* cpu, int op, uint8_t v) {
+   switch (op) {
+      case O_ASL:
+      case O_SLO:
+         setFlag(cpu, CPU_FLAG_C, v & 0x80);
+         v <<= 1;
+         break;
+      case O_LSR:
+      case O_SRE:
+         setFlag(cpu, CPU_FLAG_C, v & 0x01);
+         v >>= 1;
+         break;
+      case O_ROL:
+      case O_RLA: {
+         uint8_t c = cpu->p & CPU_FLAG_C;
+         setFlag(cpu, CPU_FLAG_C, v & 0x80);
+         v = (v << 1) | c;
+         break;
+      }
+      case O_ROR:
+      case O_RRA: {
+         uint8_t c = cpu->p & CPU_FLAG_C;
+         setFlag(cpu, CPU_FLAG_C, v & 0x01);
+         v = (v >> 1) | (c << 7);
+         break;
+      }
+      case O_INC:
+      case O_ISC:
+         v++;
+         break;
+      case O_DEC:
+      case O_DCP:
+         v--;
+         break;
+      default:
+         break;
+   }
+
+   switch (op) {
+      case O_SLO: cpu->a |= v; setNZ(cpu, cpu->a); break;
+      case O_RLA: cpu->a &= v; setNZ(cpu, cpu->a); break;
+      case O_SRE: cpu->a ^= v; setNZ(cpu, cpu->a); break;
+      case O_RRA: adc(cpu, v); break;
+      case O_DCP: compare(cpu, cpu->a, v); break;
+      case O_ISC: sbc(cpu, v); break;
+      default: setNZ(cpu, v); break;
+   }
+   return v;
+}
+
+static void execImplied(struct cpu6510* cpu, int op) {
+   switch (op) {
+      case O_TAX: cpu->x = cpu->a; setNZ(cpu, cpu->x); break;
+      case O_TAY: cpu->y = cpu->a; setNZ(cpu, cpu->y); break;
+      case O_TXA: cpu->a = cpu->x; setNZ(cpu, cpu->a); break;
+      case O_TYA: cpu->a = cpu->y; setNZ(cpu, cpu->a); break;
+      case O_TSX: cpu->x = cpu->s; setNZ(cpu, cpu->x); break;
+      case O_TXS: cpu->s = cpu->x; break;
+      case O_INX: cpu->x++; setNZ(cpu, cpu->x); break;
+      case O_INY: cpu->y++; setNZ(cpu, cpu->y); break;
+      case O_DEX: cpu->x--; setNZ(cpu, cpu->x); break;
+      case O_DEY: cpu->y--; setNZ(cpu, cpu->y); break;
+      case O_CLC: cpu->p &= ~CPU_FLAG_C; break;
+      case O_SEC: cpu->p |= CPU_FLAG_C; break;
+      case O_CLI: cpu->p &= ~CPU_FLAG_I; break;
+      case O_SEI: cpu->p |= CPU_FLAG_I; break;
+      case O_CLV: cpu->p &= ~CPU_FLAG_V; break;
+      case O_CLD: cpu->p &= ~CPU_FLAG_D; break;
+      case O_SED: cpu->p |= CPU_FLAG_D; break;
+      default:
+         if (IS_RMW(op))
+            cpu->a = execRMW(cpu, op, cpu->a);
+         break;
+   }
+}
+
+// What a write instruction stores. The SH* and TAS quirk: the value is
+// ANDed with the base address' high byte + 1, and when indexing crossed
+// a page that value also becomes the high byte of the address.
+static uint8_t storeValue(struct cpu6510* cpu, int op) {
+   uint8_t h = cpu->baseHi + 1;
+   switch (op) {
+      case O_STA: return cpu->a;
+      case O_STX: return cpu->x;
+      case O_STY: return cpu->y;
+      case O_SAX: return cpu->a & cpu->x;
+      case O_SHA: return cpu->a & cpu->x & h;
+      case O_SHX: return cpu->x & h;
+      case O_SHY: return cpu->y & h;
+      case O_TAS: cpu->s = cpu->a & cpu->x; return cpu->s & h;
+      default: return 0;
+   }
+}
+
+static bool branchTaken(struct cpu6510* cpu, int op) {
+   static const uint8_t flags[] = {
+      CPU_FLAG_N, CPU_FLAG_V, CPU_FLAG_C, CPU_FLAG_Z
+   };
+   int n = op - O_BPL;
+   bool set = (cpu->p & flags[n >> 1]) != 0;
+   return (n & 1) ? set : !set;
+}
+
+// Last cycle of an instruction: fetch the next opcode, or throw it away
+// and start an interrupt sequence if one was seen in time.
+static void fetch(struct cpu6510* cpu) {
+   cpu->t = 0;
+   cpu->intr = 0;
+   if (cpu->pollPrev)
+      cpu->intr = cpu->nmiPending ? INTR_NMI : INTR_IRQ;
+   RD(cpu->pc);
+}
+
+// Addressing is done, ea is final. Set up the access(es) that use it.
+static void useEA(struct cpu6510* cpu, int op) {
+   if (IS_WRITE(op)) {
+      uint8_t v = storeValue(cpu, op);
+      if (cpu->crossed && op >= O_SHA)
+         cpu->ea = (v << 8) | (cpu->ea & 0xff);
+      WR(cpu->ea, v);
+      cpu->t = T_WRITE;
+   } else {
+      RD(cpu->ea);
+      cpu->t = IS_RMW(op) ? T_RMW : T_READ;
+   }
+}
+
+// Indexed read of (baseHi, lo + index). Reads are done in this cycle
+// unless a page was crossed; everything else does a dummy read here.
+static void indexed(struct cpu6510* cpu, uint8_t lo, uint8_t index) {
+   unsigned int sum = lo + index;
+   cpu->crossed = sum > 0xff;
+   cpu->ea = (cpu->baseHi << 8) | (sum & 0xff);
+   RD(cpu->ea);
+}
+
+static void indexedDone(struct cpu6510* cpu, int op, uint8_t data) {
+   if (!cpu->crossed && !IS_WRITE(op) && !IS_RMW(op)) {
+      execRead(cpu, op, data);
+      fetch(cpu);
+      return;
+   }
+   if (cpu->crossed)
+      cpu->ea += 0x100;
+   useEA(cpu, op);
+}
+
+void cpu_reset(struct cpu6510* cpu, uint16_t pc) {
+   memset(cpu, 0, sizeof(struct cpu6510));
+   cpu->pc = pc;
+   cpu->s = 0xfd;
+   cpu->p = CPU_FLAG_U | CPU_FLAG_I;
+   RD(pc);
+}
+
+void cpu_tick(struct cpu6510* cpu, uint8_t data) {
+   cpu->cycles++;
+
+   // What the interrupt lines look like at the end of this cycle
+   if (cpu->nmi && !cpu->nmiPrev)
+      cpu->nmiPending = true;
+   cpu->nmiPrev = cpu->nmi;
+   if (!cpu->holdPoll)
+      cpu->pollPrev = cpu->pollCur;
+   cpu->holdPoll = false;
+   cpu->pollCur = cpu->nmiPending || (cpu->irq && !(cpu->p & CPU_FLAG_I));
+
+   if (cpu->jammed)
+      return;
+
+   if (cpu->t == 0) {
+      // Interrupts run the BRK sequence over the opcode just fetched
+      if (cpu->intr) {
+         cpu->ir = 0x00;
+      } else {
+         cpu->ir = data;
+         cpu->pc++;
+      }
+      cpu->crossed = false;
+   }
+
+   int mode = opTable[cpu->ir][0];
+   int op = opTable[cpu->ir][1];
+   int t = cpu->t++;
+
+   // The tail shared by every mode that computes an address
+   switch (t) {
+      case T_READ:
+         execRead(cpu, op, data);
+         fetch(cpu);
+         return;
+      case T_WRITE:
+         fetch(cpu);
+         return;
+      case T_RMW:
+         cpu->val = data;
+         WR(cpu->ea, cpu->val);
+         return;
+      case T_RMW + 1:
+         cpu->val = execRMW(cpu, op, cpu->val);
+         WR(cpu->ea, cpu->val);
+         return;
+      case T_RMW + 2:
+         fetch(cpu);
+         return;
+      default:
+         break;
+   }
+
+   switch (mode) {
+      case M_IMP:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else {
+            execImplied(cpu, op);
+            fetch(cpu);
+         }
+         break;
+
+      case M_IMM:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else {
+            cpu->pc++;
+            execRead(cpu, op, data);
+            fetch(cpu);
+         }
+         break;
+
+      case M_ZP:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else {
+            cpu->ea = data;
+            cpu->pc++;
+            useEA(cpu, op);
+         }
+         break;
+
+      case M_ZPX:
+      case M_ZPY:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else if (t == 1) {
+            cpu->ea = data;
+            cpu->pc++;
+            RD(cpu->ea);
+         } else {
+            cpu->ea = (cpu->ea + (mode == M_ZPX ? cpu->x : cpu->y)) & 0xff;
+            useEA(cpu, op);
+         }
+         break;
+
+      case M_ABS:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else if (t == 1) {
+            cpu->ea = data;
+            cpu->pc++;
+            RD(cpu->pc);
+         } else {
+            cpu->ea |= data << 8;
+            cpu->pc++;
+            useEA(cpu, op);
+         }
+         break;
+
+      case M_ABX:
+      case M_ABY:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else if (t == 1) {
+            cpu->ea = data;
+            cpu->pc++;
+            RD(cpu->pc);
+         } else if (t == 2) {
+            cpu->baseHi = data;
+            cpu->pc++;
+            indexed(cpu, cpu->ea, mode == M_ABX ? cpu->x : cpu->y);
+         } else {
+            indexedDone(cpu, op, data);
+         }
+         break;
+
+      case M_IZX:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else if (t == 1) {
+            cpu->ptr = data;
+            cpu->pc++;
+            RD(cpu->ptr);
+         } else if (t == 2) {
+            cpu->ptr += cpu->x;
+            RD(cpu->ptr);
+         } else if (t == 3) {
+            cpu->ea = data;
+            RD((uint8_t) (cpu->ptr + 1));
+         } else {
+            cpu->ea |= data << 8;
+            useEA(cpu, op);
+         }
+         break;
+
+      case M_IZY:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else if (t == 1) {
+            cpu->ptr = data;
+            cpu->pc++;
+            RD(cpu->ptr);
+         } else if (t == 2) {
+            cpu->ea = data;
+            RD((uint8_t) (cpu->ptr + 1));
+         } else if (t == 3) {
+            cpu->baseHi = data;
+            indexed(cpu, cpu->ea, cpu->y);
+         } else {
+            indexedDone(cpu, op, data);
+         }
+         break;
+
+      case M_REL:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else if (t == 1) {
+            cpu->val = data;
+            cpu->pc++;
+            if (!branchTaken(cpu, op)) {
+               fetch(cpu);
+            } else {
+               // A taken branch that stays on its page polls
+               // interrupts before this cycle, not after it
+               cpu->holdPoll = true;
+               RD(cpu->pc);
+            }
+         } else if (t == 2) {
+            uint16_t target = cpu->pc + (int8_t) cpu->val;
+            if ((target ^ cpu->pc) & 0xff00) {
+               cpu->pc = (cpu->pc & 0xff00) | (target & 0xff);
+               cpu->ea = target;
+               RD(cpu->pc);
+            } else {
+               cpu->pc = target;
+               fetch(cpu);
+            }
+         } else {
+            cpu->pc = cpu->ea;
+            fetch(cpu);
+         }
+         break;
+
+      case M_JMP:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else if (t == 1) {
+            cpu->ea = data;
+            cpu->pc++;
+            RD(cpu->pc);
+         } else {
+            cpu->pc = (data << 8) | cpu->ea;
+            fetch(cpu);
+         }
+         break;
+
+      case M_JMPI:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else if (t == 1) {
+            cpu->ea = data;
+            cpu->pc++;
+            RD(cpu->pc);
+         } else if (t == 2) {
+            cpu->ea |= data << 8;
+            cpu->pc++;
+            RD(cpu->ea);
+         } else if (t == 3) {
+            // The pointer's high byte never carries into the next page
+            cpu->val = data;
+            RD((cpu->ea & 0xff00) | ((cpu->ea + 1) & 0xff));
+         } else {
+            cpu->pc = (data << 8) | cpu->val;
+            fetch(cpu);
+         }
+         break;
+
+      case M_JSR:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else if (t == 1) {
+            cpu->ea = data;
+            cpu->pc++;
+            RD(0x100 | cpu->s);
+         } else if (t == 2) {
+            WR(0x100 | cpu->s, cpu->pc >> 8);
+            cpu->s--;
+         } else if (t == 3) {
+            WR(0x100 | cpu->s, cpu->pc & 0xff);
+            cpu->s--;
+         } else if (t == 4) {
+            RD(cpu->pc);
+         } else {
+            cpu->pc = (data << 8) | cpu->ea;
+            fetch(cpu);
+         }
+         break;
+
+      case M_RTS:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else if (t == 1) {
+            RD(0x100 | cpu->s);
+         } else if (t == 2) {
+            cpu->s++;
+            RD(0x100 | cpu->s);
+         } else if (t == 3) {
+            cpu->ea = data;
+            cpu->s++;
+            RD(0x100 | cpu->s);
+         } else if (t == 4) {
+            cpu->pc = (data << 8) | cpu->ea;
+            RD(cpu->pc);
+         } else {
+            cpu->pc++;
+            fetch(cpu);
+         }
+         break;
+
+      case M_RTI:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else if (t == 1) {
+            RD(0x100 | cpu->s);
+         } else if (t == 2) {
+            cpu->s++;
+            RD(0x100 | cpu->s);
+         } else if (t == 3) {
+            cpu->p = (data & ~CPU_FLAG_B) | CPU_FLAG_U;
+            cpu->s++;
+            RD(0x100 | cpu->s);
+         } else if (t == 4) {
+            cpu->ea = data;
+            cpu->s++;
+            RD(0x100 | cpu->s);
+         } else {
+            cpu->pc = (data << 8) | cpu->ea;
+            fetch(cpu);
+         }
+         break;
+
+      case M_BRK:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else if (t == 1) {
+            if (!cpu->intr)
+               cpu->pc++;
+            WR(0x100 | cpu->s, cpu->pc >> 8);
+            cpu->s--;
+         } else if (t == 2) {
+            WR(0x100 | cpu->s, cpu->pc & 0xff);
+            cpu->s--;
+         } else if (t == 3) {
+            WR(0x100 | cpu->s,
+               cpu->p | CPU_FLAG_U | (cpu->intr ? 0 : CPU_FLAG_B));
+            cpu->s--;
+            // An NMI arriving by now takes over the vector
+            if (cpu->nmiPending) {
+               cpu->nmiPending = false;
+               cpu->ea = 0xfffa;
+            } else {
+               cpu->ea = 0xfffe;
+            }
+         } else if (t == 4) {
+            cpu->p |= CPU_FLAG_I;
+            RD(cpu->ea);
+         } else if (t == 5) {
+            cpu->val = data;
+            RD(cpu->ea + 1);
+         } else {
+            cpu->pc = (data << 8) | cpu->val;
+            fetch(cpu);
+         }
+         break;
+
+      case M_PUSH:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else if (t == 1) {
+            WR(0x100 | cpu->s, op == O_PHA ? cpu->a :
+               cpu->p | CPU_FLAG_B | CPU_FLAG_U);
+            cpu->s--;
+         } else {
+            fetch(cpu);
+         }
+         break;
+
+      case M_PULL:
+         if (t == 0) {
+            RD(cpu->pc);
+         } else if (t == 1) {
+            RD(0x100 | cpu->s);
+         } else if (t == 2) {
+            cpu->s++;
+            RD(0x100 | cpu->s);
+         } else {
+            if (op == O_PLA) {
+               cpu->a = data;
+               setNZ(cpu, data);
+            } else {
+               cpu->p = (data & ~CPU_FLAG_B) | CPU_FLAG_U;
+            }
+            fetch(cpu);
+         }
+         break;
+
+      case M_JAM:
+         // Stuck with the address bus at $ffff until reset
+         cpu->jammed = true;
+         RD(0xffff);
+         break;
+   }
+}
@@ -0,0 +1,93 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef VICII_CPU6510_H
+#define VICII_CPU6510_H
+
+#include <stdint.h>
+
+// A cycle stepped NMOS 6502 (the 6510's core, the I/O port at $00/$01
+// belongs to the memory map). Every cycle is exactly one bus access,
+// dummy reads included, so it can share the bus with the VIC:
+//
+//    cpu->addr, cpu->rw and cpu->dout describe this cycle's access.
+//    Perform it, then call cpu_tick() with the byte read (ignored for
+//    a write) to get the next cycle's access.
+//
+// RDY is up to the caller. When BA is low on a read cycle, don't
+// perform the access and don't tick; the same read is repeated later.
+// Writes never wait. Undocumented opcodes are supported, the unstable
+// ones (SHA, SHX, SHY, TAS, ANE, LXA) as they behave on most C64s.
+
+#define CPU_FLAG_C 0x01
+#define CPU_FLAG_Z 0x02
+#define CPU_FLAG_I 0x04
+#define CPU_FLAG_D 0x08
+#define CPU_FLAG_B 0x10
+#define CPU_FLAG_U 0x20
+#define CPU_FLAG_V 0x40
+#define CPU_FLAG_N 0x80
+
+struct cpu6510 {
+   uint16_t pc;
+   uint8_t a;
+   uint8_t x;
+   uint8_t y;
+   uint8_t s;
+   uint8_t p;
+
+   // This cycle's bus access
+   uint16_t addr;
+   uint8_t dout;
+   bool rw;  // true for a read
+
+   // Interrupt inputs, true while asserted. NMI is edge triggered.
+   bool irq;
+   bool nmi;
+
+   bool jammed;  // hit a JAM opcode, only reset gets out
+   uint64_t cycles;
+
+   // Where we are in the current instruction
+   uint8_t ir;
+   int t;
+   int intr;
+   uint16_t ea;
+   uint8_t ptr;
+   uint8_t val;
+   uint8_t baseHi;
+   bool crossed;
+
+   // Interrupt polling. An interrupt is taken after the instruction
+   // whose second to last cycle saw it.
+   bool pollPrev;
+   bool pollCur;
+   bool holdPoll;
+   bool nmiPrev;
+   bool nmiPending;
+};
+
+// Start fetching at pc with the state the reset sequence leaves
+void cpu_reset(struct cpu6510* cpu, uint16_t pc);
+
+void cpu_tick(struct cpu6510* cpu, uint8_t data);
+
+// True when the access set up by the last tick is an opcode fetch
+static inline bool cpu_fetching(struct cpu6510* cpu) {
+   return cpu->t == 0 && !cpu->intr && !cpu->jammed;
+}
+
+#endif
@@ -0,0 +1,155 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diverge.h"
+#include "log.h"
+
+struct diverge* diverge_init(int context, const char* filename) {
+   if (context < 0) {
+      LOG(LOG_ERROR, "divergence context can't be negative");
+      return NULL;
+   }
+
+   struct diverge* dv = (struct diverge*) malloc(sizeof(struct diverge));
+   dv->context = context;
+   dv->filename = filename;
+   dv->size = context * 2 + 1;
+   dv->pos = 0;
+   dv->count = 0;
+   dv->found = false;
+   dv->done = false;
+   dv->after = 0;
+   dv->firstStep = 0;
+   dv->frame = 0;
+   dv->lastLine = -1;
+   dv->ring = (struct diverge_entry*)
+      calloc(dv->size, sizeof(struct diverge_entry));
+   if (!dv->ring) {
+      LOG(LOG_ERROR, "can't allocate divergence window");
+      free(dv);
+      return NULL;
+   }
+   return dv;
+}
+
+void diverge_free(struct diverge* dv) {
+   free(dv->ring);
+   free(dv);
+}
+
+static void logFirst(struct diverge* dv, const struct busrec* ref,
+                     const struct vicii_state* state) {
+   const struct busrec_out* exp = &ref->expected;
+   const struct busrec_out* act = &ref->actual;
+
+   LOG(LOG_ERROR, "first divergence at step %llu frame %d line %03x "
+       "cycle %d xpos %03x", (unsigned long long) dv->firstStep,
+       dv->frame, act->raster_line, act->cycle_num, act->xpos);
+   logField("irq", exp->irq, act->irq);
+   logField("ba", exp->ba, act->ba);
+   logField("aec", exp->aec, act->aec);
+   logField("addr", exp->addr_from_sim, act->addr_from_sim);
+   logField("data", exp->data_from_sim, act->data_from_sim);
+   logField("raster_line", exp->raster_line, act->raster_line);
+   logField("cycle_num", exp->cycle_num, act->cycle_num);
+   logField("xpos", exp->xpos, act->xpos);
+   for (int r = 0; r < 64; r++) {
+      if (ref->expectedRegs[r] != state->fpga_reg[r])
+         LOG(LOG_ERROR, "   reg $d0%02x   expected %02x got %02x", r,
+             ref->expectedRegs[r], state->fpga_reg[r]);
+   }
+}
+
+static void printOut(FILE* fp, const char* label,
+                     const struct busrec_out* o) {
+   fprintf(fp, "   %s line %03x cycle %02d xpos %03x irq %d ba %d aec %d "
+           "addr %04x data %03x\n", label, o->raster_line, o->cycle_num,
+           o->xpos, o->irq, o->ba, o->aec, o->addr_from_sim,
+           o->data_from_sim);
+}
+
+int diverge_finish(struct diverge* dv) {
+   if (!dv->found || dv->done)
+      return 0;
+   dv->done = true;
+
+   FILE* fp = fopen(dv->filename, "w");
+   if (!fp) {
+      LOG(LOG_ERROR, "can't write %s", dv->filename);
+      return 1;
+   }
+
+   int first = (dv->pos - dv->count + dv->size) % dv->size;
+   for (int k = 0; k < dv->count; k++) {
+      const struct diverge_entry* e = &dv->ring[(first + k) % dv->size];
+      fprintf(fp, "%c step %llu frame %d\n",
+              e->step == dv->firstStep ? '>' : (e->bad ? '!' : ' '),
+              (unsigned long long) e->step, e->frame);
+      printOut(fp, "expected", &e->expected);
+      if (e->bad)
+         printOut(fp, "actual  ", &e->actual);
+   }
+   fclose(fp);
+   printf ("divergence: %d steps around step %llu written to %s\n",
+           dv->count, (unsigned long long) dv->firstStep, dv->filename);
+   return 0;
+}
+
+bool diverge_step(struct diverge* dv, const struct busrec* ref,
+                  const struct vicii_state* state, bool bad) {
+   if (dv->done)
+      return true;
+
+   if (ref->actual.raster_line < dv->lastLine)
+      dv->frame++;
+   dv->lastLine = ref->actual.raster_line;
+
+   // Until the first divergence only the last 'context' steps are
+   // kept, so the window starts out that far behind it.
+   struct diverge_entry* e = &dv->ring[dv->pos];
+   if (++dv->pos == dv->size)
+      dv->pos = 0;
+   if (dv->count < dv->size)
+      dv->count++;
+   e->step = ref->steps - 1;
+   e->frame = dv->frame;
+   e->bad = bad;
+   e->expected = ref->expected;
+   e->actual = ref->actual;
+
+   if (!dv->found) {
+      if (!bad) {
+         if (dv->count > dv->context)
+            dv->count = dv->context;
+         return false;
+      }
+      dv->found = true;
+      dv->firstStep = e->step;
+      dv->after = dv->context;
+      logFirst(dv, ref, state);
+   } else {
+      dv->after--;
+   }
+
+   if (dv->after > 0)
+      return false;
+   diverge_finish(dv);
+   return true;
+}
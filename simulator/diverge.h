@@ -0,0 +1,66 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef VICII_DIVERGE_H
+#define VICII_DIVERGE_H
+
+#include <stdint.h>
+
+#include "busrec.h"
+
+// First divergence reporter. Fed one step at a time while a session is
+// checked against a bus recording (--replay or --compare). The first
+// step whose answer differs is logged field by field, with where the
+// model was, and a window of steps around it is written to a file.
+
+struct diverge_entry {
+   uint64_t step;
+   int frame;
+   bool bad;
+   struct busrec_out expected;
+   struct busrec_out actual;
+};
+
+struct diverge {
+   int context;          // steps kept before and written after
+   const char* filename;
+   struct diverge_entry* ring;  // context before + 1 + context after
+   int size;
+   int pos;
+   int count;
+   bool found;
+   bool done;
+   int after;            // steps still to collect after the first one
+   uint64_t firstStep;
+   int frame;            // counted from raster line wrapping
+   int lastLine;
+};
+
+// Returns NULL on error
+struct diverge* diverge_init(int context, const char* filename);
+
+// Call after busrec_check_out() with its result. Returns true once the
+// report is complete (the divergence and the steps after it).
+bool diverge_step(struct diverge* dv, const struct busrec* ref,
+                  const struct vicii_state* state, bool bad);
+
+// Write whatever was collected if the run ended early. Returns 1 on
+// error.
+int diverge_finish(struct diverge* dv);
+
+void diverge_free(struct diverge* dv);
+
+#endif
@@ -0,0 +1,66 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "edges.h"
+#include "log.h"
+
+#define COL16X_UNITS 4
+
+void edges_init(struct edge_schedule* es, uint64_t psPerDot4x,
+                int col16xPer4Dot4x, const int* dviScale,
+                unsigned char domains) {
+   es->psPerDot4x = psPerDot4x;
+   es->unitsPerDot4x = col16xPer4Dot4x;
+   es->period = EDGE_PERIOD_DOT4X * es->unitsPerDot4x;
+   es->numEdges = 0;
+   es->pos = 0;
+   es->base = 0;
+
+   // Time 0 is the state we start in so the first edge is at unit 1
+   // and the last one lands on the period boundary.
+   for (unsigned int u = 1; u <= es->period; u++) {
+      unsigned char mask = 0;
+      if (u % es->unitsPerDot4x == 0) {
+         mask |= EDGE_DOT4X | EDGE_COL4X;
+         if (dviScale && dviScale[u / es->unitsPerDot4x - 1])
+            mask |= EDGE_DVI;
+      }
+      if (u % COL16X_UNITS == 0)
+         mask |= EDGE_COL16X;
+      mask &= domains | EDGE_DOT4X;
+      if (!mask) continue;
+
+      if (es->numEdges == EDGE_MAX) {
+         LOG(LOG_ERROR, "edge schedule overflow");
+         exit(-1);
+      }
+      es->edges[es->numEdges].offset = u;
+      es->edges[es->numEdges].mask = mask;
+      es->numEdges++;
+   }
+}
+
+void edges_seek(struct edge_schedule* es, uint64_t units) {
+   es->base = units / es->period * es->period;
+   es->pos = 0;
+   // The last edge is always on the period boundary so this stops
+   // inside the table.
+   while (es->edges[es->pos].offset <= units - es->base)
+      es->pos++;
+}
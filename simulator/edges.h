@@ -0,0 +1,91 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef VICII_EDGES_H
+#define VICII_EDGES_H
+
+#include <stdint.h>
+
+// Precomputed clock edge timeline.
+//
+// All clocks we drive are exact rational multiples of the dot4x clock
+// so we measure time in integer 'units' where a dot4x half period is
+// R units and a col16x half period is 4 units (R = number of col16x
+// half periods in 4 dot4x half periods, see constants.h). The pattern
+// repeats every EDGE_PERIOD_DOT4X dot4x half periods, which also
+// covers the 16 entry dvi tick scale tables. Edges that land on the
+// same unit are merged so the caller evaluates the model once per
+// distinct timestamp. Timestamps are computed from the absolute unit
+// count so they never drift.
+//
+// Clock domains whose outputs nobody looks at can be left out of the
+// schedule entirely. Edges that only toggle such clocks are dropped,
+// which saves the model evaluations that went with them.
+
+#define EDGE_DOT4X  1
+#define EDGE_COL4X  2
+#define EDGE_COL16X 4
+#define EDGE_DVI    8
+
+#define EDGE_PERIOD_DOT4X 16
+#define EDGE_MAX 64
+
+struct edge {
+   unsigned int offset;  // units from start of period, 1..period
+   unsigned char mask;   // which clocks toggle
+};
+
+struct edge_schedule {
+   uint64_t psPerDot4x;  // half period of dot4x in ticks (ps)
+   unsigned int unitsPerDot4x;
+   unsigned int period;  // units per repeat of the pattern
+   int numEdges;
+   struct edge edges[EDGE_MAX];
+
+   int pos;              // next edge to hand out
+   uint64_t base;        // units at start of current period
+};
+
+// col16xPer4Dot4x is 9 for PAL and 7 for NTSC. dviScale is a 16 entry
+// table saying which dot4x edges also toggle the dvi clock, or NULL
+// when there is no dvi clock to drive. domains is a mask of EDGE_*
+// clocks to drive; dot4x is always driven.
+void edges_init(struct edge_schedule* es, uint64_t psPerDot4x,
+                int col16xPer4Dot4x, const int* dviScale,
+                unsigned char domains);
+
+// Returns the clocks toggling at the next edge and its time in ticks.
+static inline unsigned char edges_next(struct edge_schedule* es,
+                                       uint64_t* ticks) {
+   struct edge* e = &es->edges[es->pos];
+   *ticks = (es->base + e->offset) * es->psPerDot4x / es->unitsPerDot4x;
+   if (++es->pos == es->numEdges) {
+      es->pos = 0;
+      es->base += es->period;
+   }
+   return e->mask;
+}
+
+// Units up to and including the last edge handed out
+static inline uint64_t edges_now(struct edge_schedule* es) {
+   return es->pos == 0 ? es->base : es->base + es->edges[es->pos - 1].offset;
+}
+
+// Continue from a time previously returned by edges_now(), possibly
+// with a schedule built for different clock domains.
+void edges_seek(struct edge_schedule* es, uint64_t units);
+
+#endif
@@ -0,0 +1,181 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "flightrec.h"
+#include "log.h"
+
+struct flightrec* flightrec_init(int cycles) {
+   if (cycles <= 0) {
+      LOG(LOG_ERROR, "flight recorder needs at least 1 cycle");
+      return NULL;
+   }
+
+   struct flightrec* fr =
+      (struct flightrec*) malloc(sizeof(struct flightrec));
+   fr->size = cycles * FLIGHTREC_TICKS_PER_CYCLE;
+   fr->pos = 0;
+   fr->count = 0;
+   fr->buf = (struct tick_record*)
+      calloc(fr->size, sizeof(struct tick_record));
+   if (!fr->buf) {
+      LOG(LOG_ERROR, "can't allocate flight recorder");
+      free(fr);
+      return NULL;
+   }
+   return fr;
+}
+
+void flightrec_free(struct flightrec* fr) {
+   free(fr->buf);
+   free(fr);
+}
+
+// Signals written to the vcd. Flags become 1 bit wires.
+struct vcd_signal {
+   const char* name;
+   int width;
+};
+
+static const struct vcd_signal vcdSignals[] = {
+   { "rst", 1 },
+   { "dot4x", 1 },
+   { "dotedge", 1 },
+   { "dotr", 1 },
+   { "phi", 1 },
+   { "irq", 1 },
+   { "ba", 1 },
+   { "aec", 1 },
+   { "ras", 1 },
+   { "cas", 1 },
+   { "rw", 1 },
+   { "ce", 1 },
+   { "badline", 1 },
+   { "bmm", 1 },
+   { "cnt", 8 },
+   { "xpos", 16 },
+   { "cycle_num", 8 },
+   { "cycle_bit", 8 },
+   { "cycle_type", 8 },
+   { "raster_x", 16 },
+   { "raster_line", 16 },
+   { "raster_line_d", 16 },
+   { "adl", 8 },
+   { "ado", 16 },
+   { "dbi", 8 },
+   { "dbo", 8 },
+   { "refc", 8 },
+   { "pps", 16 },
+   { "phir", 32 },
+   { "rc", 8 },
+   { "sprite_mc0", 8 },
+   { "sprite_mcbase0", 8 },
+   { "vicaddr", 16 },
+};
+
+#define NUM_VCD_SIGNALS (int)(sizeof(vcdSignals) / sizeof(vcdSignals[0]))
+#define NUM_VCD_FLAGS 14
+
+// Value of vcdSignals[i] in a record
+static uint32_t signalValue(const struct tick_record* r, int i) {
+   if (i < NUM_VCD_FLAGS)
+      return (r->flags >> i) & 1;
+   switch (i) {
+      case 14: return r->cnt;
+      case 15: return r->xpos;
+      case 16: return r->cycle_num;
+      case 17: return r->cycle_bit;
+      case 18: return r->cycle_type;
+      case 19: return r->raster_x;
+      case 20: return r->raster_line;
+      case 21: return r->raster_line_d;
+      case 22: return r->adl;
+      case 23: return r->ado;
+      case 24: return r->dbi;
+      case 25: return r->dbo;
+      case 26: return r->refc;
+      case 27: return r->pps;
+      case 28: return r->phir;
+      case 29: return r->rc;
+      case 30: return r->sprite_mc0;
+      case 31: return r->sprite_mcbase0;
+      case 32: return r->vicaddr;
+      default: return 0;
+   }
+}
+
+static void writeValue(FILE* fp, int i, uint32_t v) {
+   if (vcdSignals[i].width == 1) {
+      fprintf(fp, "%u%c\n", v, '!' + i);
+   } else {
+      fprintf(fp, "b%s %c\n", toBin(vcdSignals[i].width, v), '!' + i);
+   }
+}
+
+int flightrec_dump(struct flightrec* fr, const char* basename) {
+   char filename[256];
+   int n = fr->count < (uint64_t) fr->size ? fr->count : fr->size;
+   int first = fr->count < (uint64_t) fr->size ? 0 : fr->pos;
+
+   snprintf(filename, sizeof(filename), "%s.txt", basename);
+   FILE* txt = fopen(filename, "w");
+   if (!txt) {
+      LOG(LOG_ERROR, "can't write %s", filename);
+      return 1;
+   }
+
+   snprintf(filename, sizeof(filename), "%s.vcd", basename);
+   FILE* vcd = fopen(filename, "w");
+   if (!vcd) {
+      LOG(LOG_ERROR, "can't write %s", filename);
+      fclose(txt);
+      return 1;
+   }
+
+   fprintf(vcd, "$timescale 1ps $end\n");
+   fprintf(vcd, "$scope module flightrec $end\n");
+   for (int i = 0; i < NUM_VCD_SIGNALS; i++) {
+      fprintf(vcd, "$var wire %d %c %s $end\n",
+              vcdSignals[i].width, '!' + i, vcdSignals[i].name);
+   }
+   fprintf(vcd, "$upscope $end\n");
+   fprintf(vcd, "$enddefinitions $end\n");
+
+   const struct tick_record* prev = NULL;
+   for (int k = 0; k < n; k++) {
+      const struct tick_record* r = &fr->buf[(first + k) % fr->size];
+
+      if (r->flags & TR_DOTEDGE)
+         tickrec_print_header(txt);
+      tickrec_print(txt, r);
+
+      fprintf(vcd, "#%llu\n", (unsigned long long) r->ticks);
+      for (int i = 0; i < NUM_VCD_SIGNALS; i++) {
+         uint32_t v = signalValue(r, i);
+         if (!prev || signalValue(prev, i) != v)
+            writeValue(vcd, i, v);
+      }
+      prev = r;
+   }
+
+   fclose(txt);
+   fclose(vcd);
+   printf ("flight recorder: %d ticks written to %s.txt and %s.vcd\n",
+           n, basename, basename);
+   return 0;
+}
@@ -0,0 +1,56 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef VICII_FLIGHTREC_H
+#define VICII_FLIGHTREC_H
+
+#include <stdint.h>
+
+#include "tickrec.h"
+
+// Flight recorder. Keeps the last N tick records (the STATE() fields)
+// in memory so a failure can show how we got there without a full
+// trace running. Costs one record copy per dot4x tick.
+
+// dot4x ticks recorded per CPU cycle (rising edges only)
+#define FLIGHTREC_TICKS_PER_CYCLE 32
+
+struct flightrec {
+   int size;
+   int pos;
+   uint64_t count;
+   struct tick_record* buf;
+};
+
+// Returns NULL on error
+struct flightrec* flightrec_init(int cycles);
+
+// For a run that ends without a dump
+void flightrec_free(struct flightrec* fr);
+
+static inline struct tick_record* flightrec_next(struct flightrec* fr) {
+   struct tick_record* r = &fr->buf[fr->pos];
+   if (++fr->pos == fr->size)
+      fr->pos = 0;
+   fr->count++;
+   return r;
+}
+
+// Writes <basename>.txt (STATE columns) and <basename>.vcd, oldest
+// record first. Returns 1 on error.
+int flightrec_dump(struct flightrec* fr, const char* basename);
+
+#endif
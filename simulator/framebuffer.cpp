@@ -0,0 +1,706 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "framebuffer.h"
+#include "log.h"
+
+struct framebuffer* fb_init(int width, int height) {
+   struct framebuffer* fb = (struct framebuffer*)
+      malloc(sizeof(struct framebuffer));
+   fb->width = width;
+   fb->height = height;
+   fb->pixels = (unsigned int*) malloc(width * height * sizeof(unsigned int));
+   fb_clear(fb, ARGB(0,0,0));
+   return fb;
+}
+
+void fb_free(struct framebuffer* fb) {
+   free(fb->pixels);
+   free(fb);
+}
+
+void fb_clear(struct framebuffer* fb, unsigned int argb) {
+   for (int i = 0; i < fb->width * fb->height; i++)
+      fb->pixels[i] = argb;
+}
+
+static const char* extension(const char* filename) {
+   const char* dot = strrchr(filename, '.');
+   return dot ? dot + 1 : "";
+}
+
+int fb_save(struct framebuffer* fb, const char* filename) {
+   const char* ext = extension(filename);
+   if (strcasecmp(ext, "ppm") == 0)
+      return fb_save_ppm(fb, filename);
+   if (strcasecmp(ext, "png") == 0)
+      return fb_save_png(fb, filename);
+   if (strcasecmp(ext, "bmp") == 0)
+      return fb_save_bmp(fb, filename);
+   if (strcasecmp(ext, "raw") == 0)
+      return fb_save_raw(fb, filename);
+   LOG(LOG_ERROR, "don't know how to write '%s' (use ppm, png, bmp or raw)",
+      filename);
+   return 1;
+}
+
+static FILE* open_out(const char* filename) {
+   FILE* fp = fopen(filename, "wb");
+   if (!fp) {
+      LOG(LOG_ERROR, "can't open %s for writing", filename);
+   }
+   return fp;
+}
+
+int fb_save_ppm(struct framebuffer* fb, const char* filename) {
+   FILE* fp = open_out(filename);
+   if (!fp) return 1;
+
+   fprintf(fp, "P6\n%d %d\n255\n", fb->width, fb->height);
+   unsigned char* row = (unsigned char*) malloc(fb->width * 3);
+   for (int y = 0; y < fb->height; y++) {
+      unsigned int* src = &fb->pixels[y * fb->width];
+      for (int x = 0; x < fb->width; x++) {
+         row[x*3]   = (src[x] >> 16) & 0xff;
+         row[x*3+1] = (src[x] >> 8) & 0xff;
+         row[x*3+2] = src[x] & 0xff;
+      }
+      fwrite(row, 1, fb->width * 3, fp);
+   }
+   free(row);
+   fclose(fp);
+   return 0;
+}
+
+int fb_save_raw(struct framebuffer* fb, const char* filename) {
+   FILE* fp = open_out(filename);
+   if (!fp) return 1;
+
+   fwrite(fb->pixels, sizeof(unsigned int), fb->width * fb->height, fp);
+   fclose(fp);
+   return 0;
+}
+
+static void put16le(unsigned char* p, unsigned int v) {
+   p[0] = v & 0xff; p[1] = (v >> 8) & 0xff;
+}
+
+static void put32le(unsigned char* p, unsigned int v) {
+   p[0] = v & 0xff; p[1] = (v >> 8) & 0xff;
+   p[2] = (v >> 16) & 0xff; p[3] = (v >> 24) & 0xff;
+}
+
+static void put32be(unsigned char* p, unsigned int v) {
+   p[0] = (v >> 24) & 0xff; p[1] = (v >> 16) & 0xff;
+   p[2] = (v >> 8) & 0xff; p[3] = v & 0xff;
+}
+
+int fb_save_bmp(struct framebuffer* fb, const char* filename) {
+   FILE* fp = open_out(filename);
+   if (!fp) return 1;
+
+   int stride = (fb->width * 3 + 3) & ~3;
+   unsigned char hdr[54];
+   memset(hdr, 0, sizeof(hdr));
+   hdr[0] = 'B'; hdr[1] = 'M';
+   put32le(&hdr[2], 54 + stride * fb->height); // file size
+   put32le(&hdr[10], 54);                     // pixel data offset
+   put32le(&hdr[14], 40);                     // BITMAPINFOHEADER
+   put32le(&hdr[18], fb->width);
+   put32le(&hdr[22], fb->height);             // positive = bottom up
+   put16le(&hdr[26], 1);                      // planes
+   put16le(&hdr[28], 24);                     // bpp
+   put32le(&hdr[34], stride * fb->height);
+   fwrite(hdr, 1, sizeof(hdr), fp);
+
+   unsigned char* row = (unsigned char*) calloc(stride, 1);
+   for (int y = fb->height - 1; y >= 0; y--) {
+      unsigned int* src = &fb->pixels[y * fb->width];
+      for (int x = 0; x < fb->width; x++) {
+         row[x*3]   = src[x] & 0xff;
+         row[x*3+1] = (src[x] >> 8) & 0xff;
+         row[x*3+2] = (src[x] >> 16) & 0xff;
+      }
+      fwrite(row, 1, stride, fp);
+   }
+   free(row);
+   fclose(fp);
+   return 0;
+}
+
+// PNG support without pulling in zlib. We emit 'stored' deflate
+// blocks so we only need crc32 and adler32. Files are big but these
+// are for regression checks, not for keeping.
+
+struct crc_table {
+   unsigned int v[256];
+};
+
+static struct crc_table makeCrcTable() {
+   struct crc_table t;
+   for (unsigned int n = 0; n < 256; n++) {
+      unsigned int c = n;
+      for (int k = 0; k < 8; k++)
+         c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      t.v[n] = c;
+   }
+   return t;
+}
+
+static unsigned int crc32_update(unsigned int crc,
+                                 const unsigned char* buf, int len) {
+   // Built once even when frames are saved from several threads (-J)
+   static const struct crc_table table = makeCrcTable();
+   for (int n = 0; n < len; n++)
+      crc = table.v[(crc ^ buf[n]) & 0xff] ^ (crc >> 8);
+   return crc;
+}
+
+static void png_chunk(FILE* fp, const char* type,
+                      const unsigned char* data, unsigned int len) {
+   unsigned char b[4];
+   put32be(b, len);
+   fwrite(b, 1, 4, fp);
+   fwrite(type, 1, 4, fp);
+   if (len) fwrite(data, 1, len, fp);
+   unsigned int crc = crc32_update(0xffffffffu, (const unsigned char*)type, 4);
+   crc = crc32_update(crc, data, len);
+   put32be(b, crc ^ 0xffffffffu);
+   fwrite(b, 1, 4, fp);
+}
+
+int fb_save_png(struct framebuffer* fb, const char* filename) {
+   FILE* fp = open_out(filename);
+   if (!fp) return 1;
+
+   static const unsigned char sig[8] = {137,'P','N','G',13,10,26,10};
+   fwrite(sig, 1, 8, fp);
+
+   unsigned char ihdr[13];
+   put32be(&ihdr[0], fb->width);
+   put32be(&ihdr[4], fb->height);
+   ihdr[8] = 8;   // bit depth
+   ihdr[9] = 2;   // truecolor RGB
+   ihdr[10] = 0;  // deflate
+   ihdr[11] = 0;  // adaptive filtering
+   ihdr[12] = 0;  // no interlace
+   png_chunk(fp, "IHDR", ihdr, sizeof(ihdr));
+
+   // Filter byte 0 (none) followed by RGB for each row
+   unsigned int rowLen = 1 + fb->width * 3;
+   unsigned int rawLen = rowLen * fb->height;
+   unsigned char* raw = (unsigned char*) malloc(rawLen);
+   for (int y = 0; y < fb->height; y++) {
+      unsigned char* dst = &raw[y * rowLen];
+      unsigned int* src = &fb->pixels[y * fb->width];
+      *dst++ = 0;
+      for (int x = 0; x < fb->width; x++) {
+         *dst++ = (src[x] >> 16) & 0xff;
+         *dst++ = (src[x] >> 8) & 0xff;
+         *dst++ = src[x] & 0xff;
+      }
+   }
+
+   // zlib header, stored blocks of at most 65535 bytes, adler32
+   unsigned int numBlocks = (rawLen + 65534) / 65535;
+   unsigned int zLen = 2 + numBlocks * 5 + rawLen + 4;
+   unsigned char* z = (unsigned char*) malloc(zLen);
+   unsigned char* zp = z;
+   *zp++ = 0x78;
+   *zp++ = 0x01;
+   unsigned int a = 1, b = 0;
+   for (unsigned int off = 0; off < rawLen; off += 65535) {
+      unsigned int n = rawLen - off > 65535 ? 65535 : rawLen - off;
+      *zp++ = off + n == rawLen ? 1 : 0; // BFINAL, BTYPE=00
+      put16le(zp, n); zp += 2;
+      put16le(zp, ~n & 0xffff); zp += 2;
+      memcpy(zp, &raw[off], n);
+      zp += n;
+      for (unsigned int i = 0; i < n; i++) {
+         a = (a + raw[off + i]) % 65521;
+         b = (b + a) % 65521;
+      }
+   }
+   put32be(zp, (b << 16) | a);
+
+   png_chunk(fp, "IDAT", z, zLen);
+   png_chunk(fp, "IEND", NULL, 0);
+
+   free(z);
+   free(raw);
+   fclose(fp);
+   return 0;
+}
+
+static unsigned char* readFile(const char* filename, long* len) {
+   FILE* fp = fopen(filename, "rb");
+   if (!fp) {
+      LOG(LOG_ERROR, "can't open %s", filename);
+      return NULL;
+   }
+   fseek(fp, 0, SEEK_END);
+   *len = ftell(fp);
+   fseek(fp, 0, SEEK_SET);
+   unsigned char* buf = (unsigned char*) malloc(*len > 0 ? *len : 1);
+   if (fread(buf, 1, *len, fp) != (size_t) *len) {
+      LOG(LOG_ERROR, "can't read %s", filename);
+      free(buf);
+      buf = NULL;
+   }
+   fclose(fp);
+   return buf;
+}
+
+static unsigned int get16le(const unsigned char* p) {
+   return p[0] | (p[1] << 8);
+}
+
+static unsigned int get32le(const unsigned char* p) {
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+static unsigned int get32be(const unsigned char* p) {
+   return ((unsigned int) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static struct framebuffer* load_ppm(const unsigned char* buf, long len) {
+   // P6 <ws> width <ws> height <ws> maxval <single ws> data
+   int vals[3];
+   long pos = 2;
+   for (int v = 0; v < 3; v++) {
+      while (pos < len && (buf[pos] == '#' || buf[pos] <= ' ')) {
+         if (buf[pos] == '#') {
+            while (pos < len && buf[pos] != '\n') pos++;
+         } else {
+            pos++;
+         }
+      }
+      vals[v] = 0;
+      while (pos < len && buf[pos] >= '0' && buf[pos] <= '9')
+         vals[v] = vals[v] * 10 + buf[pos++] - '0';
+   }
+   pos++;
+   int w = vals[0], h = vals[1];
+   if (vals[2] != 255 || w <= 0 || h <= 0 || pos + (long) w * h * 3 > len) {
+      LOG(LOG_ERROR, "unsupported or truncated ppm");
+      return NULL;
+   }
+   struct framebuffer* fb = fb_init(w, h);
+   const unsigned char* p = &buf[pos];
+   for (int i = 0; i < w * h; i++, p += 3)
+      fb->pixels[i] = ARGB(p[0], p[1], p[2]);
+   return fb;
+}
+
+static struct framebuffer* load_bmp(const unsigned char* buf, long len) {
+   if (len < 54 || get32le(&buf[30]) != 0) {
+      LOG(LOG_ERROR, "unsupported bmp (only uncompressed)");
+      return NULL;
+   }
+   unsigned int offset = get32le(&buf[10]);
+   int w = (int) get32le(&buf[18]);
+   int h = (int) get32le(&buf[22]);
+   int bpp = get16le(&buf[28]);
+   bool bottomUp = h > 0;
+   if (h < 0) h = -h;
+   int bytes = bpp / 8;
+   int stride = (w * bytes + 3) & ~3;
+   if ((bpp != 24 && bpp != 32) || w <= 0 ||
+          offset + (long) stride * h > len) {
+      LOG(LOG_ERROR, "unsupported or truncated bmp");
+      return NULL;
+   }
+   struct framebuffer* fb = fb_init(w, h);
+   for (int y = 0; y < h; y++) {
+      const unsigned char* row = &buf[offset + (long) stride *
+                                      (bottomUp ? h - 1 - y : y)];
+      for (int x = 0; x < w; x++, row += bytes)
+         fb->pixels[y * w + x] = ARGB(row[2], row[1], row[0]);
+   }
+   return fb;
+}
+
+// Just enough inflate (RFC 1951) to read PNGs written by other tools
+
+struct inflater {
+   const unsigned char* in;
+   long inLen;
+   long pos;
+   unsigned int bitBuf;
+   int bitCnt;
+   unsigned char* out;
+   long outLen;
+   long outCap;
+   bool err;
+};
+
+struct huffman {
+   short count[16];   // codes of each length
+   short symbol[288]; // symbols ordered by code
+};
+
+static int getBits(struct inflater* s, int n) {
+   while (s->bitCnt < n) {
+      if (s->pos >= s->inLen) {
+         s->err = true;
+         return 0;
+      }
+      s->bitBuf |= (unsigned int) s->in[s->pos++] << s->bitCnt;
+      s->bitCnt += 8;
+   }
+   int v = s->bitBuf & ((1u << n) - 1);
+   s->bitBuf >>= n;
+   s->bitCnt -= n;
+   return v;
+}
+
+static void buildHuffman(struct huffman* h, const unsigned char* lengths,
+                         int n) {
+   short offs[16];
+   memset(h->count, 0, sizeof(h->count));
+   for (int i = 0; i < n; i++)
+      h->count[lengths[i]]++;
+   h->count[0] = 0;
+   offs[1] = 0;
+   for (int len = 1; len < 15; len++)
+      offs[len + 1] = offs[len] + h->count[len];
+   for (int i = 0; i < n; i++)
+      if (lengths[i])
+         h->symbol[offs[lengths[i]]++] = i;
+}
+
+static int decodeSymbol(struct inflater* s, const struct huffman* h) {
+   int code = 0, first = 0, index = 0;
+   for (int len = 1; len < 16; len++) {
+      code |= getBits(s, 1);
+      int count = h->count[len];
+      if (code - count < first)
+         return h->symbol[index + (code - first)];
+      index += count;
+      first = (first + count) << 1;
+      code <<= 1;
+   }
+   s->err = true;
+   return 0;
+}
+
+static void putByte(struct inflater* s, unsigned char b) {
+   if (s->outLen >= s->outCap) {
+      s->err = true;
+      return;
+   }
+   s->out[s->outLen++] = b;
+}
+
+static const short lenBase[29] = {
+   3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,
+   35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const short lenExtra[29] = {
+   0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static const unsigned short distBase[30] = {
+   1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+   257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static const short distExtra[30] = {
+   0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+static void inflateCodes(struct inflater* s, const struct huffman* lit,
+                         const struct huffman* dist) {
+   while (!s->err) {
+      int sym = decodeSymbol(s, lit);
+      if (sym < 256) {
+         putByte(s, sym);
+      } else if (sym == 256) {
+         return;
+      } else {
+         sym -= 257;
+         if (sym >= 29) {
+            s->err = true;
+            return;
+         }
+         int len = lenBase[sym] + getBits(s, lenExtra[sym]);
+         int d = decodeSymbol(s, dist);
+         if (d >= 30) {
+            s->err = true;
+            return;
+         }
+         long back = distBase[d] + getBits(s, distExtra[d]);
+         if (back > s->outLen) {
+            s->err = true;
+            return;
+         }
+         while (len-- && !s->err)
+            putByte(s, s->out[s->outLen - back]);
+      }
+   }
+}
+
+static void inflateDynamic(struct inflater* s) {
+   static const unsigned char order[19] = {
+      16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+   unsigned char lengths[320];
+   struct huffman lit, dist;
+
+   int nlen = getBits(s, 5) + 257;
+   int ndist = getBits(s, 5) + 1;
+   int ncode = getBits(s, 4) + 4;
+   if (nlen > 286 || ndist > 30) {
+      s->err = true;
+      return;
+   }
+   memset(lengths, 0, sizeof(lengths));
+   for (int i = 0; i < ncode; i++)
+      lengths[order[i]] = getBits(s, 3);
+   buildHuffman(&lit, lengths, 19);
+
+   int i = 0;
+   while (i < nlen + ndist && !s->err) {
+      int sym = decodeSymbol(s, &lit);
+      if (sym < 16) {
+         lengths[i++] = sym;
+         continue;
+      }
+      int rep, val = 0;
+      if (sym == 16) {
+         if (i == 0) {
+            s->err = true;
+            return;
+         }
+         val = lengths[i - 1];
+         rep = 3 + getBits(s, 2);
+      } else if (sym == 17) {
+         rep = 3 + getBits(s, 3);
+      } else {
+         rep = 11 + getBits(s, 7);
+      }
+      if (i + rep > nlen + ndist) {
+         s->err = true;
+         return;
+      }
+      while (rep--)
+         lengths[i++] = val;
+   }
+   buildHuffman(&lit, lengths, nlen);
+   buildHuffman(&dist, lengths + nlen, ndist);
+   inflateCodes(s, &lit, &dist);
+}
+
+static void inflateFixed(struct inflater* s) {
+   unsigned char lengths[288];
+   struct huffman lit, dist;
+   int i = 0;
+   for (; i < 144; i++) lengths[i] = 8;
+   for (; i < 256; i++) lengths[i] = 9;
+   for (; i < 280; i++) lengths[i] = 7;
+   for (; i < 288; i++) lengths[i] = 8;
+   buildHuffman(&lit, lengths, 288);
+   for (i = 0; i < 30; i++) lengths[i] = 5;
+   buildHuffman(&dist, lengths, 30);
+   inflateCodes(s, &lit, &dist);
+}
+
+static void inflateStored(struct inflater* s) {
+   s->bitBuf = 0;
+   s->bitCnt = 0;
+   if (s->pos + 4 > s->inLen) {
+      s->err = true;
+      return;
+   }
+   unsigned int n = get16le(&s->in[s->pos]);
+   if ((n ^ 0xffff) != get16le(&s->in[s->pos + 2]) ||
+          s->pos + 4 + n > s->inLen) {
+      s->err = true;
+      return;
+   }
+   s->pos += 4;
+   while (n-- && !s->err)
+      putByte(s, s->in[s->pos++]);
+}
+
+// Inflates a zlib stream into out. Returns 1 on error.
+static int zlibInflate(const unsigned char* in, long inLen,
+                       unsigned char* out, long outCap) {
+   struct inflater s;
+   if (inLen < 2 || (in[0] & 0x0f) != 8 || (in[1] & 0x20))
+      return 1;
+   s.in = in;
+   s.inLen = inLen;
+   s.pos = 2;
+   s.bitBuf = 0;
+   s.bitCnt = 0;
+   s.out = out;
+   s.outLen = 0;
+   s.outCap = outCap;
+   s.err = false;
+
+   int last;
+   do {
+      last = getBits(&s, 1);
+      int type = getBits(&s, 2);
+      if (type == 0) inflateStored(&s);
+      else if (type == 1) inflateFixed(&s);
+      else if (type == 2) inflateDynamic(&s);
+      else s.err = true;
+   } while (!last && !s.err);
+   return s.err || s.outLen != outCap;
+}
+
+static int paeth(int a, int b, int c) {
+   int p = a + b - c;
+   int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+   if (pa <= pb && pa <= pc) return a;
+   return pb <= pc ? b : c;
+}
+
+static struct framebuffer* load_png(const unsigned char* buf, long len) {
+   static const unsigned char sig[8] = {137,'P','N','G',13,10,26,10};
+   if (len < 8 || memcmp(buf, sig, 8) != 0)
+      return NULL;
+
+   int w = 0, h = 0, channels = 0;
+   unsigned char* idat = (unsigned char*) malloc(len);
+   long idatLen = 0;
+   long pos = 8;
+   while (pos + 12 <= len) {
+      unsigned int n = get32be(&buf[pos]);
+      const unsigned char* type = &buf[pos + 4];
+      const unsigned char* data = &buf[pos + 8];
+      if (pos + 12 + (long) n > len)
+         break;
+      if (memcmp(type, "IHDR", 4) == 0 && n >= 13) {
+         w = get32be(data);
+         h = get32be(data + 4);
+         int depth = data[8], color = data[9], interlace = data[12];
+         channels = color == 0 ? 1 : color == 2 ? 3 : color == 6 ? 4 : 0;
+         if (depth != 8 || interlace != 0)
+            channels = 0;
+      } else if (memcmp(type, "IDAT", 4) == 0) {
+         memcpy(&idat[idatLen], data, n);
+         idatLen += n;
+      } else if (memcmp(type, "IEND", 4) == 0) {
+         break;
+      }
+      pos += 12 + n;
+   }
+   if (w <= 0 || h <= 0 || channels == 0) {
+      LOG(LOG_ERROR, "unsupported png (only 8 bit gray, RGB or RGBA)");
+      free(idat);
+      return NULL;
+   }
+
+   long rowLen = 1 + (long) w * channels;
+   unsigned char* raw = (unsigned char*) malloc(rowLen * h);
+   if (zlibInflate(idat, idatLen, raw, rowLen * h)) {
+      LOG(LOG_ERROR, "bad png image data");
+      free(raw);
+      free(idat);
+      return NULL;
+   }
+   free(idat);
+
+   // Undo the per row filters in place
+   struct framebuffer* fb = fb_init(w, h);
+   for (int y = 0; y < h; y++) {
+      unsigned char* row = &raw[y * rowLen + 1];
+      unsigned char* up = y ? &raw[(y - 1) * rowLen + 1] : NULL;
+      int filter = row[-1];
+      for (long i = 0; i < rowLen - 1; i++) {
+         int a = i >= channels ? row[i - channels] : 0;
+         int b = up ? up[i] : 0;
+         int c = up && i >= channels ? up[i - channels] : 0;
+         switch (filter) {
+            case 1: row[i] += a; break;
+            case 2: row[i] += b; break;
+            case 3: row[i] += (a + b) / 2; break;
+            case 4: row[i] += paeth(a, b, c); break;
+            default: break;
+         }
+      }
+      for (int x = 0; x < w; x++) {
+         const unsigned char* p = &row[x * channels];
+         fb->pixels[y * w + x] = channels == 1 ?
+            ARGB(p[0], p[0], p[0]) : ARGB(p[0], p[1], p[2]);
+      }
+   }
+   free(raw);
+   return fb;
+}
+
+struct framebuffer* fb_load(const char* filename) {
+   long len;
+   unsigned char* buf = readFile(filename, &len);
+   if (!buf) return NULL;
+
+   struct framebuffer* fb = NULL;
+   const char* ext = extension(filename);
+   if (strcasecmp(ext, "ppm") == 0 && len > 2 && buf[0] == 'P' &&
+          buf[1] == '6')
+      fb = load_ppm(buf, len);
+   else if (strcasecmp(ext, "bmp") == 0 && len > 2 && buf[0] == 'B' &&
+               buf[1] == 'M')
+      fb = load_bmp(buf, len);
+   else if (strcasecmp(ext, "png") == 0)
+      fb = load_png(buf, len);
+   else
+      LOG(LOG_ERROR, "don't know how to read '%s' (use ppm, png or bmp)",
+          filename);
+   free(buf);
+   if (!fb)
+      LOG(LOG_ERROR, "can't load %s", filename);
+   return fb;
+}
+
+struct framebuffer* fb_half(const struct framebuffer* fb) {
+   struct framebuffer* half = fb_init(fb->width / 2, fb->height / 2);
+   for (int y = 0; y < half->height; y++)
+      for (int x = 0; x < half->width; x++)
+         half->pixels[y * half->width + x] =
+            fb->pixels[y * 2 * fb->width + x * 2];
+   return half;
+}
+
+uint64_t fb_hash(const struct framebuffer* fb) {
+   uint64_t h = 0xcbf29ce484222325ULL;
+   unsigned int vals[2] = { (unsigned int) fb->width,
+                            (unsigned int) fb->height };
+   for (int i = 0; i < 2; i++)
+      h = (h ^ vals[i]) * 0x100000001b3ULL;
+   for (int i = 0; i < fb->width * fb->height; i++) {
+      unsigned int p = fb->pixels[i];
+      h = (h ^ ((p >> 16) & 0xff)) * 0x100000001b3ULL;
+      h = (h ^ ((p >> 8) & 0xff)) * 0x100000001b3ULL;
+      h = (h ^ (p & 0xff)) * 0x100000001b3ULL;
+   }
+   return h;
+}
+
+long fb_diff(const struct framebuffer* a, const struct framebuffer* b,
+             struct framebuffer* diff) {
+   if (a->width != b->width || a->height != b->height)
+      return -1;
+   long n = 0;
+   for (int i = 0; i < a->width * a->height; i++) {
+      bool differs = ((a->pixels[i] ^ b->pixels[i]) & 0xffffff) != 0;
+      if (differs) n++;
+      if (diff)
+         diff->pixels[i] = differs ? ARGB(255,255,255) : ARGB(0,0,0);
+   }
+   return n;
+}
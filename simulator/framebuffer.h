@@ -0,0 +1,82 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef VICII_FRAMEBUFFER_H
+#define VICII_FRAMEBUFFER_H
+
+// A flat in-memory ARGB8888 frame buffer. The simulator paints
+// pixels here and then either uploads the whole buffer to an SDL
+// texture (when showing a window) or writes it out to a file.
+// Nothing in here depends on SDL so it works headless.
+
+#include <stdint.h>
+
+#define ARGB(r,g,b) \
+   (0xff000000u | (((unsigned int)(r) & 0xff) << 16) | \
+      (((unsigned int)(g) & 0xff) << 8) | ((unsigned int)(b) & 0xff))
+
+struct framebuffer {
+   int width;
+   int height;
+   unsigned int* pixels; // width * height ARGB8888 values
+};
+
+struct framebuffer* fb_init(int width, int height);
+
+void fb_free(struct framebuffer* fb);
+
+void fb_clear(struct framebuffer* fb, unsigned int argb);
+
+static inline void fb_set(struct framebuffer* fb, int x, int y,
+                          unsigned int argb) {
+   if (x < 0 || y < 0 || x >= fb->width || y >= fb->height) return;
+   fb->pixels[y * fb->width + x] = argb;
+}
+
+// Picks the output format from the filename extension
+// (.ppm, .png, .bmp or .raw). Return 1 on error, 0 success
+int fb_save(struct framebuffer* fb, const char* filename);
+
+// Binary P6 PPM
+int fb_save_ppm(struct framebuffer* fb, const char* filename);
+
+// 8-bit RGB PNG using uncompressed deflate blocks
+int fb_save_png(struct framebuffer* fb, const char* filename);
+
+// 24-bit bottom-up BMP (same thing SDL_SaveBMP gave us before)
+int fb_save_bmp(struct framebuffer* fb, const char* filename);
+
+// Raw ARGB8888 dump, width*height*4 bytes, no header
+int fb_save_raw(struct framebuffer* fb, const char* filename);
+
+// Reads .ppm (P6), .bmp (24/32 bit, uncompressed) or .png (8 bit
+// gray, RGB or RGBA, not interlaced). Returns NULL on error.
+struct framebuffer* fb_load(const char* filename);
+
+// Undo the simulator's 2x/2y pixel scaling (every pixel is drawn
+// twice across and twice down).
+struct framebuffer* fb_half(const struct framebuffer* fb);
+
+// 64 bit FNV-1a of the size and RGB values (alpha is ignored)
+uint64_t fb_hash(const struct framebuffer* fb);
+
+// Number of pixels whose RGB differs, or -1 if the sizes do. If diff
+// is not NULL (same size) it gets white where they differ and black
+// elsewhere.
+long fb_diff(const struct framebuffer* a, const struct framebuffer* b,
+             struct framebuffer* diff);
+
+#endif
@@ -0,0 +1,208 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fuzz.h"
+
+// The registers we write and the bits we may set in them. Weights are
+// out of the table's total.
+static const struct {
+   uint8_t reg;
+   uint8_t mask;
+   int weight;
+} fuzzRegs[] = {
+   { 0x11, 0xff, 8 },  // yscroll, rsel, den, modes, raster bit 8
+   { 0x16, 0xff, 4 },  // xscroll, csel, mcm
+   { 0x18, 0xff, 4 },  // matrix and character bases
+   { 0x15, 0xff, 4 },  // sprite enables
+   { 0x17, 0xff, 2 },  // sprite y expansion
+   { 0x01, 0xff, 1 }, { 0x03, 0xff, 1 }, { 0x05, 0xff, 1 },
+   { 0x07, 0xff, 1 }, { 0x09, 0xff, 1 }, { 0x0b, 0xff, 1 },
+   { 0x0d, 0xff, 1 }, { 0x0f, 0xff, 1 },  // sprite y
+   // Extensions. $34 (spi) is never written. Hires modes stay off
+   // in $37 and $3f never turns on the overlay, persistence or a
+   // copy (both port functions 3).
+   { 0x2f, 0xff, 1 }, { 0x30, 0xff, 1 }, { 0x31, 0xff, 1 },
+   { 0x32, 0xff, 1 }, { 0x33, 0xff, 1 }, { 0x35, 0xff, 1 },
+   { 0x36, 0xff, 1 }, { 0x37, 0xef, 1 }, { 0x38, 0xff, 1 },
+   { 0x39, 0xff, 1 }, { 0x3a, 0xff, 1 }, { 0x3b, 0xff, 1 },
+   { 0x3c, 0xff, 1 }, { 0x3d, 0xff, 1 }, { 0x3e, 0xff, 1 },
+   { 0x3f, 0x0f, 1 },
+};
+
+#define NUM_FUZZ_REGS (sizeof(fuzzRegs) / sizeof(fuzzRegs[0]))
+
+// splitmix64, so a seed makes the same script everywhere
+static uint64_t nextRandom(uint64_t* state) {
+   uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+   return z ^ (z >> 31);
+}
+
+static int randomBelow(uint64_t* state, int n) {
+   return nextRandom(state) % n;
+}
+
+static int pickReg(uint64_t* state) {
+   int total = 0;
+   for (unsigned int i = 0; i < NUM_FUZZ_REGS; i++)
+      total += fuzzRegs[i].weight;
+   int r = randomBelow(state, total);
+   unsigned int i = 0;
+   while (r >= fuzzRegs[i].weight)
+      r -= fuzzRegs[i++].weight;
+   return i;
+}
+
+static void setEvent(struct stim_event* ev, int frame, int pos,
+                     int numCycles, int phase, int type, int reg,
+                     uint8_t value) {
+   ev->frame = frame;
+   ev->line = pos / numCycles;
+   ev->cycle = pos % numCycles;
+   ev->phase = phase;
+   ev->type = type;
+   ev->reg = reg;
+   ev->value = value;
+   ev->mask = 0xff;
+}
+
+// Time order, and the order they were made in for the same phase
+static int compareEvents(const void* a, const void* b) {
+   const struct stim_event* ea = (const struct stim_event*) a;
+   const struct stim_event* eb = (const struct stim_event*) b;
+   long long ka = stim_event_key(ea);
+   long long kb = stim_event_key(eb);
+   if (ka != kb)
+      return ka < kb ? -1 : 1;
+   return ea->srcLine - eb->srcLine;
+}
+
+struct stim_script* fuzz_open(uint64_t seed, int frames, int numCycles,
+                              int numLines) {
+   const int framePositions = numCycles * numLines;
+   struct stim_event* events = (struct stim_event*)
+      calloc(frames * (FUZZ_WRITES + 2) + 2, sizeof(struct stim_event));
+   uint64_t state = seed;
+   int n = 0;
+
+   // Frame 0 starts wherever reset left the raster, so the script
+   // starts at frame 1. First put the extension flags in a known
+   // state.
+   setEvent(&events[n++], 1, 1, numCycles, 2, STIM_WRITE, 0x3f, 0);
+
+   for (int frame = 1; frame <= frames; frame++) {
+      for (int i = 0; i < FUZZ_WRITES; i++) {
+         int r = pickReg(&state);
+         uint8_t value = randomBelow(&state, 256) & fuzzRegs[r].mask;
+         if (fuzzRegs[r].reg == 0x3f && value == 0x0f)
+            value = 0x0e;
+         setEvent(&events[n++], frame,
+                  randomBelow(&state, framePositions), numCycles, 2,
+                  STIM_WRITE, fuzzRegs[r].reg, value);
+      }
+
+      // A light pen pulse, up to an eighth of a frame long
+      if (randomBelow(&state, 2)) {
+         int pos = randomBelow(&state, framePositions);
+         int end = pos + 1 + randomBelow(&state, framePositions / 8);
+         if (end >= framePositions)
+            end = framePositions - 1;
+         setEvent(&events[n++], frame, pos, numCycles, 1, STIM_LP, 0, 0);
+         setEvent(&events[n++], frame, end, numCycles, 1, STIM_LP, 0, 1);
+      }
+   }
+
+   // Let go of lp and run through the last frame
+   setEvent(&events[n++], frames + 1, 1, numCycles, 1, STIM_LP, 0, 1);
+
+   for (int i = 0; i < n; i++)
+      events[i].srcLine = i;
+   qsort(events, n, sizeof(struct stim_event), compareEvents);
+
+   // One register access per cycle
+   int kept = 0;
+   long long lastAccess = -1;
+   for (int i = 0; i < n; i++) {
+      long long key = stim_event_key(&events[i]);
+      if (events[i].type == STIM_WRITE) {
+         if (key == lastAccess)
+            continue;
+         lastAccess = key;
+      }
+      events[kept] = events[i];
+      events[kept].srcLine = kept + 1;
+      kept++;
+   }
+
+   char name[32];
+   snprintf(name, sizeof(name), "fuzz seed %llu",
+            (unsigned long long) seed);
+   struct stim_script* ss = stim_from_events(name, events, kept);
+   ss->cpuTiming = true;
+   free(events);
+   return ss;
+}
+
+int fuzz_minimize(struct stim_event* events, int numEvents, int maxRuns,
+                  fuzz_run_fn run, void* ctx, int* runs) {
+   struct stim_event* trial = (struct stim_event*)
+      malloc((numEvents ? numEvents : 1) * sizeof(struct stim_event));
+   int chunks = 2;
+   *runs = 0;
+
+   while (numEvents > 1 && *runs < maxRuns) {
+      const int chunkSize = (numEvents + chunks - 1) / chunks;
+      bool reduced = false;
+      for (int start = 0; start < numEvents && *runs < maxRuns;
+              start += chunkSize) {
+         // Everything but this chunk
+         int n = 0;
+         for (int i = 0; i < numEvents; i++) {
+            if (i < start || i >= start + chunkSize)
+               trial[n++] = events[i];
+         }
+         (*runs)++;
+         int failedAt = run(ctx, trial, n);
+         if (failedAt < 0)
+            continue;
+         memcpy(events, trial, failedAt * sizeof(struct stim_event));
+         numEvents = failedAt;
+         chunks = chunks > 2 ? chunks - 1 : 2;
+         reduced = true;
+         break;
+      }
+      if (!reduced) {
+         // Try smaller chunks, down to single events
+         if (chunks >= numEvents)
+            break;
+         chunks = chunks * 2 < numEvents ? chunks * 2 : numEvents;
+      }
+   }
+
+   // The loop above never tries no events at all
+   if (numEvents == 1 && *runs < maxRuns) {
+      (*runs)++;
+      if (run(ctx, trial, 0) >= 0)
+         numEvents = 0;
+   }
+   free(trial);
+   return numEvents;
+}
@@ -0,0 +1,54 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef VICII_FUZZ_H
+#define VICII_FUZZ_H
+
+#include <stdint.h>
+
+#include "stim.h"
+
+// Random register write scripts for --fuzz. A seed always makes the
+// same script: writes at random cycles to $d011, $d016, $d018, the
+// sprite enables, y positions and y expansion, and the extension
+// registers that don't reach the flash, eeprom or the chip select,
+// plus light pen pulses. They play with stim's cpuTiming so they stay
+// off the bus when a 6510 would.
+//
+// Nothing is expected of the writes themselves. A run fails on the
+// checks that are always made and, with -V, the reference model.
+
+#define FUZZ_DEFAULT_FRAMES 4
+
+// Writes per frame
+#define FUZZ_WRITES 256
+
+struct stim_script* fuzz_open(uint64_t seed, int frames, int numCycles,
+                              int numLines);
+
+// Runs events as a script. If the run fails, events is overwritten
+// with where its events happened and the number of them that happened
+// before the failure is returned. Returns -1 if the run passed.
+typedef int (*fuzz_run_fn)(void* ctx, struct stim_event* events,
+                           int numEvents);
+
+// Delta debugging: drops ever smaller chunks of a failing script while
+// it keeps failing. Stops after maxRuns runs. Returns the number of
+// events left at the start of events.
+int fuzz_minimize(struct stim_event* events, int numEvents, int maxRuns,
+                  fuzz_run_fn run, void* ctx, int* runs);
+
+#endif
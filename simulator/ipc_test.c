@@ -1,17 +1,314 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+// Latency and throughput of the vicii_ipc handshake.
+//
+// Forks a receiver that answers like the simulator does (without
+// running a model) and times round trips from the sender side. Each
+// transport gets its own receiver. Payloads go from a single step
+// exchange up to full batches.
+//
+//    make ipc_test
+//    ./ipc_test -n 200000 -c 2,3
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
 #include "vicii_ipc.h"
 
-int main(int argc, char* argv[]) {
+#define MAX_SIZES 16
+#define WARMUP 1000
+
+static uint64_t nowNs(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Returns 1 on error
+static int pinTo(int cpu) {
+   if (cpu < 0)
+      return 0;
+#ifdef __linux__
+   cpu_set_t set;
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+   if (sched_setaffinity(0, sizeof(set), &set)) {
+      fprintf(stderr, "can't pin to cpu %d: %s\n", cpu, strerror(errno));
+      return 1;
+   }
+   return 0;
+#else
+   fprintf(stderr, "core pinning is not supported here\n");
+   return 1;
+#endif
+}
+
+// Stands in for the simulator: answers each step, and each batch with
+// one result per step.
+static int runReceiver(int session, int cpu, int readyFd, int doneFd) {
+   if (pinTo(cpu))
+      return 1;
+
+   struct vicii_ipc* ipc = ipc_init(IPC_RECEIVER);
+   ipc_set_session(ipc, session);
+   if (ipc_open(ipc))
+      return 1;
+   char ok = 1;
+   if (write(readyFd, &ok, 1) != 1)
+      return 1;
+   close(readyFd);
+
+   struct vicii_state* state = ipc->state;
+   struct vicii_batch* batch = ipc->batch;
+   while (1) {
+      if (ipc_receive(ipc))
+         break;
+      if (state->flags & VICII_OP_CAPTURE_END) {
+         // Taking the channel down while the sender still waits on it
+         // would fail its wait, so hold on until it has let go.
+         ipc_receive_done(ipc);
+         char eof;
+         while (read(doneFd, &eof, 1) > 0)
+            ;
+         break;
+      }
+      if (state->flags & VICII_OP_BATCH) {
+         for (unsigned int n = 0; n < batch->count; n++) {
+            batch->out[n].irq = 0;
+            batch->out[n].ba = 1;
+            batch->out[n].aec = 1;
+            batch->out[n].num_reg_deltas = 0;
+            batch->out[n].addr_from_sim = batch->in[n].addr_to_sim;
+            batch->out[n].data_from_sim = batch->in[n].data_to_sim;
+         }
+         batch->done = batch->count;
+      } else {
+         state->addr_from_sim = state->addr_to_sim;
+         state->data_from_sim = state->data_to_sim;
+      }
+      if (ipc_receive_done(ipc))
+         break;
+   }
+   ipc_close(ipc);
+   return 0;
+}
+
+static int cmpU64(const void* a, const void* b) {
+   uint64_t x = *(const uint64_t*)a;
+   uint64_t y = *(const uint64_t*)b;
+   return x < y ? -1 : x > y;
+}
+
+static double pct(const uint64_t* sorted, int n, double p) {
+   int i = (int)(p * (n - 1) + 0.5);
+   return sorted[i] / 1000.0;
+}
+
+// One exchange of 'steps' bus steps. 1 is a plain step exchange.
+static int exchange(struct vicii_ipc* ipc, int steps, int i) {
+   if (steps == 1) {
+      ipc->state->addr_to_sim = i;
+      ipc->state->data_to_sim = i & 0xff;
+      return ipc_send(ipc);
+   }
+   for (int n = 0; n < steps; n++) {
+      ipc->batch->in[n].addr_to_sim = i + n;
+      ipc->batch->in[n].data_to_sim = (i + n) & 0xff;
+      ipc->batch->in[n].flags = 0;
+   }
+   return ipc_send_batch(ipc, steps);
+}
+
+// Runs one transport against a fresh receiver. Returns 1 on error.
+static int benchTransport(const char* transport, int session,
+                          const int* sizes, int numSizes, int iterations,
+                          int recvCpu, uint64_t* lat) {
+   setenv("VICII_IPC_TRANSPORT", transport, 1);
+
+   // ready: receiver -> sender once open, done: closed by the sender
+   // once it no longer uses the channel
+   int fds[2];
+   int doneFds[2];
+   if (pipe(fds) || pipe(doneFds)) {
+      perror("pipe");
+      return 1;
+   }
+   fflush(stdout);
+   pid_t pid = fork();
+   if (pid < 0) {
+      perror("fork");
+      return 1;
+   }
+   if (pid == 0) {
+      close(fds[0]);
+      close(doneFds[1]);
+      exit(runReceiver(session, recvCpu, fds[1], doneFds[0]));
+   }
+   close(fds[1]);
+   close(doneFds[0]);
+   char ok;
+   int got = read(fds[0], &ok, 1);
+   close(fds[0]);
+   if (got != 1) {
+      fprintf(stderr, "receiver failed to start\n");
+      close(doneFds[1]);
+      waitpid(pid, NULL, 0);
+      return 1;
+   }
+
    struct vicii_ipc* ipc = ipc_init(IPC_SENDER);
-   unsigned char ipc_buf[IPC_BUFSIZE];
+   ipc_set_session(ipc, session);
+   if (ipc_open(ipc)) {
+      close(doneFds[1]);
+      kill(pid, SIGTERM);
+      waitpid(pid, NULL, 0);
+      return 1;
+   }
 
-   ipc_open(ipc);
+   int rc = 0;
+   for (int s = 0; s < numSizes && !rc; s++) {
+      int steps = sizes[s];
+      for (int i = 0; i < WARMUP && !rc; i++)
+         rc = exchange(ipc, steps, i);
 
-   printf ("Send\n");
-   ipc_send(ipc, ipc_buf);
+      uint64_t start = nowNs();
+      for (int i = 0; i < iterations && !rc; i++) {
+         uint64_t t0 = nowNs();
+         rc = exchange(ipc, steps, i);
+         lat[i] = nowNs() - t0;
+      }
+      uint64_t total = nowNs() - start;
+      if (rc)
+         break;
 
-   printf ("Wait for response\n");
-   ipc_receive(ipc, ipc_buf);
+      qsort(lat, iterations, sizeof(uint64_t), cmpU64);
+      double secs = total / 1e9;
+      printf("%-9s %5d %14.0f %14.0f %9.2f %9.2f %9.2f\n", transport,
+             steps, iterations / secs, (double)iterations * steps / secs,
+             pct(lat, iterations, 0.50), pct(lat, iterations, 0.99),
+             pct(lat, iterations, 0.999));
+      fflush(stdout);
+   }
 
-   printf ("Done\n");
+   ipc->state->flags |= VICII_OP_CAPTURE_END;
+   ipc_send(ipc);
    ipc_close(ipc);
+   close(doneFds[1]);
+   waitpid(pid, NULL, 0);
+   return rc;
+}
+
+static void usage(void) {
+   printf("Usage: ipc_test [options]\n");
+   printf("  -n <count>    : round trips per payload size (default 100000)\n");
+   printf("  -b <list>     : steps per exchange, comma separated\n");
+   printf("                  (default 1,16,256,%d; 1 is a plain step)\n",
+          IPC_BATCH_MAX);
+   printf("  -t <list>     : transports, comma separated (default shm,sem)\n");
+   printf("  -c <r>,<s>    : pin receiver and sender to these cpus\n");
+   printf("  -K <n>        : IPC session to use (default 0)\n");
+}
+
+int main(int argc, char* argv[]) {
+   int iterations = 100000;
+   int sizes[MAX_SIZES] = { 1, 16, 256, IPC_BATCH_MAX };
+   int numSizes = 4;
+   char transports[64] = "shm,sem";
+   int recvCpu = -1;
+   int sendCpu = -1;
+   int session = 0;
+   int c;
+
+   while ((c = getopt(argc, argv, "n:b:t:c:K:h")) != -1) {
+      switch (c) {
+         case 'n':
+            iterations = atoi(optarg);
+            break;
+         case 'b': {
+            numSizes = 0;
+            for (char* tok = strtok(optarg, ","); tok;
+                    tok = strtok(NULL, ",")) {
+               int steps = atoi(tok);
+               if (steps < 1 || steps > IPC_BATCH_MAX ||
+                      numSizes == MAX_SIZES) {
+                  fprintf(stderr, "bad size list\n");
+                  return 1;
+               }
+               sizes[numSizes++] = steps;
+            }
+            break;
+         }
+         case 't':
+            snprintf(transports, sizeof(transports), "%s", optarg);
+            break;
+         case 'c':
+            if (sscanf(optarg, "%d,%d", &recvCpu, &sendCpu) != 2) {
+               fprintf(stderr, "-c needs <receiver cpu>,<sender cpu>\n");
+               return 1;
+            }
+            break;
+         case 'K':
+            session = atoi(optarg);
+            break;
+         case 'h':
+            usage();
+            return 0;
+         default:
+            usage();
+            return 1;
+      }
+   }
+   if (iterations < 1 || numSizes == 0) {
+      usage();
+      return 1;
+   }
+
+   // The sender is pinned once, here. Each receiver is forked from us
+   // and keeps this cpu until runReceiver() pins it to its own.
+   uint64_t* lat = (uint64_t*)malloc(sizeof(uint64_t) * iterations);
+   if (!lat || pinTo(sendCpu))
+      return 1;
+
+   printf("%ld cpus online, receiver cpu %d, sender cpu %d, %d round trips\n",
+          sysconf(_SC_NPROCESSORS_ONLN), recvCpu, sendCpu, iterations);
+   printf("%-9s %5s %14s %14s %9s %9s %9s\n", "transport", "steps",
+          "round trips/s", "steps/s", "p50 us", "p99 us", "p999 us");
+
+   int rc = 0;
+   for (char* tok = strtok(transports, ","); tok && !rc;
+           tok = strtok(NULL, ",")) {
+      if (strcmp(tok, "shm") != 0 && strcmp(tok, "sem") != 0) {
+         fprintf(stderr, "unknown transport %s\n", tok);
+         rc = 1;
+         break;
+      }
+      rc = benchTransport(tok, session, sizes, numSizes, iterations,
+                          recvCpu, lat);
+   }
+   free(lat);
+   return rc;
 }
@@ -14,13 +14,16 @@
 // You should have received a copy of the GNU General Public License 
 // along with this program. If not, see <http://www.gnu.org/licenses/>.
 
+#include <stdio.h>
+
 #include "log.h"
 
 const char* logLevelStr[5] = { "none","error","warn","info", "verb" };
 int logLevel = LOG_ERROR;
 
-static int binBufNum=0;
-static char binBuf[8][65];
+// Per thread, -J runs log from several at once
+static thread_local int binBufNum=0;
+static thread_local char binBuf[8][65];
 char* toBin(int len, unsigned long reg) {
    unsigned long b =1;
    for (int c = 0 ; c < len; c++) {
@@ -32,3 +35,9 @@ char* toBin(int len, unsigned long reg) {
    binBufNum = (binBufNum + 1) % 8;
    return buf;
 }
+
+void logField(const char* name, unsigned int expected, unsigned int actual) {
+   if (expected != actual)
+      LOG(LOG_ERROR, "   %-11s expected %03x got %03x", name,
+          expected, actual);
+}
@@ -31,4 +31,7 @@ extern int logLevel;
 
 char* toBin(int len, unsigned long reg);
 
+// Logs one field of a mismatch report, if it differs
+void logField(const char* name, unsigned int expected, unsigned int actual);
+
 #endif
@@ -0,0 +1,751 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "machine.h"
+#include "constants.h"
+#include "log.h"
+
+// Where the kernal waits for a key at the READY prompt. The same in
+// every kernal revision.
+#define KERNAL_READY_LOOP 0xe5cd
+
+// Cycle limits for running the CPU on its own
+#define BOOT_MAX_CYCLES 10000000
+#define START_MAX_CYCLES 2000000
+
+// VIC registers as the kernal leaves them at the READY prompt
+static const uint8_t kernalVicRegs[0x2f] = {
+   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // $d000
+   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+   0x00, 0x1b, 0x00, 0x00, 0x00, 0x00, 0xc8, 0x00,  // $d010
+   0x15, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+   0x0e, 0x06, 0x01, 0x02, 0x03, 0x04, 0x00, 0x01,  // $d020
+   0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x00,
+};
+
+// ---------------------------------------------------------------- CIA
+
+static void ciaReset(struct cia* c) {
+   memset(c, 0, sizeof(struct cia));
+   c->ta.latch = c->ta.counter = 0xffff;
+   c->tb.latch = c->tb.counter = 0xffff;
+}
+
+// Returns true on underflow
+static bool timerClock(struct cia_timer* tm, uint8_t* cr, bool count) {
+   if (!(*cr & 1))
+      return false;
+   if (tm->delay) {
+      tm->delay--;
+      return false;
+   }
+   if (!count)
+      return false;
+   if (tm->counter) {
+      tm->counter--;
+      return false;
+   }
+   tm->counter = tm->latch;
+   if (*cr & 0x08)
+      *cr &= ~1;  // one shot
+   return true;
+}
+
+static void ciaClock(struct cia* c) {
+   bool ta = timerClock(&c->ta, &c->cra, !(c->cra & 0x20));
+   bool tb = false;
+   switch ((c->crb >> 5) & 3) {
+      case 0:
+         tb = timerClock(&c->tb, &c->crb, true);
+         break;
+      case 2:
+         tb = timerClock(&c->tb, &c->crb, ta);
+         break;
+      default:
+         // Counting CNT edges, which never come
+         break;
+   }
+   if (ta)
+      c->icr |= 0x01;
+   if (tb)
+      c->icr |= 0x02;
+   if (c->icr & c->mask)
+      c->irq = true;
+}
+
+static void ciaControl(struct cia_timer* tm, uint8_t* cr, uint8_t v) {
+   if (v & 0x10)
+      tm->counter = tm->latch;  // force load, not kept
+   if ((v & 1) && !(*cr & 1))
+      tm->delay = 2;
+   *cr = v & ~0x10;
+}
+
+static uint8_t ciaRead(struct cia* c, int reg) {
+   switch (reg) {
+      case 0x0: return c->pra | ~c->ddra;  // inputs are pulled up
+      case 0x1: return c->prb | ~c->ddrb;
+      case 0x2: return c->ddra;
+      case 0x3: return c->ddrb;
+      case 0x4: return c->ta.counter & 0xff;
+      case 0x5: return c->ta.counter >> 8;
+      case 0x6: return c->tb.counter & 0xff;
+      case 0x7: return c->tb.counter >> 8;
+      case 0xd: {
+         // Reading acknowledges everything
+         uint8_t v = c->icr | (c->irq ? 0x80 : 0);
+         c->icr = 0;
+         c->irq = false;
+         return v;
+      }
+      case 0xe: return c->cra;
+      case 0xf: return c->crb;
+      default: return c->regs[reg];
+   }
+}
+
+static void ciaWrite(struct cia* c, int reg, uint8_t v) {
+   c->regs[reg] = v;
+   switch (reg) {
+      case 0x0: c->pra = v; break;
+      case 0x1: c->prb = v; break;
+      case 0x2: c->ddra = v; break;
+      case 0x3: c->ddrb = v; break;
+      case 0x4: c->ta.latch = (c->ta.latch & 0xff00) | v; break;
+      case 0x5:
+         c->ta.latch = (c->ta.latch & 0xff) | (v << 8);
+         if (!(c->cra & 1))
+            c->ta.counter = c->ta.latch;
+         break;
+      case 0x6: c->tb.latch = (c->tb.latch & 0xff00) | v; break;
+      case 0x7:
+         c->tb.latch = (c->tb.latch & 0xff) | (v << 8);
+         if (!(c->crb & 1))
+            c->tb.counter = c->tb.latch;
+         break;
+      case 0xd:
+         if (v & 0x80)
+            c->mask |= v & 0x1f;
+         else
+            c->mask &= ~v;
+         if (c->icr & c->mask)
+            c->irq = true;
+         break;
+      case 0xe: ciaControl(&c->ta, &c->cra, v); break;
+      case 0xf: ciaControl(&c->tb, &c->crb, v); break;
+      default: break;
+   }
+}
+
+// ------------------------------------------------------- memory map
+
+// LORAM, HIRAM and CHAREN. Port lines set to input read high.
+static inline int portConfig(struct machine* m) {
+   return (m->portData | ~m->portDdr) & 7;
+}
+
+static inline bool ioVisible(struct machine* m) {
+   int cfg = portConfig(m);
+   return (cfg & 3) && (cfg & 4);
+}
+
+static inline bool isVicAddr(struct machine* m, uint16_t addr) {
+   return (addr & 0xfc00) == 0xd000 && ioVisible(m);
+}
+
+// True when the CPU sees ROM (or I/O) at addr instead of RAM
+static bool romAt(struct machine* m, uint16_t addr) {
+   int cfg = portConfig(m);
+   switch (addr >> 12) {
+      case 0xa: case 0xb: return (cfg & 3) == 3 && m->haveRoms;
+      case 0xd: return (cfg & 3) != 0;
+      case 0xe: case 0xf: return (cfg & 2) != 0;
+      default: return false;
+   }
+}
+
+static uint8_t ioRead(struct machine* m, uint16_t addr) {
+   switch (addr >> 8) {
+      case 0xd4: case 0xd5: case 0xd6: case 0xd7:
+         return 0;  // SID
+      case 0xd8: case 0xd9: case 0xda: case 0xdb:
+         return (m->lastBus & 0xf0) | m->colorRam[addr & 0x3ff];
+      case 0xdc:
+         return ciaRead(&m->cia1, addr & 0xf);
+      case 0xdd:
+         return ciaRead(&m->cia2, addr & 0xf);
+      default:
+         return m->lastBus;
+   }
+}
+
+static void ioWrite(struct machine* m, uint16_t addr, uint8_t v) {
+   switch (addr >> 8) {
+      case 0xd8: case 0xd9: case 0xda: case 0xdb:
+         m->colorRam[addr & 0x3ff] = v & 0xf;
+         break;
+      case 0xdc:
+         ciaWrite(&m->cia1, addr & 0xf, v);
+         break;
+      case 0xdd:
+         ciaWrite(&m->cia2, addr & 0xf, v);
+         break;
+      default:
+         break;
+   }
+}
+
+// Everything but the VIC's registers
+static uint8_t cpuRead(struct machine* m, uint16_t addr) {
+   if (addr == 0)
+      return m->portDdr;
+   if (addr == 1)
+      return (m->portData & m->portDdr) | (~m->portDdr & 0x17);
+
+   int cfg = portConfig(m);
+   switch (addr >> 12) {
+      case 0xa: case 0xb:
+         if ((cfg & 3) == 3 && m->haveRoms)
+            return m->basic[addr & 0x1fff];
+         break;
+      case 0xd:
+         if (cfg & 3)
+            return (cfg & 4) ? ioRead(m, addr) : m->chargen[addr & 0xfff];
+         break;
+      case 0xe: case 0xf:
+         if (cfg & 2)
+            return m->kernal[addr & 0x1fff];
+         break;
+   }
+   return m->ram[addr];
+}
+
+static void cpuWrite(struct machine* m, uint16_t addr, uint8_t v) {
+   if (addr == 0)
+      m->portDdr = v;
+   else if (addr == 1)
+      m->portData = v;
+
+   if ((addr >> 12) == 0xd && ioVisible(m))
+      ioWrite(m, addr, v);
+   else
+      m->ram[addr] = v;
+}
+
+// The VIC's fetch. RAM gets the address the DRAM latched. The char
+// ROM sees A8-A11 directly, so it follows the address through the
+// post CAS glitch. Colour RAM supplies the upper nibble.
+static void vicFetch(struct machine* m, uint16_t ado, uint8_t* dbl,
+                     uint8_t* dbh) {
+   uint16_t addr = (m->col << 8) | m->row;
+   int bank = ~m->cia2.pra & m->cia2.ddra & 3;
+   if (!(bank & 1) && (addr & 0x3000) == 0x1000)
+      *dbl = m->chargen[(ado & 0xf00) | m->row];
+   else
+      *dbl = m->ram[(bank << 14) | addr];
+   *dbh = m->colorRam[(ado & 0x300) | m->row];
+}
+
+// ------------------------------------------------- CPU without model
+
+// While booting and starting a program the CPU runs on its own. The
+// VIC is faked well enough for the kernal: its registers read back,
+// with a raster counter and the raster interrupt.
+static uint8_t fakeVicRead(struct machine* m, int reg) {
+   switch (reg) {
+      case 0x11:
+         return (m->vicRegs[0x11] & 0x7f) | ((m->rasterLine >> 1) & 0x80);
+      case 0x12:
+         return m->rasterLine & 0xff;
+      case 0x19:
+         return m->vicIrqFlags | 0x70 |
+            ((m->vicIrqFlags & m->vicRegs[0x1a] & 0xf) ? 0x80 : 0);
+      case 0x1e: case 0x1f:
+         return 0;
+      default:
+         return m->vicRegs[reg];
+   }
+}
+
+static void fakeVicWrite(struct machine* m, int reg, uint8_t v) {
+   if (reg == 0x19)
+      m->vicIrqFlags &= ~v;
+   else
+      m->vicRegs[reg] = v;
+}
+
+static void fakeRaster(struct machine* m) {
+   if (++m->rasterCycle < m->cyclesPerLine)
+      return;
+   m->rasterCycle = 0;
+   m->rasterLine = (m->rasterLine + 1) % m->numLines;
+   int compare = m->vicRegs[0x12] | ((m->vicRegs[0x11] & 0x80) << 1);
+   if (m->rasterLine == compare)
+      m->vicIrqFlags |= 1;
+}
+
+static void headlessCycle(struct machine* m) {
+   struct cpu6510* cpu = &m->cpu;
+   uint16_t addr = cpu->addr;
+   uint8_t data;
+   if (cpu->rw) {
+      data = isVicAddr(m, addr) ? fakeVicRead(m, addr & 0x3f) :
+         cpuRead(m, addr);
+   } else {
+      data = cpu->dout;
+      if (isVicAddr(m, addr))
+         fakeVicWrite(m, addr & 0x3f, data);
+      else
+         cpuWrite(m, addr, data);
+   }
+   m->lastBus = data;
+
+   ciaClock(&m->cia1);
+   ciaClock(&m->cia2);
+   fakeRaster(m);
+   cpu->irq = m->cia1.irq || (m->vicIrqFlags & m->vicRegs[0x1a] & 0xf);
+   cpu->nmi = m->cia2.irq;
+   cpu_tick(cpu, data);
+}
+
+// Runs until the CPU fetches an opcode at pc, or anywhere in RAM
+// above the stack when pc is -1. Returns 1 if that took too long.
+static int runUntil(struct machine* m, int pc, int maxCycles) {
+   struct cpu6510* cpu = &m->cpu;
+   for (int n = 0; n < maxCycles && !cpu->jammed; n++) {
+      if (cpu_fetching(cpu)) {
+         if (pc >= 0 ? cpu->addr == pc :
+                cpu->addr >= 0x200 && !romAt(m, cpu->addr))
+            return 0;
+      }
+      headlessCycle(m);
+   }
+   return 1;
+}
+
+// ------------------------------------------------------------ loading
+
+static int readFile(const char* filename, uint8_t** data, long* size) {
+   FILE* fp = fopen(filename, "rb");
+   if (!fp) {
+      LOG(LOG_ERROR, "can't open %s", filename);
+      return 1;
+   }
+   fseek(fp, 0, SEEK_END);
+   *size = ftell(fp);
+   fseek(fp, 0, SEEK_SET);
+   *data = (uint8_t*) malloc(*size > 0 ? *size : 1);
+   if (fread(*data, 1, *size, fp) != (size_t) *size) {
+      LOG(LOG_ERROR, "can't read %s", filename);
+      free(*data);
+      fclose(fp);
+      return 1;
+   }
+   fclose(fp);
+   return 0;
+}
+
+static bool loadRom(const char* dir, const char* name, uint8_t* rom,
+                    long size) {
+   char path[1024];
+   snprintf(path, sizeof(path), "%s/%s", dir, name);
+   FILE* fp = fopen(path, "rb");
+   if (!fp) {
+      LOG(LOG_WARN, "no %s", path);
+      return false;
+   }
+   bool ok = fread(rom, 1, size, fp) == (size_t) size;
+   fclose(fp);
+   if (!ok)
+      LOG(LOG_WARN, "%s is shorter than %ld bytes", path, size);
+   return ok;
+}
+
+// Just enough kernal for programs that don't call it: RTS everywhere,
+// the IRQ entry and exit the kernal has (so $0314 handlers work) and a
+// loop to return to instead of BASIC.
+static void stubKernal(struct machine* m) {
+   static const uint8_t irqEntry[] = {
+      0x48, 0x8a, 0x48, 0x98, 0x48,  // pha txa pha tya pha
+      0xba, 0xbd, 0x04, 0x01,        // tsx lda $0104,x
+      0x29, 0x10, 0xf0, 0x03,        // and #$10 beq +3
+      0x6c, 0x16, 0x03,              // jmp ($0316)
+      0x6c, 0x14, 0x03,              // jmp ($0314)
+   };
+   static const uint8_t irqExit[] = {
+      0x68, 0xa8, 0x68, 0xaa, 0x68, 0x40,  // pla tay pla tax pla rti
+   };
+   uint8_t* k = m->kernal;
+   memset(k, 0x60, sizeof(m->kernal));
+   memcpy(&k[0x1f48], irqEntry, sizeof(irqEntry));
+   memcpy(&k[0x0a81], irqExit, sizeof(irqExit));
+   k[0x0a31] = 0x4c; k[0x0a32] = 0x81; k[0x0a33] = 0xea;  // $ea31 jmp $ea81
+   k[0x0000] = 0x4c; k[0x0001] = 0x00; k[0x0002] = 0xe0;  // $e000 jmp $e000
+   k[0x1e66] = 0x4c; k[0x1e67] = 0x66; k[0x1e68] = 0xfe;  // $fe66 (BRK) hangs
+   k[0x1e47] = 0x40;                                      // $fe47 (NMI) rti
+   k[0x1ffa] = 0x47; k[0x1ffb] = 0xfe;
+   k[0x1ffc] = 0x00; k[0x1ffd] = 0xe0;
+   k[0x1ffe] = 0x48; k[0x1fff] = 0xff;
+}
+
+// What the kernal would have set up by the READY prompt
+static void stubBoot(struct machine* m) {
+   m->portDdr = 0x2f;
+   m->portData = 0x37;
+   m->ram[0] = 0x2f;
+   m->ram[1] = 0x37;
+   m->cia1.ddra = 0xff;
+   m->cia1.pra = 0x7f;
+   m->cia2.ddra = 0x3f;
+   m->cia2.pra = 0x17;  // bank 0
+   memset(&m->ram[0x0400], 0x20, 1000);
+   memset(m->colorRam, 0x0e, sizeof(m->colorRam));
+   m->ram[0x0314] = 0x31; m->ram[0x0315] = 0xea;
+   m->ram[0x0316] = 0x66; m->ram[0x0317] = 0xfe;
+   m->ram[0x0318] = 0x47; m->ram[0x0319] = 0xfe;
+   memcpy(m->vicRegs, kernalVicRegs, sizeof(kernalVicRegs));
+}
+
+// The address in a "10 SYS 2061" style first line, or -1
+static int sysAddress(struct machine* m, uint16_t load) {
+   uint16_t p = load + 4;  // skip the link and line number
+   while (m->ram[p] == ' ')
+      p++;
+   if (m->ram[p++] != 0x9e)  // SYS token
+      return -1;
+   while (m->ram[p] == ' ' || m->ram[p] == '(')
+      p++;
+   int addr = 0;
+   int digits = 0;
+   while (m->ram[p] >= '0' && m->ram[p] <= '9' && digits < 5) {
+      addr = addr * 10 + m->ram[p++] - '0';
+      digits++;
+   }
+   return digits && addr < 0x10000 ? addr : -1;
+}
+
+static void typeKeys(struct machine* m, const char* keys) {
+   int n = strlen(keys);
+   memcpy(&m->ram[0x0277], keys, n);
+   m->ram[0xc6] = n;
+}
+
+static int loadPrg(struct machine* m, const char* filename,
+                   uint8_t* data, long size) {
+   if (size < 3) {
+      LOG(LOG_ERROR, "%s is too short for a .prg", filename);
+      return 1;
+   }
+   uint16_t load = data[0] | (data[1] << 8);
+   long len = size - 2;
+   if (load + len > 0x10000)
+      len = 0x10000 - load;
+   uint16_t end = load + len;
+
+   struct cpu6510* cpu = &m->cpu;
+   if (!m->haveRoms) {
+      stubBoot(m);
+      memcpy(&m->ram[load], data + 2, len);
+      int sys = load == 0x0801 ? sysAddress(m, load) : load;
+      if (sys < 0) {
+         LOG(LOG_ERROR, "%s is BASIC, that needs the ROMs", filename);
+         return 1;
+      }
+      cpu_reset(cpu, sys);
+      cpu->p = CPU_FLAG_U;
+      // An RTS at the end lands in the stub's idle loop
+      cpu->s = 0xfb;
+      m->ram[0x01fd] = 0xdf;
+      m->ram[0x01fc] = 0xff;
+      LOG(LOG_INFO, "%s loaded at $%04x-$%04x, starting at $%04x",
+          filename, load, end - 1, sys);
+      return 0;
+   }
+
+   if (runUntil(m, KERNAL_READY_LOOP, BOOT_MAX_CYCLES)) {
+      LOG(LOG_ERROR, "no READY prompt after %d cycles, check the ROMs",
+          BOOT_MAX_CYCLES);
+      return 1;
+   }
+   LOG(LOG_VERBOSE, "booted in %llu cycles",
+       (unsigned long long) cpu->cycles);
+
+   // Same as VICE's autostart without disk: put it in memory, set
+   // BASIC's end pointers and type RUN (or SYS for machine code)
+   memcpy(&m->ram[load], data + 2, len);
+   uint16_t basicStart = m->ram[0x2b] | (m->ram[0x2c] << 8);
+   if (load == basicStart) {
+      for (int p = 0x2d; p <= 0x31; p += 2) {
+         m->ram[p] = end & 0xff;
+         m->ram[p + 1] = end >> 8;
+      }
+      typeKeys(m, "RUN\r");
+   } else {
+      char keys[11];
+      snprintf(keys, sizeof(keys), "SYS%d\r", load);
+      typeKeys(m, keys);
+   }
+   m->ram[0xae] = end & 0xff;
+   m->ram[0xaf] = end >> 8;
+
+   // Let BASIC get to the program. A program that stays in BASIC
+   // just carries on once the model is running.
+   if (runUntil(m, -1, START_MAX_CYCLES))
+      LOG(LOG_INFO, "%s didn't leave BASIC, handing over anyway", filename);
+   LOG(LOG_INFO, "%s loaded at $%04x-$%04x, running at $%04x",
+       filename, load, end - 1, cpu->addr);
+   return 0;
+}
+
+// VICE snapshot modules are a 16 byte name, major and minor version
+// and a 32 bit size that includes this 22 byte header
+#define VSF_MAGIC "VICE Snapshot File\032"
+#define VSF_VERSION_MAGIC "VICE Version\032"
+#define VSF_MODULE_HEADER 22
+
+// Where x64sc's VIC-II module (version 1.1) keeps the register image
+// and colour RAM, checked against the snapshots under tests/snapshots
+#define VSF_VIC_REGS 1
+#define VSF_VIC_COLOR_RAM 757
+
+static inline uint16_t le16(const uint8_t* p) {
+   return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t le32(const uint8_t* p) {
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// Takes RAM, the CPU, the VIC bank and the VIC-II's registers and
+// colour RAM from a snapshot. The VIC-II's internal state (raster
+// position, sprite and graphics sequencers) isn't restored.
+static int loadVsf(struct machine* m, const char* filename,
+                   const uint8_t* data, long size) {
+   long pos = strlen(VSF_MAGIC);
+   if (size < pos + 18 || memcmp(data, VSF_MAGIC, pos) != 0) {
+      LOG(LOG_ERROR, "%s is not a VICE snapshot", filename);
+      return 1;
+   }
+   pos += 2 + 16;  // version, machine name
+   long vlen = strlen(VSF_VERSION_MAGIC);
+   if (pos + vlen <= size &&
+          memcmp(data + pos, VSF_VERSION_MAGIC, vlen) == 0)
+      pos += vlen + 4 + 4;  // version, revision
+
+   stubBoot(m);
+   bool haveMem = false;
+   bool haveCpu = false;
+   bool haveVic = false;
+   while (pos + VSF_MODULE_HEADER <= size) {
+      const uint8_t* mod = data + pos;
+      uint32_t len = le32(mod + 18);
+      if (len < VSF_MODULE_HEADER ||
+             (unsigned long) pos + len > (unsigned long) size) {
+         LOG(LOG_ERROR, "%s: bad module size", filename);
+         return 1;
+      }
+      const uint8_t* body = mod + VSF_MODULE_HEADER;
+      uint32_t bodyLen = len - VSF_MODULE_HEADER;
+
+      if (strncmp((const char*) mod, "C64MEM", 16) == 0 &&
+             bodyLen >= 4 + 0x10000) {
+         m->portData = body[0];
+         m->portDdr = body[1];
+         memcpy(m->ram, body + 4, 0x10000);
+         haveMem = true;
+      } else if (strncmp((const char*) mod, "MAINCPU", 16) == 0 &&
+             bodyLen >= 11) {
+         cpu_reset(&m->cpu, le16(body + 8));
+         m->cpu.a = body[4];
+         m->cpu.x = body[5];
+         m->cpu.y = body[6];
+         m->cpu.s = body[7];
+         m->cpu.p = body[10] | CPU_FLAG_U;
+         haveCpu = true;
+      } else if (strncmp((const char*) mod, "CIA2", 16) == 0 &&
+             bodyLen >= 4) {
+         m->cia2.pra = body[0];
+         m->cia2.ddra = body[2];
+      } else if (strncmp((const char*) mod, "VIC-II", 16) == 0) {
+         if (mod[16] != 1 || mod[17] != 1 ||
+                bodyLen < VSF_VIC_COLOR_RAM + sizeof(m->colorRam)) {
+            LOG(LOG_ERROR, "%s: VIC-II module %d.%d isn't one we can read",
+                filename, mod[16], mod[17]);
+            return 1;
+         }
+         memcpy(m->vicRegs, body + VSF_VIC_REGS, sizeof(m->vicRegs));
+         for (unsigned i = 0; i < sizeof(m->colorRam); i++)
+            m->colorRam[i] = body[VSF_VIC_COLOR_RAM + i] & 0xf;
+         m->vicIrqFlags = m->vicRegs[0x19] & 0xf;
+         haveVic = true;
+      }
+      pos += len;
+   }
+
+   if (!haveMem || !haveCpu || !haveVic) {
+      LOG(LOG_ERROR, "%s has no C64MEM, MAINCPU or VIC-II module",
+          filename);
+      return 1;
+   }
+   LOG(LOG_INFO, "%s loaded, running at $%04x", filename, m->cpu.pc);
+   return 0;
+}
+
+// ------------------------------------------------------------- public
+
+struct machine* machine_open(const char* romDir, int cyclesPerLine,
+                             int numLines) {
+   struct machine* m = (struct machine*) calloc(1, sizeof(struct machine));
+
+   // DRAM comes up in 64 byte stripes, like VICE's default pattern
+   for (int i = 0; i < 0x10000; i++)
+      m->ram[i] = (i & 0x40) ? 0xff : 0x00;
+
+   if (romDir) {
+      bool kernal = loadRom(romDir, "kernal", m->kernal, sizeof(m->kernal));
+      bool basic = loadRom(romDir, "basic", m->basic, sizeof(m->basic));
+      if (!loadRom(romDir, "chargen", m->chargen, sizeof(m->chargen)))
+         memset(m->chargen, 0, sizeof(m->chargen));
+      m->haveRoms = kernal && basic;
+   }
+   if (!m->haveRoms) {
+      LOG(LOG_WARN, "no kernal and basic, using a stub kernal");
+      stubKernal(m);
+   }
+
+   ciaReset(&m->cia1);
+   ciaReset(&m->cia2);
+   m->cyclesPerLine = cyclesPerLine;
+   m->numLines = numLines;
+   cpu_reset(&m->cpu, le16(&m->kernal[0x1ffc]));
+
+   m->pins.ce = true;
+   m->pins.rw = true;
+   return m;
+}
+
+int machine_load(struct machine* m, const char* filename) {
+   uint8_t* data;
+   long size;
+   if (readFile(filename, &data, &size))
+      return 1;
+
+   const char* ext = strrchr(filename, '.');
+   int rc;
+   if (ext && strcasecmp(ext, ".vsf") == 0)
+      rc = loadVsf(m, filename, data, size);
+   else
+      rc = loadPrg(m, filename, data, size);
+   free(data);
+   return rc;
+}
+
+// phi2 rose, the CPU's half of the cycle. Reads from memory happen
+// now, register reads take the VIC's answer when phi2 falls.
+static void startCycle(struct machine* m, struct machine_pins* p) {
+   struct cpu6510* cpu = &m->cpu;
+
+   // RDY: stop on reads while the VIC wants the bus
+   m->stalled = cpu->rw && !p->ba;
+   m->vicAccess = false;
+   if (m->stalled)
+      return;
+
+   if (isVicAddr(m, cpu->addr)) {
+      m->vicAccess = true;
+      m->pins.ce = false;
+      m->pins.rw = cpu->rw;
+      m->pins.adl = cpu->addr & 0x3f;
+      m->cpuBus = cpu->rw ? m->lastBus : cpu->dout;
+   } else if (cpu->rw) {
+      m->cpuBus = cpuRead(m, cpu->addr);
+   } else {
+      cpuWrite(m, cpu->addr, cpu->dout);
+      m->cpuBus = cpu->dout;
+   }
+}
+
+static void endCycle(struct machine* m, struct machine_pins* p) {
+   struct cpu6510* cpu = &m->cpu;
+
+   ciaClock(&m->cia1);
+   ciaClock(&m->cia2);
+   cpu->irq = p->irq || m->cia1.irq;
+   cpu->nmi = m->cia2.irq;
+   if (m->stalled)
+      return;
+
+   uint8_t data = m->cpuBus;
+   if (m->vicAccess && cpu->rw)
+      data = p->dbo;
+   m->lastBus = data;
+
+   bool jammed = cpu->jammed;
+   cpu_tick(cpu, data);
+   if (cpu->jammed && !jammed)
+      LOG(LOG_WARN, "CPU jammed at $%04x", cpu->pc - 1);
+}
+
+bool machine_bus(struct machine* m, struct machine_pins* p) {
+   struct machine_pins before = m->pins;
+
+   // DRAM address latches
+   if (!p->ras && m->ras)
+      m->row = p->ado & 0xff;
+   if (!p->cas && m->cas)
+      m->col = p->ado & 0x3f;
+   m->ras = p->ras;
+   m->cas = p->cas;
+
+   if (p->phi && !m->phi) {
+      startCycle(m, p);
+   } else if (!p->phi && m->phi) {
+      endCycle(m, p);
+      m->ticksSincePhiFall = 0;
+   }
+   m->phi = p->phi;
+
+   if (!p->phi && ++m->ticksSincePhiFall == BUS_RELEASE_TICKS) {
+      m->pins.ce = true;
+      m->pins.rw = true;
+   }
+
+   // The VIC's fetch, or whatever the CPU has on the bus
+   if (!p->phi || !p->aec) {
+      vicFetch(m, p->ado, &m->pins.dbl, &m->pins.dbh);
+   } else {
+      m->pins.dbl = m->cpuBus;
+      m->pins.dbh = 0;
+   }
+
+   p->adl = m->pins.adl;
+   p->dbl = m->pins.dbl;
+   p->dbh = m->pins.dbh;
+   p->ce = m->pins.ce;
+   p->rw = m->pins.rw;
+   return before.adl != m->pins.adl || before.dbl != m->pins.dbl ||
+      before.dbh != m->pins.dbh || before.ce != m->pins.ce ||
+      before.rw != m->pins.rw;
+}
+
+void machine_free(struct machine* m) {
+   free(m);
+}
@@ -0,0 +1,128 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef VICII_MACHINE_H
+#define VICII_MACHINE_H
+
+#include <stdint.h>
+
+#include "cpu6510.h"
+
+// The rest of a C64 around the model, so programs run without VICE:
+// a 6510, 64K of DRAM, the ROMs, colour RAM and two CIAs (timers and
+// interrupts only, no keyboard, TOD or serial). SID and the expansion
+// port read back as open bus.
+//
+// machine_bus() is called once per tick with the model's pins. The
+// CPU gets the bus on phi2 when AEC is high and stops for BA on read
+// cycles. The VIC's fetches are answered from the address it puts on
+// the multiplexed bus, latched on the falling edges of RAS and CAS
+// like the DRAM does.
+
+struct machine_pins {
+   // From the model
+   bool phi;
+   bool ba;
+   bool aec;
+   bool irq;
+   bool ras;
+   bool cas;
+   uint16_t ado;
+   uint8_t dbo;
+
+   // To the model
+   uint8_t adl;
+   uint8_t dbl;
+   uint8_t dbh;
+   bool ce;
+   bool rw;
+};
+
+struct cia_timer {
+   uint16_t latch;
+   uint16_t counter;
+   int delay;  // cycles before a (re)started timer counts
+};
+
+struct cia {
+   uint8_t pra;
+   uint8_t prb;
+   uint8_t ddra;
+   uint8_t ddrb;
+   uint8_t cra;
+   uint8_t crb;
+   uint8_t icr;   // pending interrupts
+   uint8_t mask;  // enabled interrupts
+   uint8_t regs[16];  // what was written, for the registers not modelled
+   struct cia_timer ta;
+   struct cia_timer tb;
+   bool irq;
+};
+
+struct machine {
+   struct cpu6510 cpu;
+
+   uint8_t ram[0x10000];
+   uint8_t colorRam[0x400];
+   uint8_t basic[0x2000];
+   uint8_t kernal[0x2000];
+   uint8_t chargen[0x1000];
+   bool haveRoms;  // real kernal and basic, else a stub kernal
+
+   uint8_t portDdr;   // 6510 port at $00/$01
+   uint8_t portData;
+   struct cia cia1;
+   struct cia cia2;
+   uint8_t lastBus;
+
+   // VIC registers as the program left them before the model took
+   // over (after booting or loading), and a fake raster for that time
+   uint8_t vicRegs[64];
+   uint8_t vicIrqFlags;
+   int cyclesPerLine;
+   int numLines;
+   int rasterCycle;
+   int rasterLine;
+
+   // Bus state carried between ticks
+   struct machine_pins pins;
+   bool phi;
+   bool ras;
+   bool cas;
+   uint8_t row;
+   uint8_t col;
+   bool stalled;    // this cycle's read waits for BA
+   bool vicAccess;  // this cycle goes to the VIC's registers
+   uint8_t cpuBus;
+   int ticksSincePhiFall;
+};
+
+// romDir holds kernal, basic and chargen (VICE's names). NULL or
+// missing files fall back to a stub kernal and a blank charset.
+struct machine* machine_open(const char* romDir, int cyclesPerLine,
+                             int numLines);
+
+// Loads a .prg (and starts it, like RUN or SYS) or a .vsf snapshot.
+// Returns 1 on error.
+int machine_load(struct machine* m, const char* filename);
+
+// One tick. pins has the model's outputs filled in, this fills in its
+// inputs. Returns true when any input changed.
+bool machine_bus(struct machine* m, struct machine_pins* pins);
+
+void machine_free(struct machine* m);
+
+#endif
@@ -0,0 +1,77 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "present.h"
+#include "log.h"
+
+static unsigned long nowMs() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000UL;
+}
+
+int present_init(struct present_sched* ps, const char* spec) {
+   ps->mode = PRESENT_FRAME;
+   ps->interval = 1;
+   ps->lineCount = 0;
+   ps->lastMs = nowMs();
+
+   if (strcmp(spec, "frame") == 0) {
+      return 0;
+   } else if (strncmp(spec, "lines:", 6) == 0) {
+      ps->mode = PRESENT_LINES;
+      ps->interval = atoi(spec + 6);
+   } else if (strncmp(spec, "ms:", 3) == 0) {
+      ps->mode = PRESENT_TIME;
+      ps->interval = atoi(spec + 3);
+   } else {
+      LOG(LOG_ERROR, "bad present mode '%s' (frame, lines:N or ms:N)", spec);
+      return 1;
+   }
+
+   if (ps->interval <= 0) {
+      LOG(LOG_ERROR, "present interval must be > 0");
+      return 1;
+   }
+   return 0;
+}
+
+int present_due(struct present_sched* ps, int newFrame) {
+   switch (ps->mode) {
+      case PRESENT_LINES:
+         if (++ps->lineCount >= ps->interval) {
+            ps->lineCount = 0;
+            return 1;
+         }
+         return 0;
+      case PRESENT_TIME: {
+         unsigned long now = nowMs();
+         if (now - ps->lastMs >= (unsigned long)ps->interval) {
+            ps->lastMs = now;
+            return 1;
+         }
+         return 0;
+      }
+      case PRESENT_FRAME:
+      default:
+         return newFrame;
+   }
+}
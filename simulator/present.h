@@ -0,0 +1,44 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef VICII_PRESENT_H
+#define VICII_PRESENT_H
+
+// Decides when the window should be updated from the frame buffer.
+// The simulator asks once per raster line; presenting (and polling
+// SDL events) only happens when this says so, which keeps the
+// simulation from being throttled to the host display.
+
+#define PRESENT_FRAME 0  // once per completed frame
+#define PRESENT_LINES 1  // every N raster lines
+#define PRESENT_TIME  2  // at most once every N milliseconds
+
+struct present_sched {
+   int mode;
+   int interval;            // lines or milliseconds, depending on mode
+   int lineCount;
+   unsigned long lastMs;
+};
+
+// spec is one of "frame", "lines:N" or "ms:N"
+// Return 1 on error, 0 success
+int present_init(struct present_sched* ps, const char* spec);
+
+// Call when the raster line changes. newFrame is true when the line
+// wrapped around. Returns 1 if the window should be presented now.
+int present_due(struct present_sched* ps, int newFrame);
+
+#endif
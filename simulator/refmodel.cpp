@@ -0,0 +1,310 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "refmodel.h"
+#include "constants.h"
+#include "log.h"
+
+struct ref_model* ref_open(int chip) {
+   struct ref_model* ref =
+      (struct ref_model*) calloc(1, sizeof(struct ref_model));
+   switch (chip) {
+      case CHIP6567R8:
+         ref->numCycles = NTSC_6567R8_NUM_CYCLES;
+         ref->dmaCheck1 = 55;
+         ref->dmaCheck2 = 56;
+         ref->yexpCheck = 56;
+         ref->dispCheck = 58;
+         ref->firstSpriteCycle = 58;
+         break;
+      case CHIP6567R56A:
+         ref->numCycles = NTSC_6567R56A_NUM_CYCLES;
+         ref->dmaCheck1 = 55;
+         ref->dmaCheck2 = 56;
+         ref->yexpCheck = 56;
+         ref->dispCheck = 57;
+         ref->firstSpriteCycle = 58;
+         break;
+      default:
+         ref->numCycles = PAL_6569_NUM_CYCLES;
+         ref->dmaCheck1 = 54;
+         ref->dmaCheck2 = 55;
+         ref->yexpCheck = 55;
+         ref->dispCheck = 57;
+         ref->firstSpriteCycle = 57;
+         break;
+   }
+   return ref;
+}
+
+void ref_free(struct ref_model* ref) {
+   free(ref);
+}
+
+void ref_seed(struct ref_model* ref, const struct ref_state* st) {
+   ref->st = *st;
+}
+
+// Sprite n's p access. Its three s accesses follow in the high phase
+// of the same cycle and both phases of the next.
+static int pCycle(struct ref_model* ref, int n) {
+   return (ref->firstSpriteCycle + 2 * n) % ref->numCycles;
+}
+
+// Everything decided in the first phase. Like the design, decisions
+// made together all see the state from before any of them.
+static void lowPhase(struct ref_model* ref, const struct ref_inputs* in) {
+   struct ref_state* s = &ref->st;
+   const struct ref_state old = *s;
+   const int c = in->cycle;
+   const int line = in->line;
+
+   // DEN anywhere on line $30 allows bad lines for the frame. A write
+   // in its last cycle only lands at the start of the next line.
+   if (in->den && (line == 48 || (line == 49 && c == 0)))
+      s->allowBadLines = true;
+   if (line == 248)
+      s->allowBadLines = false;
+   s->badline = s->allowBadLines && line >= 48 && line < 248 &&
+      (line & 7) == in->yscroll;
+
+   for (int n = 0; n < 8; n++) {
+      const uint8_t bit = 1 << n;
+
+      // The ye flip flop is set as long as MxYE is clear. Clearing it
+      // on the cycle before mcbase is updated crunches mc.
+      if (!(in->spriteYe & bit) && !(old.yeFF & bit)) {
+         if (c == 15)
+            s->mc[n] = (0x2a & (old.mcBase[n] & old.mc[n])) |
+                       (0x15 & (old.mcBase[n] | old.mc[n]));
+         s->yeFF |= bit;
+      }
+
+      if ((c == ref->dmaCheck1 || c == ref->dmaCheck2) &&
+             !(old.dma & bit) && (in->spriteEn & bit) &&
+             (line & 0xff) == in->spriteY[n]) {
+         s->dma |= bit;
+         s->mcBase[n] = 0;
+         s->yeFF |= bit;
+      }
+
+      // mc counts the s accesses. It lags them by a phase.
+      int p = pCycle(ref, n);
+      if ((old.dma & bit) && (c == (p + 1) % ref->numCycles ||
+                              c == (p + 2) % ref->numCycles))
+         s->mc[n] = (old.mc[n] + 1) & 63;
+   }
+}
+
+static void highPhase(struct ref_model* ref, const struct ref_inputs* in) {
+   struct ref_state* s = &ref->st;
+   const struct ref_state old = *s;
+   const int c = in->cycle;
+
+   if (c == 1 && in->line == 0) {
+      s->vcBase = 0;
+      s->vc = 0;
+   }
+
+   // One increment after each g access
+   if (c > 14 && c < 55 && !old.idle)
+      s->vc = (old.vc + 1) & 0x3ff;
+
+   if (c == 13) {
+      s->vc = old.vcBase;
+      if (s->badline)
+         s->rc = 0;
+   }
+
+   if (c == 57) {
+      if (old.rc == 7) {
+         s->vcBase = old.vc;
+         s->idle = true;
+      }
+      if (!s->idle || s->badline) {
+         s->rc = (old.rc + 1) & 7;
+         s->idle = false;
+      }
+   }
+
+   for (int n = 0; n < 8; n++) {
+      const uint8_t bit = 1 << n;
+
+      // mcbase catches up with the three s accesses. The design does
+      // the +2 and +1 together.
+      if (c == 15 && (old.yeFF & bit)) {
+         s->mcBase[n] = old.mc[n];
+         if (old.mc[n] == 63)
+            s->dma &= ~bit;
+      }
+
+      if (c == ref->yexpCheck && (old.dma & bit) && (in->spriteYe & bit))
+         s->yeFF = (s->yeFF & ~bit) | (~old.yeFF & bit);
+
+      if (c == ref->dispCheck)
+         s->mc[n] = old.mcBase[n];
+
+      int p = pCycle(ref, n);
+      if ((old.dma & bit) && c == (p + 1) % ref->numCycles)
+         s->mc[n] = (old.mc[n] + 1) & 63;
+   }
+
+   // Late in the phase a bad line switches to display state
+   if (s->badline)
+      s->idle = false;
+}
+
+// The border flip flops work per pixel. The comparison values are the
+// usual ones moved 7 pixels right, where the design's pixels come out,
+// and the vertical ones only count in the second phase.
+static void borderPixel(struct ref_model* ref, const struct ref_inputs* in,
+                        int rasterX) {
+   struct ref_state* s = &ref->st;
+   const int xpos = rasterX >= 100 ? rasterX - 100 : -1;
+   const bool phi = (rasterX & 7) >= 4;
+   const bool top = (in->line == 55 && !in->rsel) ||
+                    (in->line == 51 && in->rsel);
+   const bool bottom = (in->line == 247 && !in->rsel) ||
+                       (in->line == 251 && in->rsel);
+
+   if ((xpos == 38 && !in->csel) || (xpos == 31 && in->csel)) {
+      if (bottom)
+         s->setVborder = true;
+      s->vborder = s->setVborder;
+      if (!s->vborder)
+         s->mainBorder = false;
+   } else if ((xpos == 351 && in->csel) || (xpos == 342 && !in->csel)) {
+      s->mainBorder = true;
+   }
+
+   if (phi) {
+      if (top && in->den) {
+         s->vborder = false;
+         s->setVborder = false;
+      }
+      if (bottom)
+         s->setVborder = true;
+      if (in->cycle == 0)
+         s->vborder = s->setVborder;
+   }
+}
+
+void ref_cycle(struct ref_model* ref, const struct ref_inputs* in) {
+   lowPhase(ref, in);
+   for (int i = 0; i < 4; i++)
+      borderPixel(ref, in, in->cycle * 8 + i);
+   highPhase(ref, in);
+   for (int i = 4; i < 8; i++)
+      borderPixel(ref, in, in->cycle * 8 + i);
+}
+
+int ref_compare(struct ref_model* ref, const struct ref_state* model,
+                int mask) {
+   const struct ref_state* s = &ref->st;
+   int diff = 0;
+
+   if (s->vc != model->vc || s->vcBase != model->vcBase)
+      diff |= REF_VC;
+   if (s->rc != model->rc)
+      diff |= REF_RC;
+   if (s->idle != model->idle)
+      diff |= REF_IDLE;
+   if (s->badline != model->badline)
+      diff |= REF_BADLINE;
+   if (s->dma != model->dma || s->yeFF != model->yeFF ||
+          memcmp(s->mc, model->mc, sizeof(s->mc)) ||
+          memcmp(s->mcBase, model->mcBase, sizeof(s->mcBase)))
+      diff |= REF_SPRITES;
+   if (s->vborder != model->vborder || s->mainBorder != model->mainBorder)
+      diff |= REF_BORDER;
+
+   ref->cycles++;
+   return diff & mask;
+}
+
+void ref_log_diff(struct ref_model* ref, const struct ref_state* model,
+                  int mask) {
+   const struct ref_state* s = &ref->st;
+   char name[16];
+
+   if (mask & REF_VC) {
+      logField("vc", s->vc, model->vc);
+      logField("vc_base", s->vcBase, model->vcBase);
+   }
+   if (mask & REF_RC)
+      logField("rc", s->rc, model->rc);
+   if (mask & REF_IDLE)
+      logField("idle", s->idle, model->idle);
+   if (mask & REF_BADLINE)
+      logField("badline", s->badline, model->badline);
+   if (mask & REF_SPRITES) {
+      logField("sprite_dma", s->dma, model->dma);
+      logField("ye_ff", s->yeFF, model->yeFF);
+      for (int n = 0; n < 8; n++) {
+         snprintf(name, sizeof(name), "mc%d", n);
+         logField(name, s->mc[n], model->mc[n]);
+         snprintf(name, sizeof(name), "mcbase%d", n);
+         logField(name, s->mcBase[n], model->mcBase[n]);
+      }
+   }
+   if (mask & REF_BORDER) {
+      logField("vborder", s->vborder, model->vborder);
+      logField("main_border", s->mainBorder, model->mainBorder);
+   }
+}
+
+int ref_parse_fields(const char* spec) {
+   static const struct {
+      const char* name;
+      int mask;
+   } fields[] = {
+      { "all", REF_ALL },
+      { "vc", REF_VC },
+      { "rc", REF_RC },
+      { "idle", REF_IDLE },
+      { "badline", REF_BADLINE },
+      { "sprites", REF_SPRITES },
+      { "border", REF_BORDER },
+   };
+
+   char buf[128];
+   if (strlen(spec) >= sizeof(buf)) {
+      LOG(LOG_ERROR, "reference model field list too long");
+      return 0;
+   }
+   strcpy(buf, spec);
+
+   int mask = 0;
+   char* save;
+   for (char* f = strtok_r(buf, ",", &save); f;
+           f = strtok_r(NULL, ",", &save)) {
+      unsigned int i;
+      for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+         if (strcmp(f, fields[i].name) == 0)
+            break;
+      }
+      if (i == sizeof(fields) / sizeof(fields[0])) {
+         LOG(LOG_ERROR, "unknown reference model field '%s'", f);
+         return 0;
+      }
+      mask |= fields[i].mask;
+   }
+   return mask;
+}
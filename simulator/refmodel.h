@@ -0,0 +1,112 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef VICII_REFMODEL_H
+#define VICII_REFMODEL_H
+
+#include <stdint.h>
+
+// A behavioural model of the VIC-II's sequencing state that runs next
+// to the Verilog one, one cycle at a time, as a check that needs no
+// VICE. It covers the video matrix counters (vc, vc_base, rc, idle),
+// the bad line condition, sprite dma, mc, mcbase and the y expansion
+// flip flops, and the border flip flops.
+//
+// Cycle numbers are the design's (0 is sprite 3's p access on a 6569),
+// and events land in the phase the chip does them. Register values
+// come from the model itself, so this checks what the chip does with
+// its registers, not how they are written.
+//
+// The caller samples the model twice per cycle:
+//
+//    phi rises   ref_inputs with the position and the registers
+//    phi falls   ref_cycle() runs the cycle, then ref_compare() checks
+//                the model's state against ours
+//
+// ref_seed() takes the model's state as it is, at the start and after
+// anything else (a VICE sync) changes it.
+
+// Fields for ref_compare()'s mask
+#define REF_VC       0x01  // vc and vc_base
+#define REF_RC       0x02
+#define REF_IDLE     0x04
+#define REF_BADLINE  0x08
+#define REF_SPRITES  0x10  // dma, mc, mcbase and the ye flip flops
+#define REF_BORDER   0x20  // vertical and main border flip flops
+#define REF_ALL      0x3f
+
+struct ref_inputs {
+   int line;
+   int cycle;
+   uint8_t yscroll;
+   bool den;
+   bool rsel;
+   bool csel;
+   uint8_t spriteEn;
+   uint8_t spriteYe;
+   uint8_t spriteY[8];
+};
+
+struct ref_state {
+   uint16_t vc;
+   uint16_t vcBase;
+   uint8_t rc;
+   bool idle;
+   bool badline;
+   bool allowBadLines;
+   uint8_t dma;
+   uint8_t yeFF;
+   uint8_t mc[8];
+   uint8_t mcBase[8];
+   bool vborder;
+   bool setVborder;
+   bool mainBorder;
+};
+
+struct ref_model {
+   int numCycles;
+   // Where this chip does its sprite checks (see vicii.v)
+   int dmaCheck1;
+   int dmaCheck2;
+   int yexpCheck;
+   int dispCheck;
+   int firstSpriteCycle;  // sprite 0's p access
+
+   struct ref_state st;
+   uint64_t cycles;  // compared so far
+};
+
+struct ref_model* ref_open(int chip);
+
+void ref_seed(struct ref_model* ref, const struct ref_state* st);
+
+void ref_cycle(struct ref_model* ref, const struct ref_inputs* in);
+
+// Returns the fields in mask where the model's state differs from ours
+int ref_compare(struct ref_model* ref, const struct ref_state* model,
+                int mask);
+
+// Logs each differing field in mask
+void ref_log_diff(struct ref_model* ref, const struct ref_state* model,
+                  int mask);
+
+// Parses a comma separated list of field names (vc, rc, idle, badline,
+// sprites, border or all) into a mask. Returns 0 on error.
+int ref_parse_fields(const char* spec);
+
+void ref_free(struct ref_model* ref);
+
+#endif
@@ -19,50 +19,72 @@
 #include <iostream>
 
 #include <ctype.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include <verilated.h>
+#if VM_SAVABLE
+#include <verilated_save.h>
+#endif
 #include <regex.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
 
 #include "Vtop.h"
 #include "constants.h"
 
 #if VM_TRACE
+#if VM_TRACE_FST
+// Built with make TRACE=fst. Verilator compresses and writes the
+// waveform on its own thread (--trace-threads).
+#include <verilated_fst_c.h>
+typedef VerilatedFstC SimTrace;
+#define TRACE_FILE "session.fst"
+#else
 #include <verilated_vcd_c.h>
+typedef VerilatedVcdC SimTrace;
+#define TRACE_FILE "session.vcd"
+#endif
 #endif
 
+#define MAX_TRACE_SCOPES 16
+
 extern "C" {
 #include "vicii_ipc.h"
 }
 #include "log.h"
-// Current simulation time (64-bit unsigned). See
-// constants.h for how much each tick represents.
-static vluint64_t ticks = 0;
-static vluint64_t half4XDotPS;
-static vluint64_t half16XColPS;
-static vluint64_t startTicks;
-static vluint64_t endTicks;
-static vluint64_t nextClk;
-static vluint64_t next16XColClk;
-static double col4xClk;
-static double col16xClk;
-static int nextClkCnt;
-static int screenWidth;
-static int screenHeight;
-static int lastXPos;
-static int numCycles;
+#include "framebuffer.h"
+#include "present.h"
+#include "edges.h"
+#include "tickrec.h"
+#include "trigger.h"
+#include "flightrec.h"
+#include "busrec.h"
+#include "diverge.h"
+#include "machine.h"
+#include "stim.h"
+#include "fuzz.h"
+#include "bench.h"
+#include "refmodel.h"
 
 // Some utility macros
 // Use RISING/FALLING in combination with HASCHANGED
 
-#define HASCHANGED(signum) \
-   ( SGETVAL(signum) != prev_signal_values[signum] )
-#define RISING(signum) \
-   ( SGETVAL(signum))
-#define FALLING(signum) \
-   ( !SGETVAL(signum))
+#define HASCHANGED(si, signum) \
+   ( SGETVAL(si, signum) != (si)->prev_signal_values[signum] )
+#define RISING(si, signum) \
+   ( SGETVAL(si, signum))
+#define FALLING(si, signum) \
+   ( !SGETVAL(si, signum))
 
 // Add new input/output here
 enum {
@@ -71,11 +93,175 @@ enum {
 
 #define NUM_SIGNALS 2
 
-static unsigned int signal_width[NUM_SIGNALS];
-static unsigned char *signal_src8[NUM_SIGNALS];
-static unsigned short *signal_src16[NUM_SIGNALS];
-static unsigned int signal_bit[NUM_SIGNALS];
-static unsigned char prev_signal_values[NUM_SIGNALS];
+// Everything the command line (or a -J job line) asks for
+struct sim_config {
+   int chip;
+   int logLevel;  // one for the whole process, so not in -J lines
+   bool hideSync;
+   bool showActive;
+   bool captureByTime;
+   bool showWindow;
+   bool shadowVic;
+   bool cycleByCycle;
+   bool tracing;
+   const char* traceScopes[MAX_TRACE_SCOPES];
+   int numTraceScopes;
+   bool viceCapture;
+   bool endCapture;
+   bool scanline;
+   const char* outFile;
+   const char* presentSpec;
+   bool vsync;
+   bool allClocks;
+   const char* recordFile;
+   int flightCycles;
+   const char* saveFile;
+   bool saveAtReset;
+   struct trigger_set saveTrigger;
+   struct trigger_set triggers;
+   const char* restoreFile;
+   int ipcSession;
+   const char* recordBusFile;
+   const char* replayFile;
+   const char* compareFile;
+   int divergeContext;
+   bool divergeStop;
+   int captureAfterMs;
+   vluint64_t startUs;
+   vluint64_t userDurationUs;
+
+   // Frame checks (-N, -I, -G, -H)
+   bool nativeFrames;
+   const char* refImageFile;
+   const char* diffImageFile;
+   bool haveExpectedHash;
+   uint64_t expectedHash;
+
+   // Many runs in one process (-J, -j)
+   const char* jobsFile;
+   int jobThreads;
+
+   // Built in CPU and memory instead of VICE (-m, -O)
+   const char* loadFile;
+   const char* romDir;
+
+   // Scripted bus events instead of a CPU (-e)
+   const char* stimFile;
+
+   // Fields the behavioural reference checks (-V), 0 when off
+   int refFields;
+
+   // Random register writes instead of a script (-f, -n)
+   uint64_t fuzzSeed;
+   int fuzzSeeds;   // seeds to run from fuzzSeed on, 0 when off
+   int fuzzFrames;
+   // Part of a fuzz script to run instead, while minimizing
+   struct stim_event* fuzzEvents;
+   int numFuzzEvents;
+   bool quiet;      // no FAIL reports (runs made while minimizing)
+
+   // Timing (--bench, --bench-label) and a fixed length (--frames)
+   bool bench;
+   const char* benchFile;
+   const char* benchLabel;
+   int frames;
+};
+
+struct sim_instance;
+
+// Runs ticks of the loop built for the instance's chip. See stepChip().
+typedef bool (*sim_step_fn)(struct sim_instance* si, vluint64_t maxTicks);
+
+// One simulated chip and everything that goes with it. main() runs one
+// of these; -J runs several at once on worker threads, so nothing a
+// run changes may live outside of it.
+struct sim_instance {
+   struct sim_config cfg;
+   char prefix[16];  // for files every run writes, "" or "jobN."
+
+   Vtop* top;
+#if VERILATOR_VERSION_INTEGER >= 4210000
+   VerilatedContext* context;
+#endif
+   SimTrace* tfp;
+   struct vicii_ipc* ipc;
+   struct vicii_state* state;
+   struct framebuffer* fb;
+   SDL_Renderer* ren;
+   SDL_Texture* tex;
+   bool render;
+   struct present_sched presentSched;
+   struct trigger_set* triggers;  // NULL when always tracing
+   struct trigger_set* saveTrigger;  // NULL unless --save-at an event
+   sim_step_fn step;
+
+   // Current simulation time (64-bit unsigned). See
+   // constants.h for how much each tick represents.
+   vluint64_t ticks;
+   vluint64_t half4XDotPS;
+   vluint64_t startTicks;
+   vluint64_t endTicks;
+   struct edge_schedule edgeSched;
+   int nextClkCnt;
+   struct tickrec* tickRec;
+   struct flightrec* flightRec;
+   struct busrec* busRec;
+   // Reference for --replay and --compare
+   struct busrec* refRec;
+   bool comparing;
+   bool compareInputs;  // --compare, inputs come from VICE
+   uint64_t inputMismatches;
+   struct diverge* divergeRep;
+   char divergeFile[64];
+   char screenshotFile[64];  // -o's default
+   struct machine* machine;  // NULL unless --load
+   struct stim_script* stim;  // NULL unless --stim
+   struct ref_model* ref;  // NULL unless --ref-model
+   struct bench* bench;  // NULL unless --bench
+   struct ref_inputs refIn;
+   bool refPhi;
+   bool refSeeded;
+   bool refHaveInputs;
+   int screenWidth;
+   int screenHeight;
+   int lastXPos;
+   int numCycles;
+
+   unsigned int signal_width[NUM_SIGNALS];
+   unsigned char *signal_src8[NUM_SIGNALS];
+   unsigned short *signal_src16[NUM_SIGNALS];
+   unsigned int signal_bit[NUM_SIGNALS];
+   unsigned char prev_signal_values[NUM_SIGNALS];
+
+   // Loop state carried from one tick to the next
+   bool capture;
+   bool captureByFrame;
+   int captureByFrameStopXpos;
+   int captureByFrameStopYpos;
+   int cycleByCycleCount;
+   int last_phase;
+   int prevY;
+   int frameNum;
+   bool keyPressToQuit;
+   bool windowClosed;
+   int ticksUntilDone;
+   int ticksUntilPhase;
+   bool showState;
+   bool viceCaptureWaitLine1;
+   bool inputsChanged;
+   // Batch mode (VICII_OP_BATCH)
+   struct vicii_batch* batch;
+   unsigned int batchPos;
+   unsigned int batchCount;
+   unsigned char lastRegs[64];
+
+   bool frameSaved;  // -x already wrote the last frame
+   bool stimDone;    // the --stim script is over and ends the run
+   bool failed;      // a CHECK failed or a file couldn't be written
+};
+
+// The run the fatal signal handlers dump, if there is only one
+static struct sim_instance* signalSim;
 
 // Used when no RGB is avaiable (i.e. composite only)
 int native_rgb[] = {
@@ -98,185 +284,183 @@ int native_rgb[] = {
 };
 
 
-static char cycleToChar(int cycle){
-  switch (cycle) {
-    case VIC_LP   : return '#';
-    case VIC_LPI2 : return 'i';
-    case VIC_LS2  : return 's';
-    case VIC_LR   : return 'r';
-    case VIC_LG   : return 'g';
-    case VIC_HS1  : return 'S';
-    case VIC_HPI1 : return 'I';
-    case VIC_HPI3 : return 'I';
-    case VIC_HS3  : return 'S';
-    case VIC_HRI  : return 'I';
-    case VIC_HRC  : return 'C';
-    case VIC_HGC  : return 'C';
-    case VIC_HGI  : return 'I';
-    case VIC_HI   : return 'I';
-    case VIC_LI   : return 'i';
-    case VIC_HRX  : return 'x';
-    default:
-       LOG(LOG_ERROR,"bad cycle");
-       exit(-1);
-  }
-}
-
 // TODO : Add a signal_shift so we can shift before we mask with signal
 // bit in case we want to isolate higher bits of a signal?
-static int SGETVAL(int signum) {
-  if (signal_width[signum] == 1) {
+static int SGETVAL(struct sim_instance* si, int signum) {
+  if (si->signal_width[signum] == 1) {
      // When width is 1, we can pick out any bit
-     return (*signal_src8[signum] & signal_bit[signum] ? 1 : 0);
-  } else if (signal_width[signum] <= 8) {
-     return (*signal_src8[signum] & signal_bit[signum]);
-  } else if (signal_width[signum] > 8 && signal_width[signum] < 16) {
-     return (*signal_src16[signum] & signal_bit[signum]);
+     return (*si->signal_src8[signum] & si->signal_bit[signum] ? 1 : 0);
+  } else if (si->signal_width[signum] <= 8) {
+     return (*si->signal_src8[signum] & si->signal_bit[signum]);
+  } else if (si->signal_width[signum] > 8 && si->signal_width[signum] < 16) {
+     return (*si->signal_src16[signum] & si->signal_bit[signum]);
   } else {
     abort();
   }
 }
 
+// The column header for STATE()
 static void HEADER(Vtop *top) {
-   LOG(LOG_VERBOSE,
-   "  "
-   "D4X "
-   "CNT "
-   "POS "
-   "CYC "
-   "DOTR "
-   "PHI "
-   "BIT "
-   "IRQ "
-   "BA "
-   "AEC "
-   "VCY "
-   "RAS "
-   "CAS "
-   " X  "
-   " Y  "
-   " Y  "
-   "ADI  "
-   "ADO  "
-   "DBI "
-   "DBO "
-   "RW "
-   "CE "
-   "RFC "
-   "BIN"
-  );
+   if (logLevel >= LOG_VERBOSE) {
+      printf ("%s: ", logLevelStr[logLevel]);
+      tickrec_print_header(stdout);
+   }
 }
 
-static void STATE(Vtop *top) {
-   if ((top->V_DOT4X & 1) == 0) return;
+// Binary version of STATE() for -R and the flight recorder
+static void fillRecord(struct sim_instance* si, struct tick_record* r) {
+   Vtop* top = si->top;
+   r->ticks = si->ticks;
+   r->phir = top->V_PHIR;
+   r->xpos = top->V_XPOS;
+   r->raster_x = top->V_RASTER_X;
+   r->raster_line = top->V_RASTER_LINE;
+   r->raster_line_d = top->V_RASTER_LINE_D;
+   r->ado = top->V_ADO;
+   r->vicaddr = top->V_VICADDR;
+   r->pps = top->V_PPS;
+   r->flags =
+      (top->V_RST ? TR_RST : 0) |
+      (top->V_DOT4X ? TR_DOT4X : 0) |
+      (HASCHANGED(si, OUT_DOT) && RISING(si, OUT_DOT) ? TR_DOTEDGE : 0) |
+      (top->V_CLK_DOT & 8 ? TR_DOTR : 0) |
+      (top->clk_phi ? TR_PHI : 0) |
+      (top->irq ? TR_IRQ : 0) |
+      (top->ba ? TR_BA : 0) |
+      (top->aec ? TR_AEC : 0) |
+      (top->ras ? TR_RAS : 0) |
+      (top->cas ? TR_CAS : 0) |
+      (top->rw ? TR_RW : 0) |
+      (top->ce ? TR_CE : 0) |
+      (top->V_BADLINE ? TR_BADLINE : 0) |
+      (top->V_BMM ? TR_BMM : 0);
+   r->cnt = si->nextClkCnt;
+   r->cycle_num = top->V_CYCLE_NUM;
+   r->cycle_bit = top->V_CYCLE_BIT;
+   r->cycle_type = top->V_CYCLE_TYPE;
+   r->adl = top->adl;
+   r->dbi = top->V_DBI;
+   r->dbo = top->V_DBO;
+   r->refc = top->V_REFC;
+   r->rc = top->V_RC;
+   r->sprite_mc0 = top->V_SPRITE_MC[0];
+   r->sprite_mcbase0 = top->V_SPRITE_MCBASE[0];
+   r->pad = 0;
+}
 
-   if(HASCHANGED(OUT_DOT) && RISING(OUT_DOT))
-      HEADER(top);
+static void RECORD(struct sim_instance* si) {
+   fillRecord(si, tickrec_next(si->tickRec));
+}
+
+// Remember this tick in the flight recorder (-B)
+static inline void FLIGHT(struct sim_instance* si) {
+   if (si->flightRec && (si->top->V_DOT4X & 1))
+      fillRecord(si, flightrec_next(si->flightRec));
+}
+
+static void closeTickRec(struct sim_instance* si) {
+   if (si->tickRec) {
+      tickrec_close(si->tickRec);
+      si->tickRec = nullptr;
+   }
+}
+
+// One CPU cycle is 32 dot4x periods
+static inline vluint64_t cycleTicks(struct sim_instance* si) {
+   return 64 * si->half4XDotPS;
+}
+
+// Files every run writes get the run's prefix
+static const char* simFile(struct sim_instance* si, const char* name,
+                           char* buf, int size) {
+   snprintf(buf, size, "%s%s", si->prefix, name);
+   return buf;
+}
+
+static void dumpFlightRec(struct sim_instance* si) {
+   if (si->flightRec) {
+      char name[64];
+      flightrec_dump(si->flightRec,
+                     simFile(si, "flightrec", name, sizeof(name)));
+      flightrec_free(si->flightRec);
+      si->flightRec = nullptr;
+   }
+}
 
-   LOG(LOG_VERBOSE,
-   "%c "      /*DOT*/
-   "%01d   "   /*D4x*/
-   "%02d  "   /*CNT*/
-   "%03x "   /*POS*/
-   " %02d "  /*CYC*/
-   " %01d  "   /*DOTR*/
-   " %01d  "   /*PHI*/
-   " %01d  "   /*BIT*/
-   " %01d  "   /*IRQ*/
-   " %01d  "   /*BA */
-   " %01d  "   /*AEC*/
-   "%c  "     /*VCY*/
-   " %01d  "   /*RAS*/
-   " %01d  "   /*CAS*/
-   "%03d "   /*  X*/
-   "%03d "   /*  Y*/
-   "%03d "   /*  Y*/
-   "%04x "   /*ADI*/
-   "%04x "   /*ADO*/
-   " %02x "   /*DBI*/
-   " %02x "   /*DBO*/
-   " %01d "   /* RW*/
-   " %01d "   /* CE*/
-   "%02x "   /*RFC*/
-   " %s"     /*BIN*/
-   " %s"     /*BIN*/
-   " %s"     /*BIN*/
-   " %d"     /*badline*/
-
-   " %03d"
-   " %03d"
-   " %01d"
-   " %04x"
-   " %01d"
-   ,
-
-   top->V_RST ? 'R' : HASCHANGED(OUT_DOT) && RISING(OUT_DOT) ? '*' : ' ',
-   top->V_DOT4X ? 1 : 0,
-   nextClkCnt,
-   top->V_XPOS,
-   top->V_CYCLE_NUM,
-   top->V_CLK_DOT & 8 ? 1 : 0,
-   top->clk_phi,
-   top->V_CYCLE_BIT,
-   top->irq,
-   top->ba,
-   top->aec,
-   cycleToChar(top->V_CYCLE_TYPE),
-   top->ras,
-   top->cas,
-   top->V_RASTER_X,
-   top->V_RASTER_LINE,
-   top->V_RASTER_LINE_D,
-   top->adl,
-   top->V_ADO,
-   top->V_DBI,
-   top->V_DBO,
-   top->rw,
-   top->ce,
-   top->V_REFC,
-
-   //toBin(16, top->V_RASR),
-   //toBin(16, top->V_CASR),
-
-   toBin(16, top->V_PPS),
-   toBin(32, top->V_PHIR),
-   " ",
-
-   //toBin(16, top->V_DOTRISINGR),
-   //toBin(32, top->V_DOTR),
-   //" ",
-
-   top->V_BADLINE,
-
-   top->V_SPRITE_MC[0],
-   top->V_SPRITE_MCBASE[0],
-   top->V_RC,
-   top->V_VICADDR,
-   top->V_BMM
-   //top->V_NEXTCHAR
-   );
+// Not async signal safe, but we are going down anyway and the dump is
+// the whole point.
+static void flightRecSignal(int sig) {
+   printf ("caught signal %d\n", sig);
+   if (signalSim) {
+      dumpFlightRec(signalSim);
+      closeTickRec(signalSim);
+   }
+   signal(sig, SIG_DFL);
+   raise(sig);
 }
 
+// Logs this tick at level 4. The columns come from tickrec_print() so
+// the live log and tickdump's output stay the same.
+static void STATE(struct sim_instance* si) {
+   Vtop* top = si->top;
+   if ((top->V_DOT4X & 1) == 0) return;
+
+   if (si->tickRec) {
+      RECORD(si);
+      return;
+   }
+
+   if (logLevel < LOG_VERBOSE) return;
+
+   if(HASCHANGED(si, OUT_DOT) && RISING(si, OUT_DOT))
+      HEADER(top);
 
+   struct tick_record r;
+   fillRecord(si, &r);
+   printf ("%s: ", logLevelStr[logLevel]);
+   tickrec_print(stdout, &r);
+}
 
-static void STORE_PREV() {
+static void STORE_PREV(struct sim_instance* si) {
   for (int i = 0; i < NUM_SIGNALS; i++) {
-     prev_signal_values[i] = SGETVAL(i);
+     si->prev_signal_values[i] = SGETVAL(si, i);
   }
 }
 
 
-static void CHECK(Vtop *top, int cond, int line) {
-  if (!cond) {
-     printf ("FAIL line %d:", line);
-     STATE(top);
-     exit(-1);
-  }
+// Ends the run at the end of this tick and reports why, after "FAIL ".
+// Only the first failure is reported. Returns true if this one was
+// printed, so the caller can add details.
+static bool failRun(struct sim_instance* si, const char* fmt, ...) {
+  if (si->failed)
+     return false;
+  closeTickRec(si);
+  dumpFlightRec(si);
+  si->failed = true;
+  if (si->cfg.quiet)
+     return false;
+  va_list ap;
+  va_start(ap, fmt);
+  printf ("%sFAIL ", si->prefix);
+  vprintf (fmt, ap);
+  va_end(ap);
+  STATE(si);
+  return true;
+}
+
+static void CHECK(struct sim_instance* si, int cond, int line) {
+  if (!cond)
+     failRun(si, "line %d:", line);
+}
+
+// A --stim expectation didn't hold. Reported like a failed CHECK.
+static void stimFailed(struct sim_instance* si) {
+  failRun(si, "%s:", si->stim->error);
 }
 
 // We can drive our simulated clock gen every pico second but that would
-// be a waste since nothing happens between clock edges. This function
-// will determine how many ticks(picoseconds) to advance our clock.
+// be a waste since nothing happens between clock edges. The edge
+// schedule (see edges.h) tells us when the next clock edge happens.
 
 // tick_scale_* simulates a clk_dvi signal that is slower in the right
 // fraction of the master dot4x clock.  For efinix, we use a slower clock
@@ -285,7 +469,7 @@ static void CHECK(Vtop *top, int cond, int line) {
 
 #ifdef EFINIX
 #ifdef WITH_DVI
-static long tc = 0;
+#define DRIVE_DVI_CLOCK 1
 
 // The fraction of dot4x to dviclk changes between our two
 // alternate PAL clocks. The dot clock can be switched at build
@@ -316,60 +500,292 @@ static int tick_scale_ntsc[] = {1,1,1,0,1,1,1,1,0,1,1,1,0,1,1,1};
 #endif
 #endif
 
-double col16xtick = 0;
+// col16x only has loads when there is a luma/chroma generator or, on
+// efinix, when address generation is timed off of it.
+#if defined(GEN_LUMA_CHROMA) || defined(EFINIX)
+#define HAVE_COL16X_LOADS 1
+#endif
+
+// The parts --bench times. Without it these cost a branch.
+static inline uint64_t benchStart(struct sim_instance* si) {
+   return si->bench ? bench_now() : 0;
+}
 
-static vluint64_t nextTick(Vtop* top, VerilatedVcdC* tfp, int chip) {
-   vluint64_t diff1 = nextClk - ticks;
+static inline void benchStop(struct sim_instance* si, int part,
+                             uint64_t start) {
+   if (si->bench) {
+      si->bench->ns[part] += bench_now() - start;
+      si->bench->calls[part]++;
+   }
+}
 
-   nextClk += half4XDotPS;
+static inline void evalModel(struct sim_instance* si) {
+   uint64_t start = benchStart(si);
+   si->top->eval();
+   benchStop(si, BENCH_EVAL, start);
+}
 
-   top->V_DOT4X = ~top->V_DOT4X;
-   
-#ifdef EFINIX
-#ifdef WITH_DVI
-   // Emulate our dvi clock in the correct fraction of the dot4x clock
-   if (chip & 1) {
-      if (tick_scale_pal[tc])
-         top->V_CLK_DVI = ~top->V_CLK_DVI;
-   } else {
-      if (tick_scale_ntsc[tc])
-         top->V_CLK_DVI = ~top->V_CLK_DVI;
+#if VM_TRACE
+static inline void dumpTrace(struct sim_instance* si, SimTrace* tfp,
+                             vluint64_t t) {
+   if (tfp) {
+      uint64_t start = benchStart(si);
+      tfp->dump(t / TICKS_TO_TIMESCALE);
+      benchStop(si, BENCH_TRACE, start);
    }
+}
+#endif
 
-   tc++;
-   if (tc>=16) tc=0;
+// Advance to the next dot4x edge. Any col16x edges that fall
+// between dot4x edges are evaluated (and traced) on their own. The
+// dot4x edge itself is evaluated here too and the new time is
+// returned; the caller traces it after applying any input changes.
+static vluint64_t nextTick(struct sim_instance* si, SimTrace* tfp) {
+   Vtop* top = si->top;
+   vluint64_t t;
+   unsigned char mask;
+
+   while (!((mask = edges_next(&si->edgeSched, &t)) & EDGE_DOT4X)) {
+      top->V_COL16X = ~top->V_COL16X;
+      evalModel(si);
+#if VM_TRACE
+      dumpTrace(si, tfp, t);
 #endif
+   }
+
+   top->V_DOT4X = ~top->V_DOT4X;
+   if (mask & EDGE_COL4X)
+      top->V_COL4X = ~top->V_COL4X;
+#ifdef DRIVE_DVI_CLOCK
+   // Our dvi clock toggles in the correct fraction of the dot4x clock
+   if (mask & EDGE_DVI)
+      top->V_CLK_DVI = ~top->V_CLK_DVI;
 #endif
+   if (mask & EDGE_COL16X)
+      top->V_COL16X = ~top->V_COL16X;
+   evalModel(si);
+
+   si->nextClkCnt = (si->nextClkCnt + 1) % 32;
+   return t;
+}
 
-   top->V_COL4X = ~top->V_COL4X;
+// Each native line is drawn twice in the frame buffer.
+static void drawPixel(struct framebuffer* fb, int x,int y, unsigned int color) {
+   fb_set(fb, x, y*2, color);
+   fb_set(fb, x, y*2+1, color);
+}
 
-   // One tick of dot4x 
-   // = 9/4 ticks of col16x for PAL, 7/4 ticks of col16x for NTSC
+// Upload the frame buffer to the window.
+static void present(SDL_Renderer* ren, SDL_Texture* tex,
+                    struct framebuffer* fb) {
+   SDL_UpdateTexture(tex, NULL, fb->pixels, fb->width * sizeof(unsigned int));
+   SDL_RenderCopy(ren, tex, NULL, NULL);
+   SDL_RenderPresent(ren);
+}
 
-   if (chip & 1) {
-       col16xtick += 9.0f/4.0d;
-   } else {
-       col16xtick += 7.0f/4.0d;
+// If the output filename has a printf style % in it (i.e. frame%03d.png),
+// every completed frame is written. Otherwise only the last one is.
+// Returns 1 on error.
+static int saveFrame(struct sim_instance* si) {
+   struct framebuffer* fb = si->fb;
+   char filename[256];
+   snprintf(filename, sizeof(filename), si->cfg.outFile, si->frameNum);
+   struct framebuffer* out = si->cfg.nativeFrames ? fb_half(fb) : fb;
+   int rc = fb_save(out, filename);
+   if (out != fb) fb_free(out);
+   if (rc) {
+      si->failed = true;
+      return 1;
    }
+   LOG(LOG_INFO, "wrote frame %d to %s", si->frameNum, filename);
+   return 0;
+}
 
-   next16XColClk = nextClk;
-   while (col16xtick >= 1) {
-       top->V_COL16X = ~top->V_COL16X;
-       top->eval();
-#if VM_TRACE
-       if (tfp) tfp->dump(next16XColClk / TICKS_TO_TIMESCALE);
-#endif
-       next16XColClk += half16XColPS;
-       col16xtick -= 1;
+// Hash the last frame at native resolution and check it against
+// --expect-hash and --ref-image. Returns 1 if it fails either.
+static int checkFrame(struct sim_instance* si) {
+   struct framebuffer* fb = si->fb;
+   const char* refImageFile = si->cfg.refImageFile;
+   const char* diffImageFile = si->cfg.diffImageFile;
+   struct framebuffer* native = fb_half(fb);
+   uint64_t hash = fb_hash(native);
+   printf ("%sframe hash %016llx\n", si->prefix, (unsigned long long) hash);
+
+   int fail = 0;
+   if (si->cfg.haveExpectedHash && hash != si->cfg.expectedHash) {
+      printf ("%sexpected frame hash %016llx\n", si->prefix,
+              (unsigned long long) si->cfg.expectedHash);
+      fail = 1;
+   }
+
+   if (refImageFile) {
+      struct framebuffer* ref = fb_load(refImageFile);
+      if (ref && ref->width == fb->width && ref->height == fb->height) {
+         // Saved without -N
+         struct framebuffer* half = fb_half(ref);
+         fb_free(ref);
+         ref = half;
+      }
+      if (!ref) {
+         fail = 1;
+      } else {
+         struct framebuffer* diff = diffImageFile ?
+            fb_init(native->width, native->height) : NULL;
+         long n = fb_diff(native, ref, diff);
+         if (n < 0) {
+            LOG(LOG_ERROR, "%s is %dx%d, frame is %dx%d", refImageFile,
+                ref->width, ref->height, native->width, native->height);
+            fail = 1;
+         } else {
+            printf ("%s%ld pixels differ from %s\n", si->prefix, n,
+                    refImageFile);
+            if (n) fail = 1;
+            if (diff && fb_save(diff, diffImageFile)) fail = 1;
+         }
+         if (diff) fb_free(diff);
+         fb_free(ref);
+      }
    }
 
-   nextClkCnt = (nextClkCnt + 1) % 32;
-   return ticks + diff1;
+   if (refImageFile || si->cfg.haveExpectedHash)
+      printf ("%sverdict: %s\n", si->prefix, fail ? "fail" : "pass");
+   fb_free(native);
+   return fail;
+}
+
+// Harness state saved alongside the model by --save-at
+#define CHECKPOINT_MAGIC "KWCP"
+#define CHECKPOINT_VERSION 2
+
+struct checkpoint_header {
+   char magic[4];
+   int version;
+   int chip;
+   vluint64_t ticks;
+   vluint64_t edgeUnits;
+   int nextClkCnt;
+   unsigned char prev[NUM_SIGNALS];
+};
+
+// Appended after Verilator's own trailer. A short read from
+// VerilatedRestore just gives zeros, so the file's size is checked
+// against this before any of it is restored.
+struct checkpoint_footer {
+   char magic[4];
+   int pad;
+   vluint64_t size;
+};
+
+// Returns 1 on error
+static int saveCheckpoint(struct sim_instance* si, const char* filename) {
+#if VM_SAVABLE
+   struct checkpoint_header hdr;
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, CHECKPOINT_MAGIC, 4);
+   hdr.version = CHECKPOINT_VERSION;
+   hdr.chip = si->cfg.chip;
+   hdr.ticks = si->ticks;
+   hdr.edgeUnits = edges_now(&si->edgeSched);
+   hdr.nextClkCnt = si->nextClkCnt;
+   memcpy(hdr.prev, si->prev_signal_values, sizeof(hdr.prev));
+
+   VerilatedSave os;
+   os.open(filename);
+   if (!os.isOpen()) {
+      LOG(LOG_ERROR, "can't write checkpoint %s", filename);
+      return 1;
+   }
+   os.write(&hdr, sizeof(hdr));
+   os << *si->top;
+   os.close();
+
+   struct checkpoint_footer foot;
+   memset(&foot, 0, sizeof(foot));
+   memcpy(foot.magic, CHECKPOINT_MAGIC, 4);
+   struct stat st;
+   FILE* fp = fopen(filename, "ab");
+   bool ok = fp && stat(filename, &st) == 0;
+   if (ok) {
+      foot.size = st.st_size + sizeof(foot);
+      ok = fwrite(&foot, sizeof(foot), 1, fp) == 1;
+   }
+   if (fp && fclose(fp) != 0)
+      ok = false;
+   if (!ok) {
+      LOG(LOG_ERROR, "can't write checkpoint %s", filename);
+      return 1;
+   }
+   LOG(LOG_INFO, "saved checkpoint %s", filename);
+   return 0;
+#else
+   LOG(LOG_ERROR, "checkpoints need a model built with SAVABLE=1");
+   return 1;
+#endif
 }
 
-static void drawPixel(SDL_Renderer* ren, int x,int y) {
-   SDL_RenderDrawPoint(ren, x,y*2);
-   SDL_RenderDrawPoint(ren, x,y*2+1);
+// Returns 1 on error. The model must be the same design and chip.
+static int loadCheckpoint(struct sim_instance* si, const char* filename) {
+#if VM_SAVABLE
+   const int chip = si->cfg.chip;
+   struct checkpoint_header hdr;
+   struct checkpoint_footer foot;
+   FILE* fp = fopen(filename, "rb");
+   if (!fp) {
+      LOG(LOG_ERROR, "can't read checkpoint %s", filename);
+      return 1;
+   }
+   struct stat st;
+   bool whole = fstat(fileno(fp), &st) == 0 &&
+      st.st_size >= (off_t) (sizeof(hdr) + sizeof(foot)) &&
+      fseek(fp, -(long) sizeof(foot), SEEK_END) == 0 &&
+      fread(&foot, sizeof(foot), 1, fp) == 1 &&
+      memcmp(foot.magic, CHECKPOINT_MAGIC, 4) == 0 &&
+      foot.size == (vluint64_t) st.st_size;
+   fclose(fp);
+   if (!whole) {
+      LOG(LOG_ERROR, "checkpoint %s is truncated or not a checkpoint",
+          filename);
+      return 1;
+   }
+   VerilatedRestore os;
+   os.open(filename);
+   if (!os.isOpen()) {
+      LOG(LOG_ERROR, "can't read checkpoint %s", filename);
+      return 1;
+   }
+   os.read(&hdr, sizeof(hdr));
+   if (!os.isOpen()) {
+      LOG(LOG_ERROR, "can't read checkpoint %s", filename);
+      return 1;
+   }
+   if (memcmp(hdr.magic, CHECKPOINT_MAGIC, 4) != 0 ||
+          hdr.version != CHECKPOINT_VERSION) {
+      LOG(LOG_ERROR, "%s is not a checkpoint", filename);
+      return 1;
+   }
+   if (hdr.chip != chip) {
+      LOG(LOG_ERROR, "checkpoint %s is for chip %d, not %d",
+          filename, hdr.chip, chip);
+      return 1;
+   }
+   // Verilator checks the design itself matches
+   os >> *si->top;
+   if (!os.isOpen()) {
+      LOG(LOG_ERROR, "can't read checkpoint %s", filename);
+      return 1;
+   }
+   os.close();
+
+   si->ticks = hdr.ticks;
+   edges_seek(&si->edgeSched, hdr.edgeUnits);
+   si->nextClkCnt = hdr.nextClkCnt;
+   memcpy(si->prev_signal_values, hdr.prev, sizeof(hdr.prev));
+   LOG(LOG_INFO, "restored checkpoint %s", filename);
+   return 0;
+#else
+   LOG(LOG_ERROR, "checkpoints need a model built with SAVABLE=1");
+   return 1;
+#endif
 }
 
 // Initial sync
@@ -490,483 +906,433 @@ static void regs_vice_to_fpga(Vtop* top, struct vicii_state* state) {
        }
 }
 
+// Only mark what actually changed so VICE can skip the rest
+static inline void setReg(struct vicii_state* state, int r,
+                          unsigned char v) {
+   if (state->fpga_reg[r] != v) {
+      state->fpga_reg[r] = v;
+      state->dirty_regs |= 1ULL << r;
+   }
+}
+
+#define SET_FIELD(state, field, v, bit) \
+   do { \
+      if ((state)->field != (v)) { \
+         (state)->field = (v); \
+         (state)->dirty |= (bit); \
+      } \
+   } while (0)
+
 static void regs_fpga_to_vice(Vtop* top, struct vicii_state* state) {
-       state->fpga_reg[0x11] =
+       setReg(state, 0x11,
           (top->V_YSCROLL & 0x7) |
           (top->V_RSEL ? 8 : 0) |
           (top->V_DEN  ? 16 : 0) |
           (top->V_BMM  ? 32 : 0) |
           (top->V_ECM  ? 64 : 0) |
-          ((top->V_RASTER_LINE_D & 256) ? 128 : 0);
+          ((top->V_RASTER_LINE_D & 256) ? 128 : 0));
 
-       state->fpga_reg[0x12] =
-          top->V_RASTER_LINE_D & 0xff;
+       setReg(state, 0x12,
+          top->V_RASTER_LINE_D & 0xff);
 
-       state->fpga_reg[0x13] = top->V_LPX;
-       state->fpga_reg[0x14] = top->V_LPY;
+       setReg(state, 0x13, top->V_LPX);
+       setReg(state, 0x14, top->V_LPY);
 
-       state->fpga_reg[0x16] =
+       setReg(state, 0x16,
           (top->V_XSCROLL & 0x7) |
           (top->V_CSEL ? 8 : 0) |
           (top->V_MCM ? 16 : 0) |
           (top->V_RES ? 32 : 0) |
-          0b11000000;
+          0b11000000);
 
-       state->fpga_reg[0x18] = 1 |
+       setReg(state, 0x18, 1 |
           ((top->V_CB & 0x7) << 1) |
-          ((top->V_VM & 0xf) << 4);
+          ((top->V_VM & 0xf) << 4));
 
-       state->fpga_reg[0x19] =
-	  (top->V_IRQ ? 128 : 0) |
+       setReg(state, 0x19,
+          (top->V_IRQ ? 128 : 0) |
           (top->V_IRST ? 1 : 0) |
           (top->V_IMBC ? 2 : 0) |
           (top->V_IMMC ? 4 : 0) |
           (top->V_ILP ? 8 : 0) |
-          0b01110000;
+          0b01110000);
 
-       state->fpga_reg[0x1A] =
+       setReg(state, 0x1A,
           (top->V_ERST  ? 1 : 0) |
           (top->V_EMBC  ? 2 : 0) |
           (top->V_EMMC  ? 4 : 0) |
           (top->V_ELP   ? 8 : 0) |
-          0b11110000;
-
-       state->fpga_reg[0x20] =
-          (top->V_EC & 15) | 0b11110000;
-       state->fpga_reg[0x21] =
-          (top->V_B0C & 15) | 0b11110000;
-       state->fpga_reg[0x22] =
-          (top->V_B1C & 15) | 0b11110000;
-       state->fpga_reg[0x23] =
-          (top->V_B2C & 15) | 0b11110000;
-       state->fpga_reg[0x24] =
-          (top->V_B3C & 15) | 0b11110000;
-
-       state->vc = top->V_VC;
-       state->vc_base = top->V_VCBASE;
-       state->rc = top->V_RC;
+          0b11110000);
+
+       setReg(state, 0x20,
+          (top->V_EC & 15) | 0b11110000);
+       setReg(state, 0x21,
+          (top->V_B0C & 15) | 0b11110000);
+       setReg(state, 0x22,
+          (top->V_B1C & 15) | 0b11110000);
+       setReg(state, 0x23,
+          (top->V_B2C & 15) | 0b11110000);
+       setReg(state, 0x24,
+          (top->V_B3C & 15) | 0b11110000);
+
+       SET_FIELD(state, vc, top->V_VC, VICII_DIRTY_COUNTERS);
+       SET_FIELD(state, vc_base, top->V_VCBASE, VICII_DIRTY_COUNTERS);
+       SET_FIELD(state, rc, top->V_RC, VICII_DIRTY_COUNTERS);
 
        state->allow_bad_lines = top->V_ALLOW_BAD_LINES;
        state->reg11_delayed = top->V_REG11_DELAYED;
 
-       state->fpga_reg[0x00] = top->V_SPRITE_X[0] & 0xff;
-       state->fpga_reg[0x01] = top->V_SPRITE_Y[0];
-       state->fpga_reg[0x02] = top->V_SPRITE_X[1] & 0xff;
-       state->fpga_reg[0x03] = top->V_SPRITE_Y[1];
-       state->fpga_reg[0x04] = top->V_SPRITE_X[2] & 0xff;
-       state->fpga_reg[0x05] = top->V_SPRITE_Y[2];
-       state->fpga_reg[0x06] = top->V_SPRITE_X[3] & 0xff;
-       state->fpga_reg[0x07] = top->V_SPRITE_Y[3];
-       state->fpga_reg[0x08] = top->V_SPRITE_X[4] & 0xff;
-       state->fpga_reg[0x09] = top->V_SPRITE_Y[4];
-       state->fpga_reg[0x0a] = top->V_SPRITE_X[5] & 0xff;
-       state->fpga_reg[0x0b] = top->V_SPRITE_Y[5];
-       state->fpga_reg[0x0c] = top->V_SPRITE_X[6] & 0xff;
-       state->fpga_reg[0x0d] = top->V_SPRITE_Y[6];
-       state->fpga_reg[0x0e] = top->V_SPRITE_X[7] & 0xff;
-       state->fpga_reg[0x0f] = top->V_SPRITE_Y[7];
-       state->fpga_reg[0x10] = ((top->V_SPRITE_X[0] & 256) >> 8) |
-                               ((top->V_SPRITE_X[1] & 256) >> 7) |
-                               ((top->V_SPRITE_X[2] & 256) >> 6) |
-                               ((top->V_SPRITE_X[3] & 256) >> 5) |
-                               ((top->V_SPRITE_X[4] & 256) >> 4) |
-                               ((top->V_SPRITE_X[5] & 256) >> 3) |
-                               ((top->V_SPRITE_X[6] & 256) >> 2) |
-                               ((top->V_SPRITE_X[7] & 256) >> 1);
-
-       state->fpga_reg[0x15] = top->V_SPRITE_EN;
-       state->fpga_reg[0x17] = top->V_SPRITE_YE;
-       state->fpga_reg[0x1b] = top->V_SPRITE_PRI;
-       state->fpga_reg[0x1c] = top->V_SPRITE_MMC;
-       state->fpga_reg[0x1d] = top->V_SPRITE_XE;
-       state->fpga_reg[0x1e] = top->V_SPRITE_M2M;
-       state->fpga_reg[0x1f] = top->V_SPRITE_M2D;
-       state->fpga_reg[0x25] = top->V_SPRITE_MC0 | 0xf0;
-       state->fpga_reg[0x26] = top->V_SPRITE_MC1 | 0xf0;
+       setReg(state, 0x00, top->V_SPRITE_X[0] & 0xff);
+       setReg(state, 0x01, top->V_SPRITE_Y[0]);
+       setReg(state, 0x02, top->V_SPRITE_X[1] & 0xff);
+       setReg(state, 0x03, top->V_SPRITE_Y[1]);
+       setReg(state, 0x04, top->V_SPRITE_X[2] & 0xff);
+       setReg(state, 0x05, top->V_SPRITE_Y[2]);
+       setReg(state, 0x06, top->V_SPRITE_X[3] & 0xff);
+       setReg(state, 0x07, top->V_SPRITE_Y[3]);
+       setReg(state, 0x08, top->V_SPRITE_X[4] & 0xff);
+       setReg(state, 0x09, top->V_SPRITE_Y[4]);
+       setReg(state, 0x0a, top->V_SPRITE_X[5] & 0xff);
+       setReg(state, 0x0b, top->V_SPRITE_Y[5]);
+       setReg(state, 0x0c, top->V_SPRITE_X[6] & 0xff);
+       setReg(state, 0x0d, top->V_SPRITE_Y[6]);
+       setReg(state, 0x0e, top->V_SPRITE_X[7] & 0xff);
+       setReg(state, 0x0f, top->V_SPRITE_Y[7]);
+       setReg(state, 0x10, ((top->V_SPRITE_X[0] & 256) >> 8) |
+                           ((top->V_SPRITE_X[1] & 256) >> 7) |
+                           ((top->V_SPRITE_X[2] & 256) >> 6) |
+                           ((top->V_SPRITE_X[3] & 256) >> 5) |
+                           ((top->V_SPRITE_X[4] & 256) >> 4) |
+                           ((top->V_SPRITE_X[5] & 256) >> 3) |
+                           ((top->V_SPRITE_X[6] & 256) >> 2) |
+                           ((top->V_SPRITE_X[7] & 256) >> 1));
+
+       setReg(state, 0x15, top->V_SPRITE_EN);
+       setReg(state, 0x17, top->V_SPRITE_YE);
+       setReg(state, 0x1b, top->V_SPRITE_PRI);
+       setReg(state, 0x1c, top->V_SPRITE_MMC);
+       setReg(state, 0x1d, top->V_SPRITE_XE);
+       setReg(state, 0x1e, top->V_SPRITE_M2M);
+       setReg(state, 0x1f, top->V_SPRITE_M2D);
+       setReg(state, 0x25, top->V_SPRITE_MC0 | 0xf0);
+       setReg(state, 0x26, top->V_SPRITE_MC1 | 0xf0);
 
        for (int n=0,b=1;n<8;n++,b=b*2) {
-          state->mc[n] = top->V_SPRITE_MC[n];
-          state->mcbase[n] = top->V_SPRITE_MCBASE[n];
-          state->ye_ff[n] = top->V_SPRITE_YE_FF[n];
-          state->sprite_dma[n] = top->V_SPRITE_DMA & b ? 1 : 0;
-          state->fpga_reg[0x27+n] = top->V_SPRITE_COL[n] | 0xf0;
+          SET_FIELD(state, mc[n], top->V_SPRITE_MC[n], VICII_DIRTY_SPRITES);
+          SET_FIELD(state, mcbase[n], top->V_SPRITE_MCBASE[n],
+                    VICII_DIRTY_SPRITES);
+          SET_FIELD(state, ye_ff[n], top->V_SPRITE_YE_FF[n],
+                    VICII_DIRTY_SPRITES);
+          SET_FIELD(state, sprite_dma[n], top->V_SPRITE_DMA & b ? 1 : 0,
+                    VICII_DIRTY_SPRITES);
+          setReg(state, 0x27+n, top->V_SPRITE_COL[n] | 0xf0);
        }
 
        // Tell VICE what our char buf looks like or comparison
        for (int i=0; i < 40; i++) {
-	  state->fpga_char_buf[i] = top->V_CHAR_BUF[i];
+	  SET_FIELD(state, fpga_char_buf[i], top->V_CHAR_BUF[i],
+	            VICII_DIRTY_CHAR_BUF);
        }
 }
 
 
-int main(int argc, char** argv, char** env) {
-    SDL_Event event;
-    SDL_Renderer* ren = nullptr;
-    SDL_Window* win;
-
-    struct vicii_state* state;
-    bool capture = false;
-
-    int chip = CHIP6569R3;
-    bool hideSync = false;
-    bool isNtsc = false;
-    bool showActive = false;
-
-    bool captureByTime = true;
-    bool captureByFrame = false;
-    int  captureByFrameStopXpos = 0;
-    int  captureByFrameStopYpos = 0;
-    bool showWindow = false;
-    bool shadowVic = false;
-    bool cycleByCycle = false;
-    int cycleByCycleCount = 0;
-    int last_phase = 0;
-    bool tracing = false;
-    int prevY = -1;
-    struct vicii_ipc* ipc;
-    bool keyPressToQuit = true;
-    bool viceCapture = false;
-    bool endCapture = false;
-    bool scanline = true;
+// Everything VICE reads back at the end of a step, except
+// data_from_sim which is latched whenever the CPU reads us.
+static void exportState(Vtop* top, struct vicii_state* state,
+                        bool cycleByCycle) {
+   state->irq = top->irq;
+   state->irst = top->V_IRST;
+   state->immc = top->V_IMMC;
+   state->imbc = top->V_IMBC;
+   state->ilp = top->V_ILP;
+   state->ba = top->ba;
+   state->badline = top->V_BADLINE;
+   state->aec = top->aec;
+   state->phi = top->clk_phi;
+   state->addr_from_sim = top->V_VICADDR;
+
+   // We have to simulate the ROM glitch and keep VICE
+   // happy with address comparisons.
+   // See addressgen.v for the description of the glitch.
+   if (top->V_CYCLE_TYPE == VIC_LG) {
+       if (top->V_BMM_DELAYED != top->V_BMM) {
+          uint16_t from_addr = top->V_VICADDR + state->vice_vbank_phi1;
+          uint16_t to_addr = top->V_VICADDR_NOW + state->vice_vbank_phi1;
+          // This is the same cheat VICE uses. But we implement the glitch
+          // the 'real' way on the actual hardware.  This is just for VICE
+          // sync comparison to keep address match happy.
+          if ((from_addr & 0x7000) != 0x1000 && (to_addr & 0x7000) == 0x1000) {
+              state->addr_from_sim = (top->V_VICADDR & 0xff) | (top->V_VICADDR_NOW & 0xff00);
+          }
+       }
+   }
 
-    // Default to 16.7us starting at 0
-    startTicks = US_TO_TICKS(0);
-    vluint64_t durationTicks;
-    vluint64_t userDurationUs = -1;
+   state->cycle_num = top->V_CYCLE_NUM;
+   state->xpos = top->V_XPOS;
+   state->raster_line = top->V_RASTER_LINE_D;
+   state->cycleByCycleStepping = cycleByCycle;
+   state->idle = top->V_IDLE;
+   state->allow_bad_lines = top->V_ALLOW_BAD_LINES;
+   state->reg11_delayed = top->V_REG11_DELAYED;
+   state->vborder = top->V_VBORDER;
+   state->main_border = top->V_MAIN_BORDER;
+   state->pps = top->V_PPS;
+   state->dot4x = top->V_DOT4X ? 1 : 0;
+
+   regs_fpga_to_vice(top, state);
+}
 
-    char *cvalue = nullptr;
-    char c;
-    char *token;
-    regex_t regex;
-    int reti, reti2;
-    char regex_buf[32];
+static void readRefInputs(Vtop* top, struct ref_inputs* in) {
+    in->line = top->V_RASTER_LINE;
+    in->cycle = top->V_CYCLE_NUM;
+    in->yscroll = top->V_YSCROLL;
+    in->den = top->V_DEN;
+    in->rsel = top->V_RSEL;
+    in->csel = top->V_CSEL;
+    in->spriteEn = top->V_SPRITE_EN;
+    in->spriteYe = top->V_SPRITE_YE;
+    for (int n = 0; n < 8; n++)
+       in->spriteY[n] = top->V_SPRITE_Y[n];
+}
 
-    while ((c = getopt (argc, argv, "akc:hs:d:wi:zbl:r:gtxqy")) != -1)
-    switch (c) {
-      case 'q':
-        scanline = false;
-      case 't':
-        tracing = true;
-        break;
-      case 'l':
-        logLevel = atoi(optarg);
-        break;
-      case 'c':
-        chip = atoi(optarg);
-        break;
-      case 'b':
-        cycleByCycle = true;
-        break;
-      case 'z':
-        // IPC tells us when to start/stop capture
-        captureByTime = false;
-        shadowVic = true;
-        break;
-      case 'w':
-        showWindow = true;
-        break;
-      case 'k':
-        hideSync = true;
-        break;
-      case 'a':
-        showActive = true;
-        break;
-      case 's':
-        startTicks = US_TO_TICKS(atol(optarg));
-        break;
-      case 'd':
-        userDurationUs = atol(optarg);
-        break;
-      case 'h':
-        printf ("Usage\n");
-        printf ("  -s [uS]   : start at uS\n");
-        printf ("  -d [uS]   : run for uS\n");
-        printf ("  -w        : show SDL2 window\n");
-        printf ("  -z        : single step eval for shadow vic via ipc\n");
-        printf ("  -b        : render each cycle, waiting for key press after each one\n");
-        printf ("  -c <chip> : 0=CHIP6567R8, 1=CHIP6569R3 2=CHIP6567R56A 3=CHIP6569R1\n");
-        printf ("  -l        : log level\n");
-        printf ("  -q        : hide scanline\n");
-        printf ("  -k        : hide sync lines\n");
-        printf ("  -t        : enable tracing to session.vcd\n");
-        printf ("  -x        : sync with VICE and save a frame before exiting\n");
-        printf ("  -y        : save a frame before exiting\n");
-        exit(0);
-      case 'x':
-	viceCapture = true;
-	break;
-      case 'y':
-	endCapture = true;
-	break;
-      case '?':
-        if (optopt == 't' || optopt == 's') {
-          LOG(LOG_ERROR, "Option -%c requires an argument", optopt);
-        } else if (isprint (optopt)) {
-          LOG(LOG_ERROR, "Unknown option `-%c'", optopt);
-        } else {
-          LOG(LOG_ERROR, "Unknown option character `\\x%x'", optopt);
-        }
-        return 1;
-      default:
-        exit(-1);
+static void readRefState(Vtop* top, struct ref_state* st) {
+    st->vc = top->V_VC;
+    st->vcBase = top->V_VCBASE;
+    st->rc = top->V_RC;
+    st->idle = top->V_IDLE;
+    st->badline = top->V_BADLINE;
+    st->allowBadLines = top->V_ALLOW_BAD_LINES;
+    st->dma = top->V_SPRITE_DMA;
+    st->yeFF = 0;
+    for (int n = 0; n < 8; n++) {
+       st->mc[n] = top->V_SPRITE_MC[n];
+       st->mcBase[n] = top->V_SPRITE_MCBASE[n];
+       st->yeFF |= top->V_SPRITE_YE_FF[n] ? 1 << n : 0;
     }
+    st->vborder = top->V_VBORDER;
+    st->setVborder = top->V_SET_VBORDER;
+    st->mainBorder = top->V_MAIN_BORDER;
+}
 
-    int sdl_init_mode = SDL_INIT_VIDEO;
-    if (SDL_Init(sdl_init_mode) != 0) {
-      LOG(LOG_ERROR, "SDL_Init %s", SDL_GetError());
-      return 1;
+// --ref-model. Registers are taken when phi rises, by then the last
+// cycle's write has landed. When phi falls the reference runs the
+// cycle and the first difference fails the run like a CHECK.
+static void refTick(struct sim_instance* si) {
+    Vtop* top = si->top;
+    if (top->clk_phi == si->refPhi)
+       return;
+    si->refPhi = top->clk_phi;
+
+    if (top->clk_phi) {
+       readRefInputs(top, &si->refIn);
+       si->refHaveInputs = true;
+       return;
     }
 
-    // Add new input/output here.
-    Vtop* top = new Vtop;
-
-#if VM_TRACE
-    VerilatedVcdC* tfp = NULL;
-    if (tracing) {
-        Verilated::traceEverOn(true);  // Verilator must compute traced signals
-        VL_PRINTF("verilog tracing into session.vcd\n");
-        tfp = new VerilatedVcdC;
-        top->trace(tfp, 99);  // Trace 99 levels of hierarchy
-        tfp->open("session.vcd");  // Open the dump file
+    struct ref_state st;
+    readRefState(top, &st);
+    if (!si->refSeeded || !si->refHaveInputs) {
+       ref_seed(si->ref, &st);
+       si->refSeeded = true;
+       si->refHaveInputs = false;
+       return;
     }
-#endif
 
-    top->eval();
+    ref_cycle(si->ref, &si->refIn);
+    si->refHaveInputs = false;
+    int diff = ref_compare(si->ref, &st, si->cfg.refFields);
+    if (diff && failRun(si, "reference model at line %03x cycle %d:\n",
+                        si->refIn.line, si->refIn.cycle))
+       ref_log_diff(si->ref, &st, diff);
+}
 
-    switch (chip) {
-       case CHIP6567R8:
-          isNtsc = true;
-          printf ("CHIP: 6567R8\n");
-          printf ("VIDEO: NTSC\n");
-          break;
-       case CHIP6567R56A:
-          isNtsc = true;
-          printf ("CHIP: 6567R56A\n");
-          printf ("VIDEO: NTSC\n");
-          break;
-       case CHIP6569R1:
-          isNtsc = false;
-          printf ("CHIP: 6569R1\n");
-          printf ("VIDEO: PAL\n");
-          break;
-       case CHIP6569R3:
-          isNtsc = false;
-          printf ("CHIP: 6569R3\n");
-          printf ("VIDEO: PAL\n");
-          break;
-       default:
-          LOG(LOG_ERROR, "unknown chip");
-          exit(-1);
-          break;
-    }
-    printf ("Log Level: %d\n", logLevel);
+// Per chip constants the main loop needs. The loop is instantiated
+// once per chip so these fold away at compile time.
+template <int CHIP> struct ChipTraits;
 
-#ifdef GEN_RGB
-    printf ("Color: Using RGB/Sync output values\n");
-#else
-#ifdef NEED_RGB
-    printf ("Color: Using internal RGB/Sync values\n");
-#else
-#ifdef GEN_LUMA_CHROMA
-    printf ("Color: Using composite palette/sync\n");
-#else
-    printf ("Color: No color information available\n");
-#endif
-#endif
-#endif
+template <> struct ChipTraits<CHIP6567R8> {
+   static const int resetXPos = 0x19c;
+   static const bool hasRepeat = true;  // xpos repeats at cycle 61/62
+   static const int rasterShift = 25;   // close to vstart for the chip
+   static const int numLines = NTSC_6567R8_MAX_DOT_Y + 1;
+};
 
-    if (userDurationUs == -1) {
-       switch (chip) {
-          case CHIP6567R8:
-          case CHIP6567R56A:
-             durationTicks = US_TO_TICKS(17000L);
-             break;
-          case CHIP6569R1:
-          case CHIP6569R3:
-             durationTicks = US_TO_TICKS(20000L);
-             break;
-          default:
-             durationTicks = US_TO_TICKS(20000L);
-       }
-    } else {
-       durationTicks = US_TO_TICKS(userDurationUs);
-    }
+template <> struct ChipTraits<CHIP6567R56A> {
+   static const int resetXPos = 0x19c;
+   static const bool hasRepeat = false;
+   static const int rasterShift = 25;
+   static const int numLines = NTSC_6567R56A_MAX_DOT_Y + 1;
+};
 
-    if (isNtsc) {
-       half4XDotPS = NTSC_HALF_4X_DOT_PS;
-       half16XColPS = NTSC_HALF_16X_COLOR_PS;
-       switch (chip) {
-          case CHIP6567R56A:
-             screenWidth = NTSC_6567R56A_MAX_DOT_X+1;
-             screenHeight = NTSC_6567R56A_MAX_DOT_Y+1;
-             lastXPos = NTSC_6567R56A_LAST_XPOS;
-	     numCycles = NTSC_6567R56A_NUM_CYCLES;
-             break;
-          case CHIP6567R8:
-             screenWidth = NTSC_6567R8_MAX_DOT_X+1;
-             screenHeight = NTSC_6567R8_MAX_DOT_Y+1;
-             lastXPos = NTSC_6567R8_LAST_XPOS;
-	     numCycles = NTSC_6567R8_NUM_CYCLES;
-             break;
-          default:
-             LOG(LOG_ERROR, "wrong chip?");
-             exit(-1);
-       }
-    } else {
-       half4XDotPS = PAL_HALF_4X_DOT_PS;
-       half16XColPS = PAL_HALF_16X_COLOR_PS;
-       switch (chip) {
-          case CHIP6569R1:
-          case CHIP6569R3:
-             screenWidth = PAL_6569_MAX_DOT_X+1;
-             screenHeight = PAL_6569_MAX_DOT_Y+1;
-             lastXPos = PAL_6569_LAST_XPOS;
-	     numCycles = PAL_6569_NUM_CYCLES;
-             break;
-          default:
-             LOG(LOG_ERROR, "wrong chip?");
-             exit(-1);
-       }
-    }
+template <> struct ChipTraits<CHIP6569R3> {
+   static const int resetXPos = 0x194;
+   static const bool hasRepeat = false;
+   static const int rasterShift = 0;
+   static const int numLines = PAL_6569_MAX_DOT_Y + 1;
+};
 
-    nextClk = half4XDotPS;
+template <> struct ChipTraits<CHIP6569R1> : ChipTraits<CHIP6569R3> {};
 
-    if (showWindow) {
-      SDL_DisplayMode current;
+// Replay (-P) has no VICE on the other end to answer
+static int ipcReceiveDone(struct sim_instance* si) {
+   if (!si->ipc)
+      return 0;
+   uint64_t start = benchStart(si);
+   int r = ipc_receive_done(si->ipc);
+   benchStop(si, BENCH_IPC, start);
+   return r;
+}
 
-      win = SDL_CreateWindow("VICII",
-                             SDL_WINDOWPOS_CENTERED,
-                             SDL_WINDOWPOS_CENTERED,
-                             screenWidth*2, screenHeight*2, SDL_WINDOW_SHOWN);
-      if (win == nullptr) {
-        std::cerr << "SDL_CreateWindow Error: " << SDL_GetError() << std::endl;
-        SDL_Quit();
-        return 1;
-      }
+static void closeBusRec(struct sim_instance* si) {
+   if (si->busRec) {
+      busrec_close(si->busRec);
+      si->busRec = nullptr;
+   }
+}
 
-      ren = SDL_CreateRenderer(
-          win, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-      if (ren == nullptr) {
-        std::cerr << "SDL_CreateRenderer Error: "
-           << SDL_GetError() << std::endl;
-        SDL_DestroyWindow(win);
-        SDL_Quit();
-        return 1;
-      }
-    }
+// --compare: VICE should be sending what it sent for the reference.
+// If it isn't, the answers can't be expected to match either.
+static void compareStepIn(struct sim_instance* si) {
+   struct busrec* refRec = si->refRec;
+   int r = busrec_check_in(refRec, si->state);
+   if (r < 0) {
+      LOG(LOG_INFO, "reference ended at step %llu, no longer comparing",
+          (unsigned long long) refRec->steps);
+      si->comparing = false;
+   } else if (r && si->inputMismatches++ == 0) {
+      LOG(LOG_ERROR, "bus inputs differ from the reference at step %llu",
+          (unsigned long long) refRec->steps);
+   }
+}
 
-    // Default all signals to bit 1 and include in monitoring.
-    for (int i = 0; i < NUM_SIGNALS; i++) {
-      signal_width[i] = 1;
-      signal_bit[i] = 1;
-    }
+// -E records each step's inputs once they are in state
+static inline void recordStepIn(struct sim_instance* si) {
+   if (si->busRec)
+      busrec_step_in(si->busRec, si->state);
+   if (si->comparing && si->compareInputs)
+      compareStepIn(si);
+}
 
-    // Add new input/output here.
-    signal_src8[OUT_DOT] = &top->V_CLK_DOT;
-    signal_src8[OUT_DOT_RISING] = &top->V_CLK_DOT;
-    signal_width[OUT_DOT_RISING] = 4; // 4 bit shif reg
-    signal_bit[OUT_DOT_RISING] = 0b1111; // mask to get values
-
-    HEADER(top);
-
-    // Video standard toggle switch should be HIGH simulating PULLUP
-    top->standard_sw = 1;
-#if WITH_EXTENSIONS
-    // cfg reset is held HIGH simulating pullup
-#if HAVE_EEPROM
-    top->cfg_reset = 1;
-#endif
-    // simulate SHORTED for config pins
-    top->cfg1 = 0; // spi_lock
-    top->cfg2 = 0; // extensions_lock
-    top->cfg3 = 0; // persistence_lock
-#endif
-    // cpu_reset_i is held HIGH simulating pullup
-#if HIRES_RESET
-    top->cpu_reset_i = 1;
-#endif
-    
-#if HAVE_EEPROM
-    top->sim_chip = chip;
-#else
-    top->V_CHIP = chip;
-#endif
-
-    int cnt = 0;
-    while (top->V_RST) {
-       top->eval();
-       nextClkCnt = 0;
-#if VM_TRACE
-       if (tfp) tfp->dump(ticks / TICKS_TO_TIMESCALE);
-#endif
-       STATE(top);
-       STORE_PREV();
-       ticks = nextTick(top, tfp, chip);
-       cnt++;
-    }
-
-    // Not sure if this matters anymore
-    nextClkCnt = 31;
-
-    // Start counting from after reset
-    startTicks = ticks;
-    endTicks = startTicks + durationTicks;
+// Step is over. Record its outputs and check them against the
+// reference. Returns true if we should stop here.
+static bool busStepOut(struct sim_instance* si) {
+   Vtop* top = si->top;
+   struct vicii_state* state = si->state;
+   struct busrec* refRec = si->refRec;
+   if (si->busRec)
+      busrec_step_out(si->busRec, state);
+   if (!si->comparing)
+      return false;
+
+   bool bad = busrec_check_out(refRec, state);
+   if (bad && refRec->mismatches <= 10) {
+      LOG(LOG_ERROR, "mismatch at step %llu line %03x cycle %d "
+          "xpos %03x", (unsigned long long) refRec->steps - 1,
+          top->V_RASTER_LINE, top->V_CYCLE_NUM, top->V_XPOS);
+   }
+   return diverge_step(si->divergeRep, refRec, state, bad) &&
+      si->cfg.divergeStop;
+}
 
-    top->lp = 1;
-    top->rw = 1;
-    top->ce = 1;
-    top->lp = 1;
-    top->adl = 0;
-    top->V_DBI = 0;
-    top->V_DEN = 1;
-    top->V_CSEL = 1;
-    top->V_RSEL = 1;
-    top->V_VBORDER = 1;
-    top->V_MAIN_BORDER = 1;
-    top->V_SET_VBORDER = 1;
-    top->V_B0C = 6;
-    top->V_EC = 14;
-    top->V_VM = 1; // 0001
-    top->V_CB = 2; //  010
-    top->V_YSCROLL = 3; //  011
-#ifdef NEED_RGB
-    // NOTE: We are hard wired to do 2x and 1y. Any other
-    // configuration will require some work to the
-    // way rendering is done. If we have registers_eeprom, let
-    // that module set is_native_y as if it came from a the
-    // eeprom. Otherwise, just force it here.
-#ifndef HAVE_EEPROM
+// Put batch step n's bus inputs where a single step exchange has them
+static void loadBatchStep(struct vicii_state* state,
+                          struct vicii_batch* batch, unsigned int n) {
+   struct vicii_bus_in* in = &batch->in[n];
+   state->addr_to_sim = in->addr_to_sim;
+   state->data_to_sim = in->data_to_sim;
+   state->ce = in->ce;
+   state->rw = in->rw;
+   state->lp = in->lp;
+   state->flags = (state->flags & ~VICII_OP_BUS_ACCESS) |
+      (in->flags & VICII_OP_BUS_ACCESS);
+}
 
-#ifdef EFINIX
-    // Efinix DVI doesn't support native y
-    top->top__DOT__vic_inst__DOT__is_native_y = 0;
-#else
-    top->top__DOT__vic_inst__DOT__is_native_y = 1;
-#endif
+// Record what VICE would have read at the end of step n
+static void saveBatchStep(struct vicii_state* state,
+                          struct vicii_batch* batch, unsigned int n,
+                          unsigned char* lastRegs) {
+   struct vicii_bus_out* out = &batch->out[n];
+   out->irq = state->irq;
+   out->ba = state->ba;
+   out->aec = state->aec;
+   out->addr_from_sim = state->addr_from_sim;
+   out->data_from_sim = state->data_from_sim;
+
+   int d = 0;
+   for (int r = 0; r < 64; r++) {
+      if (state->fpga_reg[r] == lastRegs[r]) continue;
+      if (d < IPC_BATCH_MAX_REG_DELTAS) {
+         out->reg_delta[d][0] = r;
+         out->reg_delta[d][1] = state->fpga_reg[r];
+      }
+      d++;
+      lastRegs[r] = state->fpga_reg[r];
+   }
+   out->num_reg_deltas = d;
+   batch->done = n + 1;
+}
 
-    top->top__DOT__vic_inst__DOT__is_native_x = 0;
-#endif
+#if VERILATOR_VERSION_INTEGER >= 4210000
+static inline bool gotFinish(struct sim_instance* si) {
+   return si->context->gotFinish();
+}
 #else
-    // NO RGB? We will fallback to native res and we will use
-    // the color index coming out of the pixel sequencer
-    // (pixel_color3)
-    ;
+static inline bool gotFinish(struct sim_instance* si) {
+   return Verilated::gotFinish();
+}
 #endif
 
-    if (shadowVic) {
-       ipc = ipc_init(IPC_RECEIVER);
-       ipc_open(ipc);
-       state = ipc->state;
-    }
+// Runs up to maxTicks ticks of the loop built for this chip. Returns
+// false once the run is over, true if it can be stepped some more.
+template <class Chip>
+static bool stepChip(struct sim_instance* si, vluint64_t maxTicks) {
+    Vtop* top = si->top;
+    SimTrace* tfp = si->showState ? si->tfp : nullptr;
+    struct vicii_ipc* ipc = si->ipc;
+    struct vicii_state* state = si->state;
+    struct framebuffer* fb = si->fb;
+    SDL_Renderer* ren = si->ren;
+    SDL_Texture* tex = si->tex;
+    const bool shadowVic = si->cfg.shadowVic;
+    const bool viceCapture = si->cfg.viceCapture;
+    const bool captureByTime = si->cfg.captureByTime;
+    const bool showWindow = si->cfg.showWindow;
+    const bool render = si->render;
+    const bool hideSync = si->cfg.hideSync;
+    const bool showActive = si->cfg.showActive;
+    const bool scanline = si->cfg.scanline;
+    const bool cycleByCycle = si->cfg.cycleByCycle;
+    const char* outFile = si->cfg.outFile;
+    struct present_sched& presentSched = si->presentSched;
+    struct trigger_set* triggers = si->triggers;
+    vluint64_t& ticks = si->ticks;
+    bool& capture = si->capture;
+    bool& captureByFrame = si->captureByFrame;
+    int& captureByFrameStopXpos = si->captureByFrameStopXpos;
+    int& captureByFrameStopYpos = si->captureByFrameStopYpos;
+    int& cycleByCycleCount = si->cycleByCycleCount;
+    int& last_phase = si->last_phase;
+    int& prevY = si->prevY;
+    int& frameNum = si->frameNum;
+    bool& keyPressToQuit = si->keyPressToQuit;
+    bool& windowClosed = si->windowClosed;
+    SDL_Event event;
 
     // IMPORTANT: Any and all state reads/writes MUST occur between ipc_receive
     // and ipc_receive_done inside this loop.
-    int ticksUntilDone = 0;
-    int ticksUntilPhase = 0;
-    bool showState = true;
-    bool viceCaptureWaitLine1 = true;
-    bool endCaptureWaitLine1 = true;
-    while (!Verilated::gotFinish()) {
+    int& ticksUntilDone = si->ticksUntilDone;
+    int& ticksUntilPhase = si->ticksUntilPhase;
+    bool& showState = si->showState;
+    bool& viceCaptureWaitLine1 = si->viceCaptureWaitLine1;
+    bool& inputsChanged = si->inputsChanged;
+    struct vicii_batch* batch = si->batch;
+    unsigned int& batchPos = si->batchPos;
+    unsigned int& batchCount = si->batchCount;
+    unsigned char* lastRegs = si->lastRegs;
+
+    for (; maxTicks; maxTicks--) {
+        if (gotFinish(si))
+           return false;
 
         // Are we shadowing from VICE? Wait for sync data, then
         // step until next dot clock tick.
@@ -979,14 +1345,28 @@ int main(int argc, char** argv, char** env) {
 	   }
 
            // Do not change state before this line
-           if (ipc_receive(ipc))
-              break;
+           if (!ipc) {
+              if (busrec_next_in(si->refRec, state))
+                 return false;
+           } else {
+              uint64_t start = benchStart(si);
+              int r = ipc_receive(ipc);
+              benchStop(si, BENCH_IPC, start);
+              if (r)
+                 return false;
+           }
+           if (!(state->flags & VICII_OP_BATCH))
+              recordStepIn(si);
+
+           // VICE has seen everything we exported so far
+           state->dirty = 0;
+           state->dirty_regs = 0;
 
            capture = (state->flags & VICII_OP_CAPTURE_START);
            if (!captureByFrame) {
               captureByFrame = (state->flags & VICII_OP_CAPTURE_ONE_FRAME);
-              captureByFrameStopXpos = lastXPos;
-              captureByFrameStopYpos = screenHeight-1;
+              captureByFrameStopXpos = si->lastXPos;
+              captureByFrameStopYpos = si->screenHeight-1;
            }
 
            if (state->flags & VICII_OP_SYNC_STATE) {
@@ -998,36 +1378,44 @@ int main(int argc, char** argv, char** env) {
 	       // the repeats on the R8 because the VICE sync won't attempt
 	       // a sync past xpos 0x17c.
                while (true) {
-                  top->eval();
+                  evalModel(si);
 
 		  if (top->V_CYCLE_NUM == state->cycle_num &&
 				  top->V_RASTER_LINE == state->raster_line &&
 				  top->clk_phi) break;
 
 #if VM_TRACE
-	          if (tfp) tfp->dump(ticks / TICKS_TO_TIMESCALE);
+	          dumpTrace(si, tfp, ticks);
 #endif
-                  ticks = nextTick(top, tfp, chip);
-                  STATE(top);
-                  STORE_PREV();
+                  ticks = nextTick(si, tfp);
+                  STATE(si);
+                  FLIGHT(si);
+                  STORE_PREV(si);
                }
 
                // Now 3 more ticks + 1 more from leaving this block
                // and we will land one 'step' into our target cycle.
                for (int i=0; i< 3; i++) {
-                  top->eval();
+                  evalModel(si);
 #if VM_TRACE
-	          if (tfp) tfp->dump(ticks / TICKS_TO_TIMESCALE);
+	          dumpTrace(si, tfp, ticks);
 #endif
-                  ticks = nextTick(top, tfp, chip);
-                  STATE(top);
-                  STORE_PREV();
+                  ticks = nextTick(si, tfp);
+                  STATE(si);
+                  FLIGHT(si);
+                  STORE_PREV(si);
                }
 
 	       regs_vice_to_fpga(top, state);
+	       // VICE's state is the reference's new starting point
+	       si->refSeeded = false;
+
+               // VICE should compare everything after a sync
+               state->dirty = VICII_DIRTY_ALL;
+               state->dirty_regs = ~0ULL;
 
                // Our next tick will bring us high so we should be low right now.
-               CHECK(top, ~top->clk_phi, __LINE__);
+               CHECK(si, ~top->clk_phi, __LINE__);
 
                LOG(LOG_INFO, "synced FPGA to cycle=%u, raster_line=%u, xpos=%03x, bmm=%d, mcm=%d, ecm=%d",
                   state->cycle_num, state->raster_line, state->xpos, top->V_BMM, top->V_MCM, top->V_ECM);
@@ -1039,6 +1427,18 @@ int main(int argc, char** argv, char** env) {
 	      last_phase = 0;
            } else {
               ticksUntilDone = 4;
+
+              if (state->flags & VICII_OP_BATCH) {
+                 batchCount = batch->count;
+                 if (batchCount < 1 || batchCount > IPC_BATCH_MAX) {
+                    LOG(LOG_ERROR, "bad batch size %u", batchCount);
+                    return false;
+                 }
+                 batchPos = 0;
+                 memcpy(lastRegs, state->fpga_reg, sizeof(si->lastRegs));
+                 loadBatchStep(state, batch, 0);
+                 recordStepIn(si);
+              }
 	   }
         }
 
@@ -1046,7 +1446,7 @@ int main(int argc, char** argv, char** env) {
            // Simulate cs and rw going back high. This is the same
            // timing as what vice hook does when it lowers ce for the
            // CPU writes on the phi high side.
-           if (top->clk_phi == 0 && nextClkCnt == 4) {
+           if (top->clk_phi == 0 && si->nextClkCnt == BUS_RELEASE_TICKS) {
               state->ce = 1;
               state->rw = 1;
            }
@@ -1061,54 +1461,116 @@ int main(int argc, char** argv, char** env) {
 
         }
 
-        // Evaluate model
-        top->eval();
+        // Built in CPU and memory. It sees the pins every tick and
+        // only changes inputs on its own bus cycles.
+        if (si->machine) {
+           struct machine_pins pins;
+           pins.phi = top->clk_phi;
+           pins.ba = top->ba;
+           pins.aec = top->aec;
+           pins.irq = top->irq;
+           pins.ras = top->ras;
+           pins.cas = top->cas;
+           pins.ado = top->ado_sim;
+           pins.dbo = top->V_DBO;
+           if (machine_bus(si->machine, &pins)) {
+              top->adl = pins.adl;
+              top->dbl = pins.dbl;
+              top->dbh = pins.dbh;
+              top->ce = pins.ce;
+              top->rw = pins.rw;
+              inputsChanged = true;
+           }
+        }
+
+        // Scripted bus events. Like VICE, they land a few ticks into
+        // their phase and are checked on its last tick.
+        if (si->stim) {
+           struct stim_pins pins;
+           pins.line = top->V_RASTER_LINE;
+           pins.cycle = top->V_CYCLE_NUM;
+           pins.phi = top->clk_phi;
+           pins.irq = top->irq;
+           pins.ba = top->ba;
+           pins.aec = top->aec;
+           pins.dbo = top->V_DBO;
+           int r = stim_tick(si->stim, &pins);
+           if (r & STIM_CHANGED) {
+              top->adl = pins.adl;
+              top->dbl = pins.dbl;
+              top->ce = pins.ce;
+              top->rw = pins.rw;
+              top->lp = pins.lp;
+              inputsChanged = true;
+           }
+           if (r & STIM_FAILED)
+              stimFailed(si);
+           else if ((r & STIM_DONE) && si->endTicks == ~(vluint64_t) 0)
+              si->stimDone = true;
+        }
+
+        // Evaluate model. nextTick already evaluated the clock edge so
+        // this is only needed when we changed inputs at this timestamp.
+        if (inputsChanged || shadowVic) {
+           evalModel(si);
+           inputsChanged = false;
+        }
 
         if (shadowVic) {
            if (state->flags & VICII_OP_BUS_ACCESS) {
-              CHECK(top, top->clk_phi, __LINE__);
+              CHECK(si, top->clk_phi, __LINE__);
            }
 	}
 
+        if (si->ref)
+           refTick(si);
+
+        // Only trace and log inside trigger windows
+        if (triggers) {
+           int reg = (top->ce == 0 && top->rw == 0) ?
+              (top->adl & 0x3f) : TRIG_ANY;
+           showState = trig_update(triggers, top->V_RASTER_LINE,
+              top->V_CYCLE_NUM, top->V_XPOS, reg);
+           tfp = showState ? si->tfp : nullptr;
+        }
+
 #if VM_TRACE
-	if (tfp) tfp->dump(ticks / TICKS_TO_TIMESCALE);
+	dumpTrace(si, tfp, ticks);
 #endif
 
         if (showState) {
-           STATE(top);
+           STATE(si);
         }
+        FLIGHT(si);
 
         if (captureByTime)
-           capture = (ticks >= startTicks) && (ticks <= endTicks);
+           capture = (ticks >= si->startTicks) && (ticks <= si->endTicks);
 
         if (capture) {
           // On dot clock...
-          if (HASCHANGED(OUT_DOT) && RISING(OUT_DOT)) {
+          if (HASCHANGED(si, OUT_DOT) && RISING(si, OUT_DOT)) {
              // AEC should always be low in first phase. But AEC is
 	     // slightly delayed so don't check this when bit cycle is 0
              if (top->V_CYCLE_BIT > 0 && top->V_CYCLE_BIT < 4) {
-               CHECK(top, top->aec == 0, __LINE__);
+               CHECK(si, top->aec == 0, __LINE__);
              }
 
              // Make sure xpos is what we expect at key points
              if (top->V_CYCLE_NUM == 12 && top->V_CYCLE_BIT == 4)
-               CHECK (top, top->V_XPOS == 0, __LINE__); // rollover
+               CHECK (si, top->V_XPOS == 0, __LINE__); // rollover
 
              if (top->V_CYCLE_NUM == 0 && top->V_CYCLE_BIT == 0)
-               if (chip == CHIP6569R1 || chip == CHIP6569R3)
-                  CHECK (top, top->V_XPOS == 0x194, __LINE__); // reset
-               else
-                  CHECK (top, top->V_XPOS == 0x19c, __LINE__); // reset
+               CHECK (si, top->V_XPOS == Chip::resetXPos, __LINE__); // reset
 
-             if (chip == CHIP6567R8)
+             if (Chip::hasRepeat)
                if (top->V_CYCLE_NUM == 61 && (top->V_CYCLE_BIT == 0 || top->V_CYCLE_BIT == 4))
-                  CHECK (top, top->V_XPOS == 0x184, __LINE__); // repeat cases
+                  CHECK (si, top->V_XPOS == 0x184, __LINE__); // repeat cases
                else if (top->V_CYCLE_NUM == 62 && top->V_CYCLE_BIT == 0)
-                  CHECK (top, top->V_XPOS == 0x184, __LINE__); // repeat case
+                  CHECK (si, top->V_XPOS == 0x184, __LINE__); // repeat case
 
              // Refresh counter is supposed to reset at raster 0
              //if (top->V_RASTER_X == 0 && top->V_RASTER_LINE == 0) TODO Put back
-             //   CHECK (top, top->V_REFC == 0xff, __LINE__);
+             //   CHECK (si, top->V_REFC == 0xff, __LINE__);
 
           }
 
@@ -1116,53 +1578,39 @@ int main(int argc, char** argv, char** env) {
 	  // Our simulator resolution is twice that of native so we can
 	  // update every other dot clock tick.
 	  // dot_rising[1] || dot_rising[3]
-          if (showWindow && HASCHANGED(OUT_DOT_RISING) &&
+          if (render && HASCHANGED(si, OUT_DOT_RISING) &&
 			  (top->V_CLK_DOT == 2 || top->V_CLK_DOT == 8)) {
+            uint64_t renderStart = benchStart(si);
+            unsigned int color = ARGB(0,0,0);
 #ifdef GEN_RGB
             // Show h/v sync in red
             if (!hideSync && (!top->hsync || !top->vsync))
-             SDL_SetRenderDrawColor(ren,
-                0b11111111,
-                0b0,
-                0b0,
-                255);
+             color = ARGB(0b11111111, 0b0, 0b0);
             else {
              double rr = top->red * 255.0/63.0;
              double gg = top->green * 255.0/63.0;
              double bb = top->blue * 255.0/63.0;
-             SDL_SetRenderDrawColor(ren, rr, gg, bb, 255);
+             color = ARGB(rr, gg, bb);
             }
 
             // PURPLE ACTIVE AREA - DEBUGGING
             if (showActive && (top->active))
-             SDL_SetRenderDrawColor(ren,
-                0b11111111,
-                0b0,
-                255,
-                0b0);
+             color = ARGB(0b11111111, 0b0, 255);
 #else 
 #ifdef NEED_RGB
             // Show h/v sync in red
             if (!hideSync && (top->HSYNC || top->VSYNC))
-             SDL_SetRenderDrawColor(ren,
-                0b11111111,
-                0b0,
-                0b0,
-                255);
+             color = ARGB(0b11111111, 0b0, 0b0);
             else {
              double rr = top->top__DOT__red * 255.0/63.0;
              double gg = top->top__DOT__green * 255.0/63.0;
              double bb = top->top__DOT__blue * 255.0/63.0;
-             SDL_SetRenderDrawColor(ren, rr,gg,bb,255);
+             color = ARGB(rr, gg, bb);
             }
 
             // PURPLE ACTIVE AREA - DEBUGGING
             if (showActive && (top->ACTIVE))
-             SDL_SetRenderDrawColor(ren,
-                0b11111111,
-                0b0,
-                255,
-                0b0);
+             color = ARGB(0b11111111, 0b0, 255);
 
 #else
 #ifdef GEN_LUMA_CHROMA
@@ -1184,26 +1632,23 @@ int main(int argc, char** argv, char** env) {
 	       int lp2 = top->top__DOT__vic_inst__DOT__lumacode_p2;
 	       int lcff = top->top__DOT__vic_inst__DOT__vic_registers__DOT__lumacode_ff;
                if (lcff == 0 || lcff ==1 )
-               SDL_SetRenderDrawColor(ren,
+               color = ARGB(
                 ((lp1*16) << 2) | 0b11,
                 ((lp1*16) << 2) | 0b11,
-                ((lp1*16) << 2) | 0b11,
-                255);
+                ((lp1*16) << 2) | 0b11);
                else {
-               SDL_SetRenderDrawColor(ren,
-                ((lp2*16) << 2) | 0b11,
+               color = ARGB(
                 ((lp2*16) << 2) | 0b11,
                 ((lp2*16) << 2) | 0b11,
-                255);
+                ((lp2*16) << 2) | 0b11);
                }
              } else {
 #endif
 	       int index = top->top__DOT__vic_inst__DOT__pixel_color3;
-               SDL_SetRenderDrawColor(ren,
+               color = ARGB(
                 (native_rgb[index*3] << 2) | 0b11,
                 (native_rgb[index*3+1] << 2) | 0b11,
-                (native_rgb[index*3+2] << 2) | 0b11,
-                255);
+                (native_rgb[index*3+2] << 2) | 0b11);
 #ifdef LUMACODE
              }
 #endif
@@ -1213,13 +1658,13 @@ int main(int argc, char** argv, char** env) {
 	       if ((top->V_RASTER_X >= hss && top->V_RASTER_X < hse) ||
                       (vsync && top->V_RASTER_LINE != vve && top->V_RASTER_LINE != vvs))
 #ifdef HAVE_LUMA_SINK
-                  SDL_SetRenderDrawColor(ren, 255*top->V_LUMA_SINK,0,0,255);
+                  color = ARGB(255*top->V_LUMA_SINK, 0, 0);
 #else
                   // Only for old beta boards
-                  SDL_SetRenderDrawColor(ren, 255,0,0,255);
+                  color = ARGB(255, 0, 0);
 #endif
 	       else
-                  SDL_SetRenderDrawColor(ren, 0,0,0,255);
+                  color = ARGB(0, 0, 0);
 	    }
 #else
 #warning "There are no video output options available. Simulator will show nothing"
@@ -1232,109 +1677,78 @@ int main(int argc, char** argv, char** env) {
              int rl = top->V_RASTER_LINE;
 
              // This shifts everything up for NTSC so we can see
-             // the whole screen like on a monitor.  The value 25
-             // here should be close to the vstart values for the chips.
-             switch (chip) {
-                case CHIP6567R8:
-                   rl-= 25;
-                   if (rl < 0) rl+=263;
-                   break;
-                case CHIP6567R56A:
-                   rl-= 25;
-                   if (rl < 0) rl+=262;
-                   break;
-                case CHIP6569R1:
-                default:
-                   break;
+             // the whole screen like on a monitor.
+             if (Chip::rasterShift) {
+                rl -= Chip::rasterShift;
+                if (rl < 0) rl += Chip::numLines;
              }
 
              if (1) { //top->top__DOT__vic_inst__DOT__is_native_y) {
-               drawPixel(ren,
+               drawPixel(fb,
                   top->V_RASTER_X*2+hoffset,
-                  rl
+                  rl, color
                );
              } else {
                // Draw fatter pixels for double y
-               drawPixel(ren,
+               drawPixel(fb,
                   top->V_RASTER_X*4+hoffset*2,
-                  rl
+                  rl, color
                );
-               drawPixel(ren,
+               drawPixel(fb,
                   top->V_RASTER_X*4+1+hoffset*2,
-                  rl
+                  rl, color
                );
              }
 
-             // Show updated pixels per raster line
              if (prevY != rl) {
+                // Wrapped around? Then the previous frame is complete.
+                bool newFrame = rl < prevY;
+                if (newFrame && outFile && strchr(outFile, '%')) {
+                   saveFrame(si);
+                }
+                if (newFrame) frameNum++;
+
                 prevY = rl;
 
                 if (scanline) {
                    for (int xx=0; xx < 504; xx++) {
-                     SDL_SetRenderDrawColor(ren, 255, 255, 255, 255);
-                     drawPixel(ren, xx*2, rl+1);
+                     drawPixel(fb, xx*2, rl+1, ARGB(255, 255, 255));
                    }
                 }
 
-                SDL_RenderPresent(ren);
-                SDL_PollEvent(&event);
-                switch (event.type) {
-                   case SDL_QUIT:
-                      state->flags |= VICII_OP_CAPTURE_END;
-                      break;
-                   default:
-                      break;
+                // Show updated pixels when the scheduler says so. Events
+                // are only polled here, never on every line.
+                if (showWindow && present_due(&presentSched, newFrame)) {
+                   present(ren, tex, fb);
+                   while (SDL_PollEvent(&event)) {
+                      switch (event.type) {
+                         case SDL_QUIT:
+                            if (shadowVic)
+                               state->flags |= VICII_OP_CAPTURE_END;
+                            else
+                               windowClosed = true;
+                            break;
+                         default:
+                            break;
+                      }
+                   }
                 }
              }
+             benchStop(si, BENCH_RENDER, renderStart);
           }
         }
 
 
         if (shadowVic) {
-           state->irq = top->irq;
-           state->irst = top->V_IRST;
-           state->immc = top->V_IMMC;
-           state->imbc = top->V_IMBC;
-           state->ilp = top->V_ILP;
-           state->ba = top->ba;
-           state->badline = top->V_BADLINE;
-           state->aec = top->aec;
-           state->phi = top->clk_phi;
-	   state->addr_from_sim = top->V_VICADDR;
-
-           // We have to simulate the ROM glitch and keep VICE
-           // happy with address comparisons.
-           // See addressgen.v for the description of the glitch.
-           if (top->V_CYCLE_TYPE == VIC_LG) {
-               if (top->V_BMM_DELAYED != top->V_BMM) {
-                  uint16_t from_addr = top->V_VICADDR + state->vice_vbank_phi1;
-                  uint16_t to_addr = top->V_VICADDR_NOW + state->vice_vbank_phi1;
-                  // This is the same cheat VICE uses. But we implement the glitch
-                  // the 'real' way on the actual hardware.  This is just for VICE
-                  // sync comparison to keep address match happy.
-                  if ((from_addr & 0x7000) != 0x1000 && (to_addr & 0x7000) == 0x1000) {
-                      state->addr_from_sim = (top->V_VICADDR & 0xff) | (top->V_VICADDR_NOW & 0xff00);
-                  }
-               }
-           }
-
-	   state->cycle_num = top->V_CYCLE_NUM;
-	   state->xpos = top->V_XPOS;
-	   state->raster_line = top->V_RASTER_LINE_D;
-           state->cycleByCycleStepping = cycleByCycle;
-	   state->idle = top->V_IDLE;
-	   state->allow_bad_lines = top->V_ALLOW_BAD_LINES;
-	   state->reg11_delayed = top->V_REG11_DELAYED;
-	   state->vborder = top->V_VBORDER;
-	   state->main_border = top->V_MAIN_BORDER;
-	   state->pps = top->V_PPS;
-	   state->dot4x = top->V_DOT4X ? 1 : 0;
-
            if (top->ce == 0 && top->rw == 1) {
               // Chip selected and read, set data in state
               state->data_from_sim = top->V_DBO;
            }
-           regs_fpga_to_vice(top, state);
+
+           // VICE only looks at state once we hand it back at the end
+           // of the step, so the rest is exported on its last tick.
+           if (ticksUntilDone == 1 || (state->flags & VICII_OP_CAPTURE_END))
+              exportState(top, state, cycleByCycle);
 
            bool needQuit = false;
            if (state->flags & VICII_OP_CAPTURE_END) {
@@ -1347,40 +1761,54 @@ int main(int argc, char** argv, char** env) {
               top->V_XPOS == captureByFrameStopXpos &&
                  top->V_RASTER_LINE == captureByFrameStopYpos) {
               state->flags &= ~VICII_OP_CAPTURE_START;
-              ipc_receive_done(ipc);
-              break;
+              ipcReceiveDone(si);
+              return false;
            }
 	   if (viceCapture) {
               if (viceCaptureWaitLine1) {
 		     if (top->V_XPOS == 0 && top->V_RASTER_LINE == 0) {
 		         viceCaptureWaitLine1 = false;
 		     }
-	      } else if (top->V_XPOS == lastXPos && top->V_RASTER_LINE == screenHeight - 1) {
+	      } else if (top->V_XPOS == si->lastXPos && top->V_RASTER_LINE == si->screenHeight - 1) {
                state->flags |= VICII_OP_CAPTURE_ABORT;
-               ipc_receive_done(ipc);
-
-               SDL_Surface *sshot = SDL_CreateRGBSurface(0, screenWidth*2, screenHeight*2,
-                   32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000);
-               SDL_RenderReadPixels(ren, NULL, SDL_PIXELFORMAT_ARGB8888,
-                                    sshot->pixels, sshot->pitch);
-               SDL_SaveBMP(sshot, "screenshot.bmp");
-               SDL_FreeSurface(sshot);
-               exit(0);
+               ipcReceiveDone(si);
+
+               // Done with this frame, no need to wait for a key
+               saveFrame(si);
+               si->frameSaved = true;
+               keyPressToQuit = false;
+               return false;
 	     }
 	   }
 
            ticksUntilDone--;
            ticksUntilPhase--;
 
+           if (ticksUntilDone == 0 && (si->busRec || si->comparing) &&
+                 busStepOut(si))
+              needQuit = true;
+
+           // In batch mode only answer after the last step
+           if (ticksUntilDone == 0 && batchCount) {
+              saveBatchStep(state, batch, batchPos++, lastRegs);
+              if (batchPos < batchCount && !needQuit) {
+                 loadBatchStep(state, batch, batchPos);
+                 recordStepIn(si);
+                 ticksUntilDone = 4;
+              } else {
+                 batchCount = 0;
+              }
+           }
+
            if (ticksUntilDone == 0 || needQuit) {
               // Do not change state after this line
-              if (ipc_receive_done(ipc))
-                 break;
+              if (ipcReceiveDone(si))
+                 return false;
            }
 
            if (needQuit) {
               // Safe to quit now. We sent our response.
-              break;
+              return false;
            }
 
 	   if (cycleByCycle && top->clk_phi != last_phase) {
@@ -1406,7 +1834,7 @@ int main(int argc, char** argv, char** env) {
 		printf ("(PAUSE NEXT PHASE 1st tick)\n");
 
 		if (showWindow && cycleByCycleCount == 0)
-                   SDL_RenderPresent(ren);
+                   present(ren, tex, fb);
 
 		if (cycleByCycleCount == 0) {
                   bool quit = false;
@@ -1429,11 +1857,11 @@ int main(int argc, char** argv, char** env) {
                                     quit=true; break;
 				 // Next lines
                                  case SDLK_SPACE:
-		        	    cycleByCycleCount = numCycles * 2;
+		        	    cycleByCycleCount = si->numCycles * 2;
                                     quit=true; break;
 				 // Next 10 lines
                                  case SDLK_n:
-		        	    cycleByCycleCount = numCycles * 20;
+		        	    cycleByCycleCount = si->numCycles * 20;
                                     quit=true; break;
 				 // Show regs
                                  case SDLK_r:
@@ -1464,61 +1892,1384 @@ int main(int argc, char** argv, char** env) {
         }
 
         // End of eval. Remember current values for previous compares.
-        STORE_PREV();
+        STORE_PREV(si);
+
+        if (si->saveTrigger) {
+           int reg = (top->ce == 0 && top->rw == 0) ?
+              (top->adl & 0x3f) : TRIG_ANY;
+           if (trig_update(si->saveTrigger, top->V_RASTER_LINE,
+                 top->V_CYCLE_NUM, top->V_XPOS, reg)) {
+              // Restoring replays this tick, which is harmless.
+              if (saveCheckpoint(si, si->cfg.saveFile))
+                 si->failed = true;
+              si->saveTrigger = nullptr;
+           }
+        }
 
         // Is it time to stop?
-        if (captureByTime && ticks >= endTicks)
-           break;
+        if (captureByTime && ticks >= si->endTicks)
+           return false;
 
-        // Advance simulation time. Each tick represents 1 picosecond.
-        ticks = nextTick(top, tfp, chip);
-    }
+        if (windowClosed || si->failed || si->stimDone)
+           return false;
 
-    if (shadowVic) {
-       ipc_close(ipc);
+        // Advance simulation time. Each tick represents 1 picosecond.
+        ticks = nextTick(si, tfp);
     }
+    return true;
+}
 
-    if (showWindow) {
-
-       // Instead of waiting for a key, do the capture if requested
-       if (endCapture) {
-          SDL_Surface *sshot = SDL_CreateRGBSurface(0, screenWidth*2, screenHeight*2,
-             32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000);
-          SDL_RenderReadPixels(ren, NULL, SDL_PIXELFORMAT_ARGB8888,
-             sshot->pixels, sshot->pitch);
-          SDL_SaveBMP(sshot, "screenshot.bmp");
-          SDL_FreeSurface(sshot);
-          exit(0);
-       }
 
-       bool quit = false;
-       while (!quit && keyPressToQuit) {
-          while (SDL_PollEvent(&event)) {
-             switch (event.type) {
-                case SDL_QUIT:
-                case SDL_KEYUP:
-                   quit=true; break;
-                default:
-                   break;
-             }
-           }
-       }
+// The registers a --load program left behind (the kernal's, or its
+// own if it was started before the model) go into the model the same
+// way a VICE sync does.
+static void machineRegsToModel(struct sim_instance* si) {
+    struct vicii_state vs;
+    memset(&vs, 0, sizeof(vs));
+    memcpy(vs.vice_reg, si->machine->vicRegs, sizeof(vs.vice_reg));
+    vs.idle = 1;
+    vs.reg11_delayed = vs.vice_reg[0x11];
+    vs.allow_bad_lines = (vs.vice_reg[0x11] & 0x10) ? 1 : 0;
+    vs.vborder = 1;
+    vs.main_border = 1;
+    vs.set_vborder = 1;
+    regs_vice_to_fpga(si->top, &vs);
+}
 
-       SDL_DestroyRenderer(ren);
-       SDL_DestroyWindow(win);
-       SDL_Quit();
+// Run the reset sequence and poke the registers we want set before
+// the first frame. --restore skips this.
+static void resetModel(struct sim_instance* si, SimTrace* tfp,
+                       bool traceReset) {
+    Vtop* top = si->top;
+    int cnt = 0;
+    top->eval();
+    while (top->V_RST) {
+       si->nextClkCnt = 0;
+#if VM_TRACE
+       if (tfp) tfp->dump(si->ticks / TICKS_TO_TIMESCALE);
+#endif
+       if (traceReset) STATE(si);
+       STORE_PREV(si);
+       si->ticks = nextTick(si, tfp);
+       cnt++;
     }
 
-    // Final model cleanup
-    top->final();
+    // Not sure if this matters anymore
+    si->nextClkCnt = 31;
 
-#if VM_TRACE
-    if (tfp) { tfp->close(); tfp = NULL; }
+    top->lp = 1;
+    top->rw = 1;
+    top->ce = 1;
+    top->lp = 1;
+    top->adl = 0;
+    top->V_DBI = 0;
+    top->V_DEN = 1;
+    top->V_CSEL = 1;
+    top->V_RSEL = 1;
+    top->V_VBORDER = 1;
+    top->V_MAIN_BORDER = 1;
+    top->V_SET_VBORDER = 1;
+    top->V_B0C = 6;
+    top->V_EC = 14;
+    top->V_VM = 1; // 0001
+    top->V_CB = 2; //  010
+    top->V_YSCROLL = 3; //  011
+#ifdef NEED_RGB
+    // NOTE: We are hard wired to do 2x and 1y. Any other
+    // configuration will require some work to the
+    // way rendering is done. If we have registers_eeprom, let
+    // that module set is_native_y as if it came from a the
+    // eeprom. Otherwise, just force it here.
+#ifndef HAVE_EEPROM
+
+#ifdef EFINIX
+    // Efinix DVI doesn't support native y
+    top->top__DOT__vic_inst__DOT__is_native_y = 0;
+#else
+    top->top__DOT__vic_inst__DOT__is_native_y = 1;
 #endif
 
-    // Destroy model
-    delete top;
+    top->top__DOT__vic_inst__DOT__is_native_x = 0;
+#endif
+#else
+    // NO RGB? We will fallback to native res and we will use
+    // the color index coming out of the pixel sequencer
+    // (pixel_color3)
+    ;
+#endif
+}
+
+static void usage() {
+    printf ("Usage\n");
+    printf ("  -s [uS]   : start at uS\n");
+    printf ("  -d [uS]   : run for uS\n");
+    printf ("  -w        : show SDL2 window\n");
+    printf ("  -z        : single step eval for shadow vic via ipc\n");
+    printf ("  -b        : render each cycle, waiting for key press after each one\n");
+    printf ("  -c <chip> : 0=CHIP6567R8, 1=CHIP6569R3 2=CHIP6567R56A 3=CHIP6569R1\n");
+    printf ("  -l        : log level\n");
+    printf ("  -q        : hide scanline\n");
+    printf ("  -k        : hide sync lines\n");
+    printf ("  -t        : enable tracing to session.vcd (session.fst with make TRACE=fst)\n");
+    printf ("  -F <scope>: only trace signals under scope (implies -t, repeatable)\n");
+    printf ("              e.g. -F TOP.top.vic_inst.vic_sprites\n");
+    printf ("  -x        : sync with VICE and save a frame before exiting\n");
+    printf ("  -y        : save a frame before exiting\n");
+    printf ("  -o <file> : write frames to file (.ppm .png .bmp .raw), no window needed\n");
+    printf ("              use a %%d in the name to write every frame\n");
+    printf ("  -p <mode> : window update: frame (default), lines:N or ms:N\n");
+    printf ("  -v        : sync window updates to the display refresh\n");
+    printf ("  -C        : drive all clocks even if nothing observes them\n");
+    printf ("  -R <file> : record per tick state to a binary file (see tickdump)\n");
+    printf ("  -T <win>  : only trace/log inside window start[/stop] (repeatable)\n");
+    printf ("              e.g. -T frame=50,line=0x30/line=0x31 or -T reg=d011\n");
+    printf ("  -B <n>    : keep last n cycles in memory, dump to flightrec.txt/.vcd\n");
+    printf ("              on a failed check or fatal signal\n");
+    printf ("  -S, --save-at <when>:<file>\n");
+    printf ("              : checkpoint the model after reset (when=reset)\n");
+    printf ("                or at a trigger event (e.g. frame=10)\n");
+    printf ("  -L, --restore <file>\n");
+    printf ("              : start from a checkpoint instead of reset\n");
+    printf ("  -K <n>    : IPC session for -z (default $VICII_IPC_SESSION or 0)\n");
+    printf ("  -E, --record-bus <file>\n");
+    printf ("              : with -z, record VICE's bus inputs and our answers\n");
+    printf ("  -P, --replay <file>\n");
+    printf ("              : drive the model from a -E recording instead of VICE\n");
+    printf ("  -M, --compare <file>\n");
+    printf ("              : with -z, check our answers against a -E recording\n");
+    printf ("  -D, --diverge-context <n>\n");
+    printf ("              : steps around the first mismatch written to\n");
+    printf ("                divergence.txt (default 16)\n");
+    printf ("  -X, --stop-on-diverge\n");
+    printf ("              : stop once the divergence report is written\n");
+    printf ("  -A, --capture-after <ms>\n");
+    printf ("              : with -x, start the capture this long after VICE\n");
+    printf ("                has attached instead of right away\n");
+    printf ("  -N, --native: write frames at native resolution (no 2x/2y)\n");
+    printf ("  -I, --ref-image <file>\n");
+    printf ("              : compare the last frame with an image (.ppm .png .bmp)\n");
+    printf ("  -G, --diff-image <file>\n");
+    printf ("              : with -I, write differing pixels in white\n");
+    printf ("  -H, --expect-hash <hex>\n");
+    printf ("              : compare the last frame's hash (printed at exit)\n");
+    printf ("  -J, --jobs <file>\n");
+    printf ("              : run each line of file (more options) as its own\n");
+    printf ("                simulation, several at once in this process\n");
+    printf ("  -j <n>    : run up to n -J jobs at once (default one per cpu)\n");
+    printf ("  -m, --load <file>\n");
+    printf ("              : run a .prg or .vsf on a built in 6510 and 64K\n");
+    printf ("                instead of shadowing VICE\n");
+    printf ("  -O, --roms <dir>\n");
+    printf ("              : kernal, basic and chargen for -m\n");
+    printf ("  -e, --stim <file>\n");
+    printf ("              : drive register accesses and lp from a script and\n");
+    printf ("                check reads and pins, ends with the script\n");
+    printf ("  -V, --ref-model <fields>\n");
+    printf ("              : check the model against a behavioural one every\n");
+    printf ("                cycle. all or some of vc,rc,idle,badline,sprites,border\n");
+    printf ("  -f, --fuzz <seed>[:<n>]\n");
+    printf ("              : random register writes from seeds seed..seed+n-1,\n");
+    printf ("                several at once (-j), failures are minimized to\n");
+    printf ("                a fuzzN.stim for -e\n");
+    printf ("  -n, --fuzz-frames <n>\n");
+    printf ("              : frames of writes per seed (default %d)\n",
+            FUZZ_DEFAULT_FRAMES);
+    printf ("  -Y, --frames <n>\n");
+    printf ("              : run for n frames instead of -d\n");
+    printf ("  -W, --bench[=<file>]\n");
+    printf ("              : time the run (cycles/s, evals/s, time in eval,\n");
+    printf ("                render, trace and ipc), append a line to file\n");
+    printf ("  -U, --bench-label <text>\n");
+    printf ("              : what to call the run in the --bench file\n");
+}
+
+static void defaultConfig(struct sim_config* cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->chip = CHIP6569R3;
+    cfg->logLevel = LOG_ERROR;
+    cfg->captureByTime = true;
+    cfg->scanline = true;
+    cfg->presentSpec = "frame";
+    trig_init(&cfg->saveTrigger);
+    trig_init(&cfg->triggers);
+    cfg->ipcSession = -1;
+    cfg->divergeContext = 16;
+    cfg->fuzzFrames = FUZZ_DEFAULT_FRAMES;
+    // Default to 16.7us starting at 0
+    cfg->startUs = 0;
+    cfg->userDurationUs = -1;
+}
+
+// Applies options to cfg. Called for the command line and again for
+// each -J job line, on top of a copy of what the command line said.
+// Returns 1 on error.
+static int parseArgs(int argc, char** argv, struct sim_config* cfg) {
+    static struct option longOptions[] = {
+       { "save-at", required_argument, 0, 'S' },
+       { "restore", required_argument, 0, 'L' },
+       { "record-bus", required_argument, 0, 'E' },
+       { "replay", required_argument, 0, 'P' },
+       { "compare", required_argument, 0, 'M' },
+       { "diverge-context", required_argument, 0, 'D' },
+       { "stop-on-diverge", no_argument, 0, 'X' },
+       { "capture-after", required_argument, 0, 'A' },
+       { "native", no_argument, 0, 'N' },
+       { "ref-image", required_argument, 0, 'I' },
+       { "diff-image", required_argument, 0, 'G' },
+       { "expect-hash", required_argument, 0, 'H' },
+       { "jobs", required_argument, 0, 'J' },
+       { "load", required_argument, 0, 'm' },
+       { "roms", required_argument, 0, 'O' },
+       { "stim", required_argument, 0, 'e' },
+       { "ref-model", required_argument, 0, 'V' },
+       { "fuzz", required_argument, 0, 'f' },
+       { "fuzz-frames", required_argument, 0, 'n' },
+       { "frames", required_argument, 0, 'Y' },
+       { "bench", optional_argument, 0, 'W' },
+       { "bench-label", required_argument, 0, 'U' },
+       { 0, 0, 0, 0 }
+    };
+    int c;
+
+    // Start over, this may not be the first argument list
+    optind = 0;
+    while ((c = getopt_long (argc, argv,
+                "akc:hs:d:wi:zbl:r:gtxqyo:p:vCR:F:T:B:S:L:K:E:P:M:D:XA:NI:G:H:J:j:m:O:e:V:f:n:Y:W::U:",
+                longOptions, NULL)) != -1)
+    switch (c) {
+      case 'q':
+        cfg->scanline = false;
+        break;
+      case 't':
+        cfg->tracing = true;
+        break;
+      case 'F':
+        if (cfg->numTraceScopes == MAX_TRACE_SCOPES) {
+           LOG(LOG_ERROR, "too many trace scopes");
+           return 1;
+        }
+        cfg->traceScopes[cfg->numTraceScopes++] = optarg;
+        cfg->tracing = true;
+        break;
+      case 'l':
+        cfg->logLevel = atoi(optarg);
+        break;
+      case 'c':
+        cfg->chip = atoi(optarg);
+        break;
+      case 'b':
+        cfg->cycleByCycle = true;
+        break;
+      case 'z':
+        // IPC tells us when to start/stop capture
+        cfg->captureByTime = false;
+        cfg->shadowVic = true;
+        break;
+      case 'w':
+        cfg->showWindow = true;
+        break;
+      case 'k':
+        cfg->hideSync = true;
+        break;
+      case 'a':
+        cfg->showActive = true;
+        break;
+      case 's':
+        cfg->startUs = atol(optarg);
+        break;
+      case 'd':
+        cfg->userDurationUs = atol(optarg);
+        break;
+      case 'h':
+        usage();
+        exit(0);
+      case 'x':
+	cfg->viceCapture = true;
+	break;
+      case 'y':
+	cfg->endCapture = true;
+	break;
+      case 'o':
+	cfg->outFile = optarg;
+	break;
+      case 'p':
+	cfg->presentSpec = optarg;
+	break;
+      case 'v':
+	cfg->vsync = true;
+	break;
+      case 'C':
+	cfg->allClocks = true;
+	break;
+      case 'R':
+	cfg->recordFile = optarg;
+	break;
+      case 'T':
+	if (trig_add(&cfg->triggers, optarg))
+	   return 1;
+	break;
+      case 'B':
+	cfg->flightCycles = atoi(optarg);
+	break;
+      case 'S': {
+	// <when>:<file> where when is 'reset' or a trigger event
+	char* colon = strrchr(optarg, ':');
+	if (!colon || colon == optarg || colon[1] == '\0') {
+	   LOG(LOG_ERROR, "--save-at needs <when>:<file>");
+	   return 1;
+	}
+	*colon = '\0';
+	cfg->saveFile = colon + 1;
+	if (strcmp(optarg, "reset") == 0)
+	   cfg->saveAtReset = true;
+	else if (trig_add(&cfg->saveTrigger, optarg))
+	   return 1;
+	break;
+      }
+      case 'L':
+	cfg->restoreFile = optarg;
+	break;
+      case 'K':
+	cfg->ipcSession = atoi(optarg);
+	break;
+      case 'E':
+	cfg->recordBusFile = optarg;
+	break;
+      case 'P':
+	// Like -z but the bus comes from a recording
+	cfg->replayFile = optarg;
+	cfg->captureByTime = false;
+	cfg->shadowVic = true;
+	break;
+      case 'M':
+	cfg->compareFile = optarg;
+	break;
+      case 'D':
+	cfg->divergeContext = atoi(optarg);
+	break;
+      case 'X':
+	cfg->divergeStop = true;
+	break;
+      case 'A':
+	cfg->captureAfterMs = atoi(optarg);
+	break;
+      case 'N':
+	cfg->nativeFrames = true;
+	break;
+      case 'I':
+	cfg->refImageFile = optarg;
+	break;
+      case 'G':
+	cfg->diffImageFile = optarg;
+	break;
+      case 'H':
+	cfg->expectedHash = strtoull(optarg, NULL, 16);
+	cfg->haveExpectedHash = true;
+	break;
+      case 'J':
+	cfg->jobsFile = optarg;
+	break;
+      case 'j':
+	cfg->jobThreads = atoi(optarg);
+	break;
+      case 'm':
+	cfg->loadFile = optarg;
+	break;
+      case 'O':
+	cfg->romDir = optarg;
+	break;
+      case 'e':
+	cfg->stimFile = optarg;
+	break;
+      case 'V':
+	cfg->refFields = ref_parse_fields(optarg);
+	if (!cfg->refFields)
+	   return 1;
+	break;
+      case 'f': {
+	// <seed>[:<how many>]
+	char* end;
+	cfg->fuzzSeed = strtoull(optarg, &end, 0);
+	cfg->fuzzSeeds = 1;
+	if (*end == ':')
+	   cfg->fuzzSeeds = strtol(end + 1, &end, 0);
+	if (end == optarg || *end != '\0' || cfg->fuzzSeeds < 1) {
+	   LOG(LOG_ERROR, "--fuzz needs <seed>[:<n>]");
+	   return 1;
+	}
+	break;
+      }
+      case 'n':
+	cfg->fuzzFrames = atoi(optarg);
+	if (cfg->fuzzFrames < 1) {
+	   LOG(LOG_ERROR, "--fuzz-frames needs at least 1");
+	   return 1;
+	}
+	break;
+      case 'Y':
+	cfg->frames = atoi(optarg);
+	if (cfg->frames < 1) {
+	   LOG(LOG_ERROR, "--frames needs at least 1");
+	   return 1;
+	}
+	break;
+      case 'W':
+	cfg->bench = true;
+	cfg->benchFile = optarg;
+	break;
+      case 'U':
+	cfg->benchLabel = optarg;
+	break;
+      case '?':
+        if (optopt == 't' || optopt == 's') {
+          LOG(LOG_ERROR, "Option -%c requires an argument", optopt);
+        } else if (isprint (optopt)) {
+          LOG(LOG_ERROR, "Unknown option `-%c'", optopt);
+        } else {
+          LOG(LOG_ERROR, "Unknown option character `\\x%x'", optopt);
+        }
+        return 1;
+      default:
+        return 1;
+    }
+    return 0;
+}
+
+static void freeSim(struct sim_instance* si);
+
+// Builds the model a run asks for and takes it through reset (or
+// restores it). The window, if any, is up to the caller. Returns NULL
+// on error.
+static struct sim_instance* sim_open(const struct sim_config* config,
+                                     const char* prefix) {
+    struct sim_instance* si =
+       (struct sim_instance*) calloc(1, sizeof(struct sim_instance));
+    si->cfg = *config;
+    snprintf(si->prefix, sizeof(si->prefix), "%s", prefix);
+    struct sim_config* cfg = &si->cfg;
+    const int chip = cfg->chip;
+    bool isNtsc = false;
+
+    si->prevY = -1;
+    si->keyPressToQuit = true;
+    si->viceCaptureWaitLine1 = true;
+    // We poke pins and registers before the first step
+    si->inputsChanged = true;
+    si->startTicks = US_TO_TICKS(cfg->startUs);
+
+    // Pixels go to our frame buffer. We only need SDL if someone
+    // is going to look at them.
+    if ((cfg->endCapture || cfg->viceCapture) && cfg->outFile == nullptr)
+       cfg->outFile = simFile(si, "screenshot.bmp", si->screenshotFile,
+                              sizeof(si->screenshotFile));
+    si->render = cfg->showWindow || cfg->outFile != nullptr ||
+       cfg->refImageFile || cfg->haveExpectedHash;
+
+    // Add new input/output here.
+#if VERILATOR_VERSION_INTEGER >= 4210000
+    // Runs on other threads have their own context
+    si->context = new VerilatedContext;
+    si->top = new Vtop(si->context);
+#else
+    si->top = new Vtop;
+#endif
+    Vtop* top = si->top;
+
+#if VM_TRACE
+    if (cfg->tracing) {
+        char traceFile[64];
+        simFile(si, TRACE_FILE, traceFile, sizeof(traceFile));
+        // Verilator must compute traced signals
+#if VERILATOR_VERSION_INTEGER >= 4210000
+        si->context->traceEverOn(true);
+#else
+        Verilated::traceEverOn(true);
+#endif
+        VL_PRINTF("verilog tracing into %s\n", traceFile);
+        si->tfp = new SimTrace;
+        top->trace(si->tfp, 99);  // Trace 99 levels of hierarchy
+        if (cfg->numTraceScopes > 0) {
+#if VERILATOR_VERSION_INTEGER >= 5020000
+           for (int i = 0; i < cfg->numTraceScopes; i++) {
+              // Accept the vpi style 'a.b.*' as well as 'a.b'
+              std::string scope = cfg->traceScopes[i];
+              if (scope.size() > 2 &&
+                     scope.compare(scope.size() - 2, 2, ".*") == 0)
+                 scope.resize(scope.size() - 2);
+              VL_PRINTF("  scope %s\n", scope.c_str());
+              // Level 0 would dump the whole design whatever the
+              // scope says, so ask for every level under it instead
+              si->tfp->dumpvars(99, scope);
+           }
+#else
+           LOG(LOG_ERROR, "-F needs Verilator 5.020 or newer");
+           freeSim(si);
+           return NULL;
+#endif
+        }
+        si->tfp->open(traceFile);  // Open the dump file
+    }
+#endif
+
+    top->eval();
+
+    switch (chip) {
+       case CHIP6567R8:
+          isNtsc = true;
+          printf ("%sCHIP: 6567R8\n", si->prefix);
+          printf ("%sVIDEO: NTSC\n", si->prefix);
+          break;
+       case CHIP6567R56A:
+          isNtsc = true;
+          printf ("%sCHIP: 6567R56A\n", si->prefix);
+          printf ("%sVIDEO: NTSC\n", si->prefix);
+          break;
+       case CHIP6569R1:
+          isNtsc = false;
+          printf ("%sCHIP: 6569R1\n", si->prefix);
+          printf ("%sVIDEO: PAL\n", si->prefix);
+          break;
+       case CHIP6569R3:
+          isNtsc = false;
+          printf ("%sCHIP: 6569R3\n", si->prefix);
+          printf ("%sVIDEO: PAL\n", si->prefix);
+          break;
+       default:
+          LOG(LOG_ERROR, "unknown chip");
+          freeSim(si);
+          return NULL;
+    }
+
+    if (cfg->recordFile) {
+       si->tickRec = tickrec_open(cfg->recordFile, chip);
+       if (!si->tickRec) {
+          freeSim(si);
+          return NULL;
+       }
+       printf ("%sRecording ticks to %s\n", si->prefix, cfg->recordFile);
+    }
+
+    if (cfg->flightCycles) {
+       si->flightRec = flightrec_init(cfg->flightCycles);
+       if (!si->flightRec) {
+          freeSim(si);
+          return NULL;
+       }
+       printf ("%sFlight recorder: %d cycles\n", si->prefix,
+               cfg->flightCycles);
+    }
+
+    vluint64_t durationTicks;
+    if (cfg->userDurationUs == (vluint64_t) -1) {
+       switch (chip) {
+          case CHIP6567R8:
+          case CHIP6567R56A:
+             durationTicks = US_TO_TICKS(17000L);
+             break;
+          case CHIP6569R1:
+          case CHIP6569R3:
+             durationTicks = US_TO_TICKS(20000L);
+             break;
+          default:
+             durationTicks = US_TO_TICKS(20000L);
+       }
+    } else {
+       durationTicks = US_TO_TICKS(cfg->userDurationUs);
+    }
+
+    if (isNtsc) {
+       si->half4XDotPS = NTSC_HALF_4X_DOT_PS;
+       switch (chip) {
+          case CHIP6567R56A:
+             si->screenWidth = NTSC_6567R56A_MAX_DOT_X+1;
+             si->screenHeight = NTSC_6567R56A_MAX_DOT_Y+1;
+             si->lastXPos = NTSC_6567R56A_LAST_XPOS;
+	     si->numCycles = NTSC_6567R56A_NUM_CYCLES;
+             break;
+          case CHIP6567R8:
+             si->screenWidth = NTSC_6567R8_MAX_DOT_X+1;
+             si->screenHeight = NTSC_6567R8_MAX_DOT_Y+1;
+             si->lastXPos = NTSC_6567R8_LAST_XPOS;
+	     si->numCycles = NTSC_6567R8_NUM_CYCLES;
+             break;
+       }
+    } else {
+       si->half4XDotPS = PAL_HALF_4X_DOT_PS;
+       si->screenWidth = PAL_6569_MAX_DOT_X+1;
+       si->screenHeight = PAL_6569_MAX_DOT_Y+1;
+       si->lastXPos = PAL_6569_LAST_XPOS;
+       si->numCycles = PAL_6569_NUM_CYCLES;
+    }
+
+    // Only drive clock domains that are rendered, checked or traced
+    // in this run. Each col16x edge costs a model evaluation so leaving
+    // it out when nobody looks at chroma saves a lot of time.
+    unsigned char domains = EDGE_DOT4X;
+    if (cfg->allClocks || cfg->tracing) {
+       domains |= EDGE_COL4X;
+    }
+#ifdef HAVE_COL16X_LOADS
+#ifdef EFINIX
+    // Efinix address generation uses col16x so we always need it
+    domains |= EDGE_COL16X;
+#else
+    if (cfg->allClocks || cfg->tracing) {
+       domains |= EDGE_COL16X;
+    }
+#endif
+#endif
+#ifdef DRIVE_DVI_CLOCK
+    const int* dviScale = isNtsc ? tick_scale_ntsc : tick_scale_pal;
+    // Our rendered RGB comes from the dvi clock domain
+    if (cfg->allClocks || cfg->tracing || si->render) {
+       domains |= EDGE_DVI;
+    }
+#else
+    const int* dviScale = NULL;
+#endif
+    edges_init(&si->edgeSched, si->half4XDotPS,
+               isNtsc ? NTSC_COL16X_PER_4_DOT4X : PAL_COL16X_PER_4_DOT4X,
+               dviScale, domains);
+    LOG(LOG_INFO, "clocks: dot4x%s%s%s",
+        domains & EDGE_COL4X ? " col4x" : "",
+        domains & EDGE_COL16X ? " col16x" : "",
+        domains & EDGE_DVI ? " dvi" : "");
+
+    if (si->render) {
+      si->fb = fb_init(si->screenWidth*2, si->screenHeight*2);
+    }
+
+    if (present_init(&si->presentSched, cfg->presentSpec)) {
+      freeSim(si);
+      return NULL;
+    }
+
+    // Default all signals to bit 1 and include in monitoring.
+    for (int i = 0; i < NUM_SIGNALS; i++) {
+      si->signal_width[i] = 1;
+      si->signal_bit[i] = 1;
+    }
+
+    // Add new input/output here.
+    si->signal_src8[OUT_DOT] = &top->V_CLK_DOT;
+    si->signal_src8[OUT_DOT_RISING] = &top->V_CLK_DOT;
+    si->signal_width[OUT_DOT_RISING] = 4; // 4 bit shif reg
+    si->signal_bit[OUT_DOT_RISING] = 0b1111; // mask to get values
+
+    HEADER(top);
+
+    // Video standard toggle switch should be HIGH simulating PULLUP
+    top->standard_sw = 1;
+#if WITH_EXTENSIONS
+    // cfg reset is held HIGH simulating pullup
+#if HAVE_EEPROM
+    top->cfg_reset = 1;
+#endif
+    // simulate SHORTED for config pins
+    top->cfg1 = 0; // spi_lock
+    top->cfg2 = 0; // extensions_lock
+    top->cfg3 = 0; // persistence_lock
+#endif
+    // cpu_reset_i is held HIGH simulating pullup
+#if HIRES_RESET
+    top->cpu_reset_i = 1;
+#endif
+
+#if HAVE_EEPROM
+    top->sim_chip = chip;
+#else
+    top->V_CHIP = chip;
+#endif
+
+    // Nothing before the first trigger window is traced, reset included
+    bool traceReset = cfg->triggers.numWindows == 0;
+    if (cfg->restoreFile) {
+       if (loadCheckpoint(si, cfg->restoreFile)) {
+          freeSim(si);
+          return NULL;
+       }
+    } else {
+       resetModel(si, traceReset ? si->tfp : NULL, traceReset);
+       if (cfg->saveAtReset && saveCheckpoint(si, cfg->saveFile)) {
+          freeSim(si);
+          return NULL;
+       }
+    }
+
+    // Start counting from after reset
+    si->startTicks = si->ticks;
+    si->endTicks = si->startTicks + durationTicks;
+    if (cfg->frames)
+       si->endTicks = si->startTicks + (vluint64_t) cfg->frames *
+          si->screenHeight * si->numCycles * cycleTicks(si);
+
+    if (cfg->loadFile) {
+       if (cfg->shadowVic) {
+          LOG(LOG_ERROR, "--load can't be used with -z or --replay");
+          freeSim(si);
+          return NULL;
+       }
+       si->machine = machine_open(cfg->romDir, si->numCycles,
+                                  si->screenHeight);
+       if (machine_load(si->machine, cfg->loadFile)) {
+          freeSim(si);
+          return NULL;
+       }
+       machineRegsToModel(si);
+    }
+
+    if (cfg->stimFile) {
+       if (cfg->shadowVic || cfg->loadFile) {
+          LOG(LOG_ERROR, "--stim can't be used with -z, --replay or --load");
+          freeSim(si);
+          return NULL;
+       }
+       si->stim = stim_open(cfg->stimFile);
+       if (!si->stim) {
+          freeSim(si);
+          return NULL;
+       }
+       // Without -d or --frames the script says when we are done
+       if (cfg->userDurationUs == (vluint64_t) -1 && !cfg->frames)
+          si->endTicks = ~(vluint64_t) 0;
+    }
+
+    if (cfg->fuzzSeeds) {
+       if (cfg->shadowVic || cfg->loadFile || cfg->stimFile) {
+          LOG(LOG_ERROR,
+              "--fuzz can't be used with -z, --replay, --load or --stim");
+          freeSim(si);
+          return NULL;
+       }
+       if (cfg->fuzzEvents) {
+          char name[32];
+          snprintf(name, sizeof(name), "fuzz seed %llu",
+                   (unsigned long long) cfg->fuzzSeed);
+          si->stim = stim_from_events(name, cfg->fuzzEvents,
+                                      cfg->numFuzzEvents);
+          si->stim->cpuTiming = true;
+       } else {
+          si->stim = fuzz_open(cfg->fuzzSeed, cfg->fuzzFrames,
+                               si->numCycles, si->screenHeight);
+       }
+       if (cfg->userDurationUs == (vluint64_t) -1 && !cfg->frames)
+          si->endTicks = ~(vluint64_t) 0;
+    }
+
+    if (cfg->refFields)
+       si->ref = ref_open(chip);
+
+    if (cfg->replayFile && cfg->compareFile) {
+       LOG(LOG_ERROR, "--replay already compares, drop --compare");
+       freeSim(si);
+       return NULL;
+    }
+
+    if (cfg->replayFile) {
+       si->refRec = busrec_open_replay(cfg->replayFile, chip);
+       if (!si->refRec) {
+          freeSim(si);
+          return NULL;
+       }
+       // Same starting point ipc_open gives us
+       si->state = (struct vicii_state*) calloc(1, IPC_BUFSIZE);
+       si->state->enabled = 1;
+       si->state->rw = 1;
+       si->state->ce = 1;
+    } else if (cfg->shadowVic) {
+       si->ipc = ipc_init(IPC_RECEIVER);
+       if (cfg->ipcSession >= 0)
+          ipc_set_session(si->ipc, cfg->ipcSession);
+       if (ipc_open(si->ipc)) {
+          si->ipc = nullptr;
+          freeSim(si);
+          return NULL;
+       }
+       si->state = si->ipc->state;
+       // Scripts wait for this before starting VICE
+       printf ("%sIPC session %d open\n", si->prefix, si->ipc->session);
+       fflush(stdout);
+    }
+
+    // VICE starts syncing as soon as it sees the capture flag, so
+    // give the test program time to set up its screen first. That
+    // time is counted from when VICE attached, not from when it
+    // was launched, but it is still a fixed delay: VICE tells us
+    // nothing about the program before the capture starts.
+    if (cfg->viceCapture && si->ipc && cfg->captureAfterMs > 0) {
+       while (!ipc_peer_attached(si->ipc))
+          usleep(10000);
+       LOG(LOG_INFO, "VICE attached, capturing in %d ms",
+           cfg->captureAfterMs);
+       usleep(cfg->captureAfterMs * 1000);
+    }
+
+    if (cfg->recordBusFile) {
+       if (!si->ipc) {
+          LOG(LOG_ERROR, "-E needs -z");
+          freeSim(si);
+          return NULL;
+       }
+       si->busRec = busrec_open_record(cfg->recordBusFile, chip);
+       if (!si->busRec) {
+          freeSim(si);
+          return NULL;
+       }
+    }
+
+    if (cfg->compareFile) {
+       if (!si->ipc) {
+          LOG(LOG_ERROR, "--compare needs -z");
+          freeSim(si);
+          return NULL;
+       }
+       si->refRec = busrec_open_replay(cfg->compareFile, chip);
+       if (!si->refRec) {
+          freeSim(si);
+          return NULL;
+       }
+       si->compareInputs = true;
+    }
+
+    if (si->refRec) {
+       si->divergeRep = diverge_init(cfg->divergeContext,
+          simFile(si, "divergence.txt", si->divergeFile,
+                  sizeof(si->divergeFile)));
+       if (!si->divergeRep) {
+          freeSim(si);
+          return NULL;
+       }
+       si->comparing = true;
+    }
+
+    si->triggers = cfg->triggers.numWindows ? &cfg->triggers : nullptr;
+    si->saveTrigger = cfg->saveTrigger.numWindows ?
+       &cfg->saveTrigger : nullptr;
+    si->showState = !si->triggers;
+    si->batch = si->ipc ? si->ipc->batch : nullptr;
+
+    // Only the run itself is timed
+    if (cfg->bench)
+       si->bench = bench_open();
+
+    // Pick the loop built for this chip once, instead of asking
+    // which chip we are on every tick.
+    switch (chip) {
+       case CHIP6567R8:
+          si->step = stepChip<ChipTraits<CHIP6567R8> >;
+          break;
+       case CHIP6569R3:
+          si->step = stepChip<ChipTraits<CHIP6569R3> >;
+          break;
+       case CHIP6567R56A:
+          si->step = stepChip<ChipTraits<CHIP6567R56A> >;
+          break;
+       case CHIP6569R1:
+          si->step = stepChip<ChipTraits<CHIP6569R1> >;
+          break;
+    }
+    return si;
+}
+
+// Runs up to maxTicks ticks. Returns false once the run is over.
+static bool sim_step(struct sim_instance* si, vluint64_t maxTicks) {
+    return si->step(si, maxTicks);
+}
+
+// Runs until the capture, the duration or the recording is over
+static void sim_run(struct sim_instance* si) {
+    while (sim_step(si, ~(vluint64_t) 0))
+       ;
+}
+
+// Ends a run. Prints its summary and writes and checks the last
+// frame. Returns the run's exit status.
+static int sim_finish(struct sim_instance* si) {
+    if (si->ipc) {
+       ipc_close(si->ipc);
+       si->ipc = nullptr;
+       si->state = nullptr;
+    }
+
+    closeBusRec(si);
+
+    bool replayFailed = false;
+    if (si->refRec) {
+       printf ("%s%s %llu steps, %llu mismatches\n", si->prefix,
+               si->compareInputs ? "Compared" : "Replayed",
+               (unsigned long long) si->refRec->steps,
+               (unsigned long long) si->refRec->mismatches);
+       if (si->inputMismatches)
+          printf ("%s%llu steps had different bus inputs\n", si->prefix,
+                  (unsigned long long) si->inputMismatches);
+       replayFailed = si->refRec->mismatches > 0;
+       diverge_finish(si->divergeRep);
+       diverge_free(si->divergeRep);
+       si->divergeRep = nullptr;
+       busrec_close(si->refRec);
+       si->refRec = nullptr;
+    }
+
+    // A -d run can end before the script does
+    bool scriptFailed = false;
+    if (si->stim && !si->failed) {
+       int left = stim_remaining(si->stim);
+       if (left) {
+          printf ("%sFAIL %s: %d of %d events never happened\n",
+                  si->prefix, si->stim->filename, left,
+                  si->stim->numEvents);
+          scriptFailed = true;
+       } else {
+          printf ("%s%s: %d events passed\n", si->prefix,
+                  si->stim->filename, si->stim->numEvents);
+       }
+    }
+
+    if (si->ref && !si->failed)
+       printf ("%sReference model: %llu cycles matched\n", si->prefix,
+               (unsigned long long) si->ref->cycles);
+
+    // A failed check or write ends the run without a frame
+    if (si->failed)
+       return -1;
+
+    // Save the last frame unless we have been writing every frame
+    const char* outFile = si->cfg.outFile;
+    if (outFile && !strchr(outFile, '%') && !si->frameSaved &&
+           saveFrame(si)) {
+       return -1;
+    }
+    bool frameFailed = false;
+    if (si->render && (outFile || si->cfg.refImageFile ||
+           si->cfg.haveExpectedHash)) {
+       frameFailed = checkFrame(si);
+    }
+
+    if (si->bench) {
+       struct bench_result res;
+       res.label = si->cfg.benchLabel;
+       res.chip = si->cfg.chip;
+       res.cycles = (si->ticks - si->startTicks) / cycleTicks(si);
+       res.frames = (double) res.cycles /
+          (si->screenHeight * si->numCycles);
+       if (bench_report(si->bench, &res, si->cfg.benchFile, si->prefix))
+          return -1;
+    }
+    return replayFailed || frameFailed || scriptFailed ? 1 : 0;
+}
+
+// Releases everything sim_open() or the run left open
+static void freeSim(struct sim_instance* si) {
+    if (si->ipc) {
+       ipc_close(si->ipc);
+    } else if (si->state) {
+       // --replay's
+       free(si->state);
+    }
+    closeBusRec(si);
+    closeTickRec(si);
+    if (si->flightRec) {
+       flightrec_free(si->flightRec);
+    }
+    if (si->divergeRep) {
+       diverge_free(si->divergeRep);
+    }
+    if (si->refRec) {
+       busrec_close(si->refRec);
+    }
+    if (si->fb) {
+       fb_free(si->fb);
+    }
+    if (si->machine) {
+       machine_free(si->machine);
+    }
+    if (si->stim) {
+       stim_free(si->stim);
+    }
+    if (si->ref) {
+       ref_free(si->ref);
+    }
+    if (si->bench) {
+       bench_free(si->bench);
+    }
+
+    // Final model cleanup
+    si->top->final();
+
+#if VM_TRACE
+    if (si->tfp) { si->tfp->close(); delete si->tfp; }
+#endif
+
+    // Destroy model
+    delete si->top;
+#if VERILATOR_VERSION_INTEGER >= 4210000
+    delete si->context;
+#endif
+    free(si);
+}
+
+static uint64_t nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#define MAX_JOB_ARGS 64
+
+// -J: the runs to do and how they went
+struct job_pool {
+    int numJobs;
+    struct sim_config* configs;
+    int* status;
+    uint64_t* ms;
+    std::atomic<int> next;
+};
+
+#define FUZZ_MAX_RUNS 400
+
+// A run while minimizing a fuzz script. See fuzz_run_fn.
+static int fuzzTrial(void* ctx, struct stim_event* events, int numEvents) {
+    struct sim_config cfg = *(const struct sim_config*) ctx;
+    cfg.fuzzEvents = events;
+    cfg.numFuzzEvents = numEvents;
+    struct sim_instance* si = sim_open(&cfg, "");
+    if (!si)
+       return -1;
+    sim_run(si);
+    int happened = -1;
+    if (si->failed) {
+       happened = si->stim->next;
+       memcpy(events, si->stim->events,
+              happened * sizeof(struct stim_event));
+    }
+    freeSim(si);
+    return happened;
+}
+
+// A fuzz seed failed. Cuts its script down to what still fails and
+// writes that out as a script for -e.
+static void minimizeFuzz(struct sim_instance* si) {
+    // Nothing after the failure matters
+    int numEvents = si->stim->next;
+    struct stim_event* events = (struct stim_event*)
+       malloc((numEvents ? numEvents : 1) * sizeof(struct stim_event));
+    memcpy(events, si->stim->events, numEvents * sizeof(struct stim_event));
+
+    // The same run without anything that writes files or prints
+    struct sim_config cfg = si->cfg;
+    cfg.quiet = true;
+    cfg.tracing = false;
+    cfg.numTraceScopes = 0;
+    cfg.recordFile = nullptr;
+    cfg.flightCycles = 0;
+    cfg.saveFile = nullptr;
+    cfg.saveAtReset = false;
+    trig_init(&cfg.saveTrigger);
+    cfg.outFile = nullptr;
+    cfg.refImageFile = nullptr;
+    cfg.haveExpectedHash = false;
+    cfg.endCapture = false;
+
+    int runs;
+    int left = fuzz_minimize(events, numEvents, FUZZ_MAX_RUNS, fuzzTrial,
+                             &cfg, &runs);
+
+    char name[32];
+    char file[64];
+    char comment[96];
+    snprintf(name, sizeof(name), "fuzz%llu.stim",
+             (unsigned long long) si->cfg.fuzzSeed);
+    simFile(si, name, file, sizeof(file));
+    snprintf(comment, sizeof(comment), "%d of %d events of fuzz seed %llu"
+             ", chip %d", left, si->stim->numEvents,
+             (unsigned long long) si->cfg.fuzzSeed, si->cfg.chip);
+    if (stim_write(file, comment, events, left) == 0)
+       printf ("%sseed %llu still fails with %d of %d events (%d runs), "
+               "run %s with -e and the same options\n", si->prefix,
+               (unsigned long long) si->cfg.fuzzSeed, left,
+               si->stim->numEvents, runs, file);
+    free(events);
+}
+
+static void jobWorker(struct job_pool* pool) {
+    int n;
+    while ((n = pool->next++) < pool->numJobs) {
+       char prefix[16];
+       snprintf(prefix, sizeof(prefix), "job%d.", n);
+       uint64_t start = nowMs();
+       struct sim_instance* si = sim_open(&pool->configs[n], prefix);
+       if (si) {
+          sim_run(si);
+          pool->status[n] = sim_finish(si);
+          if (si->failed && si->cfg.fuzzSeeds)
+             minimizeFuzz(si);
+          freeSim(si);
+       } else {
+          pool->status[n] = -1;
+       }
+       pool->ms[n] = nowMs() - start;
+       if (pool->configs[n].fuzzSeeds)
+          printf ("seed %llu: ", (unsigned long long)
+                  pool->configs[n].fuzzSeed);
+       else
+          printf ("job %d: ", n);
+       printf ("%s (exit %d, %.1fs)\n",
+               pool->status[n] ? "fail" : "pass",
+               pool->status[n], pool->ms[n] / 1000.0);
+       fflush(stdout);
+    }
+}
+
+// Runs the pool's jobs on up to threads threads (0 for one per cpu).
+// Frees the pool. Returns the process exit status.
+static int runPool(struct job_pool* pool, int threads) {
+    if (threads <= 0)
+       threads = std::thread::hardware_concurrency();
+#if VERILATOR_VERSION_INTEGER < 4210000
+    // Models share Verilator's one global context
+    if (threads > 1) {
+       LOG(LOG_WARN, "this Verilator can only run one job at a time");
+       threads = 1;
+    }
+#endif
+    if (threads > pool->numJobs)
+       threads = pool->numJobs;
+    printf ("Running %d jobs on %d threads\n", pool->numJobs, threads);
+
+    pool->next = 0;
+    pool->status = (int*) calloc(pool->numJobs, sizeof(int));
+    pool->ms = (uint64_t*) calloc(pool->numJobs, sizeof(uint64_t));
+    uint64_t start = nowMs();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++)
+       workers.push_back(std::thread(jobWorker, pool));
+    for (int i = 0; i < threads; i++)
+       workers[i].join();
+
+    int passed = 0;
+    for (int i = 0; i < pool->numJobs; i++)
+       if (pool->status[i] == 0)
+          passed++;
+    printf ("%d of %d jobs passed in %.1fs\n", passed, pool->numJobs,
+            (nowMs() - start) / 1000.0);
+
+    free(pool->status);
+    free(pool->ms);
+    free(pool->configs);
+    return passed == pool->numJobs ? 0 : 1;
+}
+
+// Runs every line of cfg->jobsFile as its own simulation, on up to
+// cfg->jobThreads threads. Each line holds options like the command
+// line's and adds to them. Returns the process exit status.
+static int runJobs(const struct sim_config* cfg) {
+    // Every job would write the same file at once
+    if (cfg->outFile || cfg->recordFile) {
+       LOG(LOG_ERROR, "-o and -R go on the job lines, not with -J");
+       return 1;
+    }
+
+    FILE* fp = fopen(cfg->jobsFile, "r");
+    if (!fp) {
+       LOG(LOG_ERROR, "can't open %s", cfg->jobsFile);
+       return 1;
+    }
+
+    struct job_pool pool;
+    pool.numJobs = 0;
+    pool.configs = nullptr;
+    int capacity = 0;
+    char line[1024];
+    int lineNum = 0;
+    int rc = 0;
+    while (!rc && fgets(line, sizeof(line), fp)) {
+       lineNum++;
+       // optarg points into the line so it has to stay around
+       char* args = strdup(line);
+       char* argv[MAX_JOB_ARGS + 1];
+       int argc = 0;
+       argv[argc++] = (char*) "vicsim";
+       for (char* tok = strtok(args, " \t\r\n"); tok;
+               tok = strtok(NULL, " \t\r\n")) {
+          if (tok[0] == '#')
+             break;
+          if (argc == MAX_JOB_ARGS) {
+             LOG(LOG_ERROR, "%s:%d: too many options", cfg->jobsFile,
+                 lineNum);
+             rc = 1;
+             break;
+          }
+          argv[argc++] = tok;
+       }
+       argv[argc] = nullptr;
+       if (rc || argc == 1) {
+          free(args);
+          continue;
+       }
+
+       if (pool.numJobs == capacity) {
+          capacity = capacity ? capacity * 2 : 16;
+          pool.configs = (struct sim_config*)
+             realloc(pool.configs, capacity * sizeof(struct sim_config));
+       }
+       struct sim_config* job = &pool.configs[pool.numJobs];
+       *job = *cfg;
+       job->jobsFile = nullptr;
+       if (parseArgs(argc, argv, job)) {
+          LOG(LOG_ERROR, "%s:%d: bad options", cfg->jobsFile, lineNum);
+          rc = 1;
+       } else if (job->showWindow || job->cycleByCycle || job->jobsFile ||
+                  job->fuzzSeeds > 1 || job->logLevel != cfg->logLevel) {
+          LOG(LOG_ERROR, "%s:%d: -w, -b, -J, -l and more than one --fuzz "
+              "seed can't be used in a job", cfg->jobsFile, lineNum);
+          rc = 1;
+       } else {
+          pool.numJobs++;
+       }
+    }
+    fclose(fp);
+    if (rc) {
+       free(pool.configs);
+       return rc;
+    }
+    return runPool(&pool, cfg->jobThreads);
+}
+
+// --fuzz: a job per seed
+static int runFuzz(const struct sim_config* cfg) {
+    struct job_pool pool;
+    pool.numJobs = cfg->fuzzSeeds;
+    pool.configs = (struct sim_config*)
+       calloc(pool.numJobs, sizeof(struct sim_config));
+    for (int i = 0; i < pool.numJobs; i++) {
+       pool.configs[i] = *cfg;
+       pool.configs[i].fuzzSeed = cfg->fuzzSeed + i;
+       pool.configs[i].fuzzSeeds = 1;
+    }
+    return runPool(&pool, cfg->jobThreads);
+}
+
+int main(int argc, char** argv, char** env) {
+    SDL_Event event;
+    SDL_Window* win = nullptr;
+    struct sim_config cfg;
+
+    defaultConfig(&cfg);
+    if (parseArgs(argc, argv, &cfg))
+       return 1;
+    logLevel = cfg.logLevel;
+
+    printf ("Log Level: %d\n", logLevel);
+#ifdef GEN_RGB
+    printf ("Color: Using RGB/Sync output values\n");
+#else
+#ifdef NEED_RGB
+    printf ("Color: Using internal RGB/Sync values\n");
+#else
+#ifdef GEN_LUMA_CHROMA
+    printf ("Color: Using composite palette/sync\n");
+#else
+    printf ("Color: No color information available\n");
+#endif
+#endif
+#endif
+
+    if (cfg.jobsFile)
+       return runJobs(&cfg);
+    if (cfg.fuzzSeeds) {
+       if (cfg.showWindow || cfg.cycleByCycle) {
+          LOG(LOG_ERROR, "-w and -b can't be used with --fuzz");
+          return 1;
+       }
+       return runFuzz(&cfg);
+    }
+
+    if (cfg.showWindow || cfg.cycleByCycle) {
+      int sdl_init_mode = SDL_INIT_VIDEO;
+      if (SDL_Init(sdl_init_mode) != 0) {
+        LOG(LOG_ERROR, "SDL_Init %s", SDL_GetError());
+        return 1;
+      }
+    }
+
+    struct sim_instance* si = sim_open(&cfg, "");
+    if (!si)
+       exit(-1);
+
+    if (si->flightRec) {
+       signalSim = si;
+       signal(SIGINT, flightRecSignal);
+       signal(SIGTERM, flightRecSignal);
+       signal(SIGSEGV, flightRecSignal);
+       signal(SIGABRT, flightRecSignal);
+    }
+
+    if (cfg.showWindow) {
+      win = SDL_CreateWindow("VICII",
+                             SDL_WINDOWPOS_CENTERED,
+                             SDL_WINDOWPOS_CENTERED,
+                             si->fb->width, si->fb->height,
+                             SDL_WINDOW_SHOWN);
+      if (win == nullptr) {
+        std::cerr << "SDL_CreateWindow Error: " << SDL_GetError() << std::endl;
+        SDL_Quit();
+        return 1;
+      }
+
+      si->ren = SDL_CreateRenderer(
+          win, -1, SDL_RENDERER_ACCELERATED |
+             (cfg.vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
+      if (si->ren == nullptr) {
+        std::cerr << "SDL_CreateRenderer Error: "
+           << SDL_GetError() << std::endl;
+        SDL_DestroyWindow(win);
+        SDL_Quit();
+        return 1;
+      }
+
+      si->tex = SDL_CreateTexture(si->ren, SDL_PIXELFORMAT_ARGB8888,
+                                  SDL_TEXTUREACCESS_STREAMING,
+                                  si->fb->width, si->fb->height);
+      if (si->tex == nullptr) {
+        std::cerr << "SDL_CreateTexture Error: "
+           << SDL_GetError() << std::endl;
+        SDL_DestroyRenderer(si->ren);
+        SDL_DestroyWindow(win);
+        SDL_Quit();
+        return 1;
+      }
+    }
+
+    sim_run(si);
+    int status = sim_finish(si);
+
+    if (cfg.showWindow && status >= 0) {
+       present(si->ren, si->tex, si->fb);
+
+       // Instead of waiting for a key, exit if the capture was requested
+       bool quit = cfg.endCapture;
+       while (!quit && si->keyPressToQuit) {
+          while (SDL_PollEvent(&event)) {
+             switch (event.type) {
+                case SDL_QUIT:
+                case SDL_KEYUP:
+                   quit=true; break;
+                default:
+                   break;
+             }
+           }
+       }
+    }
+    if (cfg.showWindow) {
+       SDL_DestroyTexture(si->tex);
+       SDL_DestroyRenderer(si->ren);
+       SDL_DestroyWindow(win);
+       SDL_Quit();
+    }
+
+    signalSim = nullptr;
+    freeSim(si);
 
     // Fin
-    exit(0);
+    exit(status);
 }
@@ -0,0 +1,447 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stim.h"
+#include "constants.h"
+#include "log.h"
+
+// Events are applied this many ticks into their phase, which is where
+// a VICE step lands (see the sync in sim_main.cpp). The raster line and
+// cycle number are settled by then.
+#define APPLY_TICKS 3
+
+static const char* pinNames[] = { "irq", "ba", "aec" };
+
+// Orders events in time. Lines and cycles are well under these limits.
+static long long eventKey(int frame, int line, int cycle, int phase) {
+   return (((long long) frame * 1024 + line) * 128 + cycle) * 2 +
+      (phase - 1);
+}
+
+long long stim_event_key(const struct stim_event* ev) {
+   return eventKey(ev->frame, ev->line, ev->cycle, ev->phase);
+}
+
+static int parseHex(const char* s, long* v) {
+   char* end;
+   if (*s == '$') s++;
+   *v = strtol(s, &end, 16);
+   return end == s || *end != '\0' || *v < 0;
+}
+
+static int parseNum(const char* s, long* v) {
+   char* end;
+   *v = strtol(s, &end, 0);
+   return end == s || *end != '\0' || *v < 0;
+}
+
+// Parses one script line into ev. Returns 1 on error, -1 if the line
+// has no event.
+static int parseLine(struct stim_event* ev, char* buf,
+                     const char* filename, int srcLine) {
+   char* hash = strchr(buf, '#');
+   if (hash) *hash = '\0';
+
+   char* tok[7];
+   int n = 0;
+   char* save;
+   for (char* t = strtok_r(buf, " \t\r\n", &save); t;
+           t = strtok_r(NULL, " \t\r\n", &save)) {
+      if (n == 7) {
+         LOG(LOG_ERROR, "%s:%d: too many fields", filename, srcLine);
+         return 1;
+      }
+      tok[n++] = t;
+   }
+   if (n == 0)
+      return -1;
+   if (n < 6) {
+      LOG(LOG_ERROR, "%s:%d: expected frame line cycle phase event",
+          filename, srcLine);
+      return 1;
+   }
+
+   long frame, line, cycle, phase;
+   if (parseNum(tok[0], &frame) || parseNum(tok[1], &line) ||
+          parseNum(tok[2], &cycle) || parseNum(tok[3], &phase) ||
+          line >= 1024 || cycle >= 128 || (phase != 1 && phase != 2)) {
+      LOG(LOG_ERROR, "%s:%d: bad position", filename, srcLine);
+      return 1;
+   }
+   ev->frame = frame;
+   ev->line = line;
+   ev->cycle = cycle;
+   ev->phase = phase;
+   ev->srcLine = srcLine;
+   ev->mask = 0xff;
+
+   long v;
+   if (strcmp(tok[4], "w") == 0 || strcmp(tok[4], "r") == 0) {
+      ev->type = tok[4][0] == 'w' ? STIM_WRITE : STIM_READ;
+      if (n != 7) {
+         LOG(LOG_ERROR, "%s:%d: expected %s register value", filename,
+             srcLine, tok[4]);
+         return 1;
+      }
+      if (phase != 2) {
+         LOG(LOG_ERROR, "%s:%d: register accesses need phase 2",
+             filename, srcLine);
+         return 1;
+      }
+      if (parseHex(tok[5], &v) || v > 0xffff) {
+         LOG(LOG_ERROR, "%s:%d: bad register '%s'", filename, srcLine,
+             tok[5]);
+         return 1;
+      }
+      // Registers are mirrored every 64 bytes
+      ev->reg = v & 0x3f;
+
+      char* slash = strchr(tok[6], '/');
+      if (slash) {
+         if (ev->type == STIM_WRITE || parseHex(slash + 1, &v) ||
+                v > 0xff) {
+            LOG(LOG_ERROR, "%s:%d: bad mask '%s'", filename, srcLine,
+                slash + 1);
+            return 1;
+         }
+         ev->mask = v;
+         *slash = '\0';
+      }
+      if (parseHex(tok[6], &v) || v > 0xff) {
+         LOG(LOG_ERROR, "%s:%d: bad value '%s'", filename, srcLine,
+             tok[6]);
+         return 1;
+      }
+      ev->value = v;
+      return 0;
+   }
+
+   if (n != 6) {
+      LOG(LOG_ERROR, "%s:%d: too many fields", filename, srcLine);
+      return 1;
+   }
+   if (strcmp(tok[4], "lp") == 0) {
+      ev->type = STIM_LP;
+      ev->reg = 0;
+   } else {
+      ev->type = STIM_PIN;
+      ev->reg = -1;
+      for (int i = 0; i < 3; i++) {
+         if (strcmp(tok[4], pinNames[i]) == 0)
+            ev->reg = i;
+      }
+      if (ev->reg < 0) {
+         LOG(LOG_ERROR, "%s:%d: unknown event '%s'", filename, srcLine,
+             tok[4]);
+         return 1;
+      }
+   }
+   if (parseNum(tok[5], &v) || v > 1) {
+      LOG(LOG_ERROR, "%s:%d: expected 0 or 1", filename, srcLine);
+      return 1;
+   }
+   ev->value = v;
+   return 0;
+}
+
+struct stim_script* stim_open(const char* filename) {
+   FILE* fp = fopen(filename, "r");
+   if (!fp) {
+      LOG(LOG_ERROR, "can't open %s", filename);
+      return NULL;
+   }
+
+   struct stim_script* ss =
+      (struct stim_script*) calloc(1, sizeof(struct stim_script));
+   ss->filename = filename;
+
+   int size = 0;
+   int srcLine = 0;
+   long long prevKey = -1;
+   int prevAccess = -1;  // srcLine of the last register access
+   long long prevAccessKey = -1;
+   char buf[256];
+   while (fgets(buf, sizeof(buf), fp)) {
+      srcLine++;
+      struct stim_event ev;
+      int r = parseLine(&ev, buf, filename, srcLine);
+      if (r < 0)
+         continue;
+      if (r) {
+         fclose(fp);
+         stim_free(ss);
+         return NULL;
+      }
+
+      long long key = eventKey(ev.frame, ev.line, ev.cycle, ev.phase);
+      if (key < prevKey) {
+         LOG(LOG_ERROR, "%s:%d: event is earlier than the one before it",
+             filename, srcLine);
+         fclose(fp);
+         stim_free(ss);
+         return NULL;
+      }
+      prevKey = key;
+      if (ev.type == STIM_WRITE || ev.type == STIM_READ) {
+         if (key == prevAccessKey) {
+            LOG(LOG_ERROR, "%s:%d: line %d already accesses a register "
+                "in this cycle", filename, srcLine, prevAccess);
+            fclose(fp);
+            stim_free(ss);
+            return NULL;
+         }
+         prevAccess = srcLine;
+         prevAccessKey = key;
+      }
+
+      if (ss->numEvents == size) {
+         size = size ? size * 2 : 64;
+         ss->events = (struct stim_event*)
+            realloc(ss->events, size * sizeof(struct stim_event));
+      }
+      ss->events[ss->numEvents++] = ev;
+   }
+   fclose(fp);
+
+   if (ss->numEvents == 0) {
+      LOG(LOG_ERROR, "%s has no events", filename);
+      stim_free(ss);
+      return NULL;
+   }
+
+   // What we drive until the script says otherwise
+   ss->out.ce = 1;
+   ss->out.rw = 1;
+   ss->out.lp = 1;
+   return ss;
+}
+
+struct stim_script* stim_from_events(const char* name,
+                                     const struct stim_event* events,
+                                     int numEvents) {
+   struct stim_script* ss =
+      (struct stim_script*) calloc(1, sizeof(struct stim_script));
+   snprintf(ss->name, sizeof(ss->name), "%s", name);
+   ss->filename = ss->name;
+   ss->events = (struct stim_event*)
+      malloc((numEvents ? numEvents : 1) * sizeof(struct stim_event));
+   memcpy(ss->events, events, numEvents * sizeof(struct stim_event));
+   ss->numEvents = numEvents;
+   ss->out.ce = 1;
+   ss->out.rw = 1;
+   ss->out.lp = 1;
+   return ss;
+}
+
+int stim_write(const char* filename, const char* comment,
+               const struct stim_event* events, int numEvents) {
+   FILE* fp = fopen(filename, "w");
+   if (!fp) {
+      LOG(LOG_ERROR, "can't write %s", filename);
+      return 1;
+   }
+   fprintf(fp, "# %s\n", comment);
+   fprintf(fp, "# frame line cycle phase event\n");
+   for (int i = 0; i < numEvents; i++) {
+      const struct stim_event* ev = &events[i];
+      fprintf(fp, "%d 0x%03x %d %d  ", ev->frame, ev->line, ev->cycle,
+              ev->phase);
+      switch (ev->type) {
+         case STIM_WRITE:
+            fprintf(fp, "w d0%02x %02x\n", ev->reg, ev->value);
+            break;
+         case STIM_READ:
+            fprintf(fp, "r d0%02x %02x/%02x\n", ev->reg, ev->value,
+                    ev->mask);
+            break;
+         case STIM_LP:
+            fprintf(fp, "lp %d\n", ev->value);
+            break;
+         default:
+            fprintf(fp, "%s %d\n", pinNames[ev->reg], ev->value);
+            break;
+      }
+   }
+   if (fclose(fp)) {
+      LOG(LOG_ERROR, "can't write %s", filename);
+      return 1;
+   }
+   return 0;
+}
+
+void stim_free(struct stim_script* ss) {
+   free(ss->events);
+   free(ss);
+}
+
+int stim_remaining(struct stim_script* ss) {
+   return ss->numEvents - ss->phaseFirst;
+}
+
+// Checks an expectation against the last tick of its phase. Returns 1
+// and fills in ss->error if it doesn't hold.
+static int check(struct stim_script* ss, struct stim_event* ev) {
+   const struct stim_pins* p = &ss->last;
+   int actual;
+   switch (ev->type) {
+      case STIM_READ:
+         if ((p->dbo & ev->mask) == (ev->value & ev->mask))
+            return 0;
+         snprintf(ss->error, sizeof(ss->error),
+            "%s:%d: read of d0%02x expected %02x/%02x got %02x",
+            ss->filename, ev->srcLine, ev->reg, ev->value, ev->mask,
+            p->dbo);
+         return 1;
+      case STIM_PIN:
+         actual = ev->reg == STIM_PIN_IRQ ? p->irq :
+                  ev->reg == STIM_PIN_BA ? p->ba : p->aec;
+         if (actual == ev->value)
+            return 0;
+         snprintf(ss->error, sizeof(ss->error),
+            "%s:%d: %s expected %d got %d", ss->filename, ev->srcLine,
+            pinNames[ev->reg], ev->value, actual);
+         return 1;
+      default:
+         return 0;
+   }
+}
+
+int stim_tick(struct stim_script* ss, struct stim_pins* pins) {
+   int flags = 0;
+
+   if (!ss->started) {
+      ss->started = true;
+      ss->prevLine = pins->line;
+      ss->phi = pins->phi;
+      ss->last = *pins;
+      // Make sure the model starts with ours
+      flags |= STIM_CHANGED;
+   }
+
+   if (pins->line < ss->prevLine)
+      ss->frame++;
+   ss->prevLine = pins->line;
+
+   if (pins->phi != ss->phi) {
+      // The phase that just ended has its expectations checked
+      for (int i = ss->phaseFirst; i < ss->next; i++) {
+         if (check(ss, &ss->events[i])) {
+            ss->phaseFirst = i;
+            flags |= STIM_FAILED;
+            break;
+         }
+      }
+      if (flags & STIM_FAILED)
+         goto out;
+      ss->phaseFirst = ss->next;
+      ss->phi = pins->phi;
+      ss->ticksIntoPhase = 0;
+   } else {
+      ss->ticksIntoPhase++;
+   }
+
+   if (ss->busy && !pins->phi && ss->ticksIntoPhase == BUS_RELEASE_TICKS) {
+      ss->out.ce = 1;
+      ss->out.rw = 1;
+      ss->busy = false;
+      flags |= STIM_CHANGED;
+   }
+
+   // A 6510 keeps writing for three cycles after ba goes low and is
+   // off the bus from then on. Counted when phi rises.
+   if (ss->cpuTiming && pins->phi && ss->ticksIntoPhase == 0)
+      ss->baCycles = pins->ba ? 0 : ss->baCycles + 1;
+
+   if (ss->next < ss->numEvents && ss->ticksIntoPhase == APPLY_TICKS) {
+      int phase = pins->phi ? 2 : 1;
+      struct stim_event* ev = &ss->events[ss->next];
+
+      // Events are only looked for once per phase, so one whose line
+      // has gone by never happened (a cycle the line doesn't have).
+      if (!ss->cpuTiming && eventKey(ss->frame, pins->line, 0, 1) >
+             eventKey(ev->frame, ev->line, 0, 1)) {
+         snprintf(ss->error, sizeof(ss->error),
+            "%s:%d: frame %d line %03x cycle %d phase %d never happened",
+            ss->filename, ev->srcLine, ev->frame, ev->line, ev->cycle,
+            ev->phase);
+         ss->phaseFirst = ss->next;
+         flags |= STIM_FAILED;
+         goto out;
+      }
+
+      const long long now = eventKey(ss->frame, pins->line, pins->cycle,
+                                     phase);
+      // ba is sampled early in the cycle, so stop one cycle sooner to
+      // be sure aec isn't already low
+      const bool onBus = phase == 2 && pins->aec && ss->baCycles < 3;
+      bool accessed = false;
+      while (ss->next < ss->numEvents) {
+         ev = &ss->events[ss->next];
+         if (ss->cpuTiming) {
+            if (stim_event_key(ev) > now)
+               break;
+            if (ev->type == STIM_WRITE || ev->type == STIM_READ) {
+               if (!onBus || accessed)
+                  break;
+               accessed = true;
+            }
+            ev->frame = ss->frame;
+            ev->line = pins->line;
+            ev->cycle = pins->cycle;
+            ev->phase = phase;
+         } else if (ev->frame != ss->frame || ev->line != pins->line ||
+                ev->cycle != pins->cycle || ev->phase != phase) {
+            break;
+         }
+         switch (ev->type) {
+            case STIM_WRITE:
+            case STIM_READ:
+               ss->out.adl = ev->reg;
+               ss->out.dbl = ev->value;
+               ss->out.ce = 0;
+               ss->out.rw = ev->type == STIM_READ;
+               ss->busy = true;
+               flags |= STIM_CHANGED;
+               break;
+            case STIM_LP:
+               ss->out.lp = ev->value;
+               flags |= STIM_CHANGED;
+               break;
+            default:
+               break;
+         }
+         ss->next++;
+      }
+   }
+
+   if (!ss->done && ss->phaseFirst == ss->numEvents && !ss->busy) {
+      ss->done = true;
+      flags |= STIM_DONE;
+   }
+
+out:
+   ss->last = *pins;
+   pins->adl = ss->out.adl;
+   pins->dbl = ss->out.dbl;
+   pins->ce = ss->out.ce;
+   pins->rw = ss->out.rw;
+   pins->lp = ss->out.lp;
+   return flags;
+}
@@ -0,0 +1,140 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef VICII_STIM_H
+#define VICII_STIM_H
+
+#include <stdint.h>
+
+// Bus stimulus scripts: register accesses, light pen changes and pin
+// checks at exact points of the frame, without a CPU program.
+//
+// One event per line, # starts a comment:
+//
+//    frame line cycle phase  event
+//
+//    0 0x30 14 2  w d011 1b       write $1b to $d011
+//    0 0x30 16 2  r d012 30       read $d012, expect $30
+//    0 0x30 16 2  r d019 81/8f    only compare the bits in $8f
+//    1 0x40 20 1  lp 0            drive lp low from here on
+//    1 0x40 30 2  irq 1           expect irq (ba, aec) to be 1
+//
+// frame counts from the start of the run (first is 0), line and cycle
+// are the model's raster line and cycle number and take C syntax.
+// Phase 1 is phi low, 2 is phi high. Register numbers and values are
+// hex. Reads and writes are CPU cycles so they need phase 2, and they
+// are driven on ce/rw/adl/dbl the way VICE does it. Expectations are
+// checked against the last tick of their phase. Events must be in time
+// order.
+//
+// Scripts can also be built in memory (see fuzz.h). Those can ask for
+// cpuTiming: an event is due from its cycle on instead of exactly then,
+// and register accesses wait while a 6510 would be off the bus. Each
+// event's position is moved to where it actually happened, so
+// stim_write() saves a script that does the same without cpuTiming.
+
+#define STIM_WRITE 0
+#define STIM_READ  1
+#define STIM_LP    2
+#define STIM_PIN   3
+
+#define STIM_PIN_IRQ 0
+#define STIM_PIN_BA  1
+#define STIM_PIN_AEC 2
+
+// Returned by stim_tick()
+#define STIM_CHANGED 1  // an input changed
+#define STIM_FAILED  2  // an expectation failed, see error
+#define STIM_DONE    4  // the last event has been checked
+
+struct stim_event {
+   int frame;
+   int line;
+   int cycle;
+   int phase;
+   int type;
+   int reg;     // or the pin for STIM_PIN
+   uint8_t value;
+   uint8_t mask;
+   int srcLine;
+};
+
+struct stim_pins {
+   // From the model
+   int line;
+   int cycle;
+   bool phi;
+   bool irq;
+   bool ba;
+   bool aec;
+   uint8_t dbo;
+
+   // To the model
+   uint8_t adl;
+   uint8_t dbl;
+   bool ce;
+   bool rw;
+   bool lp;
+};
+
+struct stim_script {
+   const char* filename;
+   char name[32];  // filename for scripts built in memory
+   struct stim_event* events;
+   int numEvents;
+   int next;
+   int phaseFirst;  // first event fired in the phase that is running
+
+   int frame;
+   int prevLine;
+   bool started;
+   bool phi;
+   int ticksIntoPhase;  // ticks since phi last changed
+   bool busy;       // ce is held low
+   bool cpuTiming;
+   int baCycles;    // cycles ba has been low, with cpuTiming
+   bool done;
+   struct stim_pins last;  // the model's outputs on the previous tick
+   struct stim_pins out;
+   char error[192];
+};
+
+// Returns NULL on error
+struct stim_script* stim_open(const char* filename);
+
+// A script of events that are already in time order (copied)
+struct stim_script* stim_from_events(const char* name,
+                                     const struct stim_event* events,
+                                     int numEvents);
+
+// Writes events out in the format stim_open() reads. Returns 1 on
+// error.
+int stim_write(const char* filename, const char* comment,
+               const struct stim_event* events, int numEvents);
+
+// Orders events in time
+long long stim_event_key(const struct stim_event* ev);
+
+// Called once per tick with the model's outputs filled in. Fills in
+// its inputs and returns STIM_* flags.
+int stim_tick(struct stim_script* ss, struct stim_pins* pins);
+
+// Events that have not been applied and checked yet
+int stim_remaining(struct stim_script* ss);
+
+void stim_free(struct stim_script* ss);
+
+#endif
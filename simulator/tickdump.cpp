@@ -0,0 +1,113 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+// Decodes a binary tick recording made with vicsim -R into the same
+// text columns the simulator prints at log level 4.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tickrec.h"
+#include "log.h"
+
+// Parse "n" or "first:last" into a range
+static void parseRange(const char* arg, long* first, long* last) {
+   const char* colon = strchr(arg, ':');
+   *first = strtol(arg, NULL, 0);
+   *last = colon ? strtol(colon + 1, NULL, 0) : *first;
+}
+
+int main(int argc, char* argv[]) {
+   long firstLine = 0, lastLine = -1;
+   long firstCycle = 0, lastCycle = -1;
+   long firstRec = 0, lastRec = -1;
+   int c;
+
+   while ((c = getopt(argc, argv, "l:c:r:h")) != -1)
+   switch (c) {
+      case 'l':
+         parseRange(optarg, &firstLine, &lastLine);
+         break;
+      case 'c':
+         parseRange(optarg, &firstCycle, &lastCycle);
+         break;
+      case 'r':
+         parseRange(optarg, &firstRec, &lastRec);
+         break;
+      case 'h':
+      default:
+         printf ("Usage: tickdump [options] <file>\n");
+         printf ("  -l <line>[:<line>]   : only these raster lines\n");
+         printf ("  -c <cyc>[:<cyc>]     : only these cycle numbers\n");
+         printf ("  -r <n>[:<n>]         : only these record numbers\n");
+         exit(c == 'h' ? 0 : -1);
+   }
+
+   if (optind >= argc) {
+      fprintf(stderr, "tickdump: no file given\n");
+      exit(-1);
+   }
+
+   FILE* fp = fopen(argv[optind], "rb");
+   if (!fp) {
+      perror(argv[optind]);
+      exit(-1);
+   }
+
+   struct tickrec_header hdr;
+   if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+          memcmp(hdr.magic, TICKREC_MAGIC, 4) != 0) {
+      fprintf(stderr, "tickdump: %s is not a tick recording\n", argv[optind]);
+      exit(-1);
+   }
+   if (hdr.version != TICKREC_VERSION ||
+          hdr.recordSize != sizeof(struct tick_record)) {
+      fprintf(stderr, "tickdump: unsupported version %u (record size %u)\n",
+              hdr.version, hdr.recordSize);
+      exit(-1);
+   }
+
+   printf ("CHIP: %u\n", hdr.chip);
+
+   static struct tick_record buf[TICKREC_BUFSIZE];
+   long recNum = 0;
+   size_t n;
+   while ((n = fread(buf, sizeof(struct tick_record),
+                     TICKREC_BUFSIZE, fp)) > 0) {
+      for (size_t i = 0; i < n; i++, recNum++) {
+         struct tick_record* r = &buf[i];
+         if (recNum < firstRec || (lastRec >= 0 && recNum > lastRec))
+            continue;
+         if (r->raster_line < firstLine ||
+                (lastLine >= 0 && r->raster_line > lastLine))
+            continue;
+         if (r->cycle_num < firstCycle ||
+                (lastCycle >= 0 && r->cycle_num > lastCycle))
+            continue;
+
+         if (r->flags & TR_DOTEDGE)
+            tickrec_print_header(stdout);
+         tickrec_print(stdout, r);
+      }
+      if (lastRec >= 0 && recNum > lastRec)
+         break;
+   }
+
+   fclose(fp);
+   return 0;
+}
@@ -0,0 +1,192 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tickrec.h"
+#include "constants.h"
+#include "log.h"
+
+static_assert(sizeof(struct tick_record) == 40, "tick_record must be packed");
+
+char cycleToChar(int cycle){
+  switch (cycle) {
+    case VIC_LP   : return '#';
+    case VIC_LPI2 : return 'i';
+    case VIC_LS2  : return 's';
+    case VIC_LR   : return 'r';
+    case VIC_LG   : return 'g';
+    case VIC_HS1  : return 'S';
+    case VIC_HPI1 : return 'I';
+    case VIC_HPI3 : return 'I';
+    case VIC_HS3  : return 'S';
+    case VIC_HRI  : return 'I';
+    case VIC_HRC  : return 'C';
+    case VIC_HGC  : return 'C';
+    case VIC_HGI  : return 'I';
+    case VIC_HI   : return 'I';
+    case VIC_LI   : return 'i';
+    case VIC_HRX  : return 'x';
+    default:
+       LOG(LOG_ERROR,"bad cycle");
+       exit(-1);
+  }
+}
+
+struct tickrec* tickrec_open(const char* filename, int chip) {
+   FILE* fp = fopen(filename, "wb");
+   if (!fp) {
+      LOG(LOG_ERROR, "can't open %s for writing", filename);
+      return NULL;
+   }
+
+   struct tickrec_header hdr;
+   memcpy(hdr.magic, TICKREC_MAGIC, 4);
+   hdr.version = TICKREC_VERSION;
+   hdr.recordSize = sizeof(struct tick_record);
+   hdr.chip = chip;
+   fwrite(&hdr, sizeof(hdr), 1, fp);
+
+   struct tickrec* tr = (struct tickrec*) malloc(sizeof(struct tickrec));
+   tr->fp = fp;
+   tr->n = 0;
+   tr->count = 0;
+   return tr;
+}
+
+void tickrec_flush(struct tickrec* tr) {
+   if (tr->n > 0) {
+      fwrite(tr->buf, sizeof(struct tick_record), tr->n, tr->fp);
+      tr->n = 0;
+   }
+}
+
+void tickrec_close(struct tickrec* tr) {
+   tickrec_flush(tr);
+   fclose(tr->fp);
+   free(tr);
+}
+
+void tickrec_print_header(FILE* fp) {
+   fprintf(fp,
+   "  "
+   "D4X "
+   "CNT "
+   "POS "
+   "CYC "
+   "DOTR "
+   "PHI "
+   "BIT "
+   "IRQ "
+   "BA "
+   "AEC "
+   "VCY "
+   "RAS "
+   "CAS "
+   " X  "
+   " Y  "
+   " Y  "
+   "ADI  "
+   "ADO  "
+   "DBI "
+   "DBO "
+   "RW "
+   "CE "
+   "RFC "
+   "BIN\n"
+  );
+}
+
+#define FLAG(bit) (r->flags & (bit) ? 1 : 0)
+
+void tickrec_print(FILE* fp, const struct tick_record* r) {
+   fprintf(fp,
+   "%c "      /*DOT*/
+   "%01d   "   /*D4x*/
+   "%02d  "   /*CNT*/
+   "%03x "   /*POS*/
+   " %02d "  /*CYC*/
+   " %01d  "   /*DOTR*/
+   " %01d  "   /*PHI*/
+   " %01d  "   /*BIT*/
+   " %01d  "   /*IRQ*/
+   " %01d  "   /*BA */
+   " %01d  "   /*AEC*/
+   "%c  "     /*VCY*/
+   " %01d  "   /*RAS*/
+   " %01d  "   /*CAS*/
+   "%03d "   /*  X*/
+   "%03d "   /*  Y*/
+   "%03d "   /*  Y*/
+   "%04x "   /*ADI*/
+   "%04x "   /*ADO*/
+   " %02x "   /*DBI*/
+   " %02x "   /*DBO*/
+   " %01d "   /* RW*/
+   " %01d "   /* CE*/
+   "%02x "   /*RFC*/
+   " %s"     /*BIN*/
+   " %s"     /*BIN*/
+   " %s"     /*BIN*/
+   " %d"     /*badline*/
+
+   " %03d"
+   " %03d"
+   " %01d"
+   " %04x"
+   " %01d"
+   "\n",
+
+   FLAG(TR_RST) ? 'R' : FLAG(TR_DOTEDGE) ? '*' : ' ',
+   FLAG(TR_DOT4X),
+   r->cnt,
+   r->xpos,
+   r->cycle_num,
+   FLAG(TR_DOTR),
+   FLAG(TR_PHI),
+   r->cycle_bit,
+   FLAG(TR_IRQ),
+   FLAG(TR_BA),
+   FLAG(TR_AEC),
+   cycleToChar(r->cycle_type),
+   FLAG(TR_RAS),
+   FLAG(TR_CAS),
+   r->raster_x,
+   r->raster_line,
+   r->raster_line_d,
+   r->adl,
+   r->ado,
+   r->dbi,
+   r->dbo,
+   FLAG(TR_RW),
+   FLAG(TR_CE),
+   r->refc,
+
+   toBin(16, r->pps),
+   toBin(32, r->phir),
+   " ",
+
+   FLAG(TR_BADLINE),
+
+   r->sprite_mc0,
+   r->sprite_mcbase0,
+   r->rc,
+   r->vicaddr,
+   FLAG(TR_BMM)
+   );
+}
@@ -0,0 +1,108 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef VICII_TICKREC_H
+#define VICII_TICKREC_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Binary per-tick state recorder. Holds the same fields STATE() logs
+// but as fixed width records written through a big buffer, so verbose
+// runs don't spend all their time in printf. Use tickdump to turn a
+// recording back into the familiar text columns.
+
+#define TICKREC_MAGIC "KWTR"
+#define TICKREC_VERSION 1
+
+// Flag bits
+#define TR_RST     0x0001
+#define TR_DOT4X   0x0002
+#define TR_DOTEDGE 0x0004  // dot clock just rose (STATE's '*' marker)
+#define TR_DOTR    0x0008
+#define TR_PHI     0x0010
+#define TR_IRQ     0x0020
+#define TR_BA      0x0040
+#define TR_AEC     0x0080
+#define TR_RAS     0x0100
+#define TR_CAS     0x0200
+#define TR_RW      0x0400
+#define TR_CE      0x0800
+#define TR_BADLINE 0x1000
+#define TR_BMM     0x2000
+
+struct tickrec_header {
+   char magic[4];
+   uint32_t version;
+   uint32_t recordSize;
+   uint32_t chip;
+};
+
+struct tick_record {
+   uint64_t ticks;
+   uint32_t phir;
+   uint16_t xpos;
+   uint16_t raster_x;
+   uint16_t raster_line;
+   uint16_t raster_line_d;
+   uint16_t ado;
+   uint16_t vicaddr;
+   uint16_t pps;
+   uint16_t flags;
+   uint8_t cnt;
+   uint8_t cycle_num;
+   uint8_t cycle_bit;
+   uint8_t cycle_type;
+   uint8_t adl;
+   uint8_t dbi;
+   uint8_t dbo;
+   uint8_t refc;
+   uint8_t rc;
+   uint8_t sprite_mc0;
+   uint8_t sprite_mcbase0;
+   uint8_t pad;
+};
+
+#define TICKREC_BUFSIZE 65536
+
+struct tickrec {
+   FILE* fp;
+   int n;
+   uint64_t count;
+   struct tick_record buf[TICKREC_BUFSIZE];
+};
+
+// Return NULL on error
+struct tickrec* tickrec_open(const char* filename, int chip);
+
+void tickrec_flush(struct tickrec* tr);
+
+void tickrec_close(struct tickrec* tr);
+
+static inline struct tick_record* tickrec_next(struct tickrec* tr) {
+   if (tr->n == TICKREC_BUFSIZE)
+      tickrec_flush(tr);
+   tr->count++;
+   return &tr->buf[tr->n++];
+}
+
+// Text output, shared by tickdump and STATE()
+void tickrec_print_header(FILE* fp);
+void tickrec_print(FILE* fp, const struct tick_record* r);
+
+char cycleToChar(int cycle);
+
+#endif
@@ -0,0 +1,165 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trigger.h"
+#include "log.h"
+
+void trig_init(struct trigger_set* ts) {
+   ts->numWindows = 0;
+   ts->numOpen = 0;
+   ts->frame = 0;
+   ts->prevLine = 0;
+}
+
+// Parse one 'key=value' condition into the event
+static int parseCond(struct trigger_event* ev, const char* cond) {
+   const char* eq = strchr(cond, '=');
+   if (!eq || eq[1] == '\0') {
+      LOG(LOG_ERROR, "bad trigger condition '%s'", cond);
+      return 1;
+   }
+   int klen = eq - cond;
+   const char* val = eq + 1;
+   char* end;
+   long v;
+
+   if (strncmp(cond, "reg", klen) == 0 && klen == 3) {
+      if (*val == '$') val++;
+      v = strtol(val, &end, 16);
+      // Registers are mirrored every 64 bytes
+      v &= 0x3f;
+   } else {
+      v = strtol(val, &end, 0);
+   }
+   if (*end != '\0' || v < 0) {
+      LOG(LOG_ERROR, "bad trigger value '%s'", cond);
+      return 1;
+   }
+
+   if (klen == 5 && strncmp(cond, "frame", 5) == 0)
+      ev->frame = v;
+   else if (klen == 4 && strncmp(cond, "line", 4) == 0)
+      ev->line = v;
+   else if (klen == 5 && strncmp(cond, "cycle", 5) == 0)
+      ev->cycle = v;
+   else if (klen == 4 && strncmp(cond, "xpos", 4) == 0)
+      ev->xpos = v;
+   else if (klen == 3 && strncmp(cond, "reg", 3) == 0)
+      ev->reg = v;
+   else {
+      LOG(LOG_ERROR, "unknown trigger condition '%s'", cond);
+      return 1;
+   }
+   return 0;
+}
+
+static int parseEvent(struct trigger_event* ev, char* spec) {
+   ev->frame = TRIG_ANY;
+   ev->line = TRIG_ANY;
+   ev->cycle = TRIG_ANY;
+   ev->xpos = TRIG_ANY;
+   ev->reg = TRIG_ANY;
+   ev->matched = false;
+
+   char* save;
+   for (char* cond = strtok_r(spec, ",", &save); cond;
+           cond = strtok_r(NULL, ",", &save)) {
+      if (parseCond(ev, cond))
+         return 1;
+   }
+   return 0;
+}
+
+int trig_add(struct trigger_set* ts, const char* spec) {
+   if (ts->numWindows == MAX_TRIGGER_WINDOWS) {
+      LOG(LOG_ERROR, "too many trigger windows");
+      return 1;
+   }
+
+   char buf[128];
+   if (strlen(spec) >= sizeof(buf)) {
+      LOG(LOG_ERROR, "trigger spec too long");
+      return 1;
+   }
+   strcpy(buf, spec);
+
+   struct trigger_window* w = &ts->windows[ts->numWindows];
+   char* slash = strchr(buf, '/');
+   if (slash) *slash = '\0';
+
+   if (parseEvent(&w->start, buf))
+      return 1;
+   w->hasStop = slash != NULL;
+   if (w->hasStop && parseEvent(&w->stop, slash + 1))
+      return 1;
+
+   w->state = TRIG_WAITING;
+   w->openFrame = 0;
+   ts->numWindows++;
+   return 0;
+}
+
+// True on the tick an event's conditions start holding
+static bool fires(struct trigger_event* ev, int frame, int line,
+                  int cycle, int xpos, int reg) {
+   bool m = (ev->frame == TRIG_ANY || ev->frame == frame) &&
+            (ev->line == TRIG_ANY || ev->line == line) &&
+            (ev->cycle == TRIG_ANY || ev->cycle == cycle) &&
+            (ev->xpos == TRIG_ANY || ev->xpos == xpos) &&
+            (ev->reg == TRIG_ANY || ev->reg == reg);
+   bool rose = m && !ev->matched;
+   ev->matched = m;
+   return rose;
+}
+
+bool trig_update(struct trigger_set* ts, int line, int cycle, int xpos,
+                 int reg) {
+   if (line < ts->prevLine)
+      ts->frame++;
+   ts->prevLine = line;
+
+   for (int i = 0; i < ts->numWindows; i++) {
+      struct trigger_window* w = &ts->windows[i];
+      switch (w->state) {
+         case TRIG_WAITING:
+            if (fires(&w->start, ts->frame, line, cycle, xpos, reg)) {
+               w->state = TRIG_OPEN;
+               w->openFrame = ts->frame;
+               ts->numOpen++;
+               LOG(LOG_INFO, "trace window %d open at frame %d line %03x "
+                   "cycle %d xpos %03x", i, ts->frame, line, cycle, xpos);
+            }
+            break;
+         case TRIG_OPEN:
+            if (w->hasStop ?
+                   fires(&w->stop, ts->frame, line, cycle, xpos, reg) :
+                   ts->frame != w->openFrame) {
+               w->state = TRIG_DONE;
+               ts->numOpen--;
+               LOG(LOG_INFO, "trace window %d closed at frame %d line %03x "
+                   "cycle %d xpos %03x", i, ts->frame, line, cycle, xpos);
+            }
+            break;
+         default:
+            break;
+      }
+   }
+   return ts->numOpen > 0;
+}
@@ -0,0 +1,80 @@
+// This file is part of the vicii-kawari distribution
+// (https://github.com/randyrossi/vicii-kawari)
+// Copyright (c) 2022 Randy Rossi.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, version 3.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef VICII_TRIGGER_H
+#define VICII_TRIGGER_H
+
+// Trace windows opened and closed by events in the simulation rather
+// than by wall time.
+//
+// A window spec is START[/STOP] where each event is a comma separated
+// list of conditions that must all hold:
+//
+//    frame=N    N-th frame since the simulation started (first is 0)
+//    line=N     raster line
+//    cycle=N    cycle number
+//    xpos=N     xpos
+//    reg=d0XX   CPU write to a register (hex, $ or 0x prefix optional)
+//
+// Numbers other than reg take C syntax (0x30 or 48). An event fires on
+// the tick its conditions become true. Without a STOP the window closes
+// at the end of the frame it opened in. Each window opens at most once.
+
+#define MAX_TRIGGER_WINDOWS 16
+
+#define TRIG_ANY -1
+
+struct trigger_event {
+   int frame;
+   int line;
+   int cycle;
+   int xpos;
+   int reg;
+   bool matched;      // conditions held on the previous tick
+};
+
+#define TRIG_WAITING 0
+#define TRIG_OPEN    1
+#define TRIG_DONE    2
+
+struct trigger_window {
+   struct trigger_event start;
+   struct trigger_event stop;
+   bool hasStop;
+   int state;
+   int openFrame;
+};
+
+struct trigger_set {
+   int numWindows;
+   struct trigger_window windows[MAX_TRIGGER_WINDOWS];
+   int numOpen;
+   int frame;
+   int prevLine;
+};
+
+void trig_init(struct trigger_set* ts);
+
+// Returns 1 on a bad spec
+int trig_add(struct trigger_set* ts, const char* spec);
+
+// Called once per tick. reg is the register the CPU is writing this
+// tick (0-0x3f) or TRIG_ANY if none. Returns true while any window is
+// open.
+bool trig_update(struct trigger_set* ts, int line, int cycle, int xpos,
+                 int reg);
+
+#endif
@@ -20,18 +20,46 @@
 #ifndef __APPLE__
 #include <malloc.h>
 #endif
+#include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/ipc.h>
 #include <sys/sem.h>
 #include <sys/shm.h>
 #include <math.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #include "vicii_ipc.h"
 
 #define MODULE_NAME "ipc"
 
+#define IPC_SYNC_MAGIC 0x4b575331
+
+// Spin this many times (adaptively) before sleeping. Never spin on a
+// single cpu, the other end can't run while we do.
+#define SPIN_MIN 16
+#define SPIN_START 1024
+#define SPIN_MAX 65536
+
+struct ipc_sync {
+  unsigned int magic;
+  unsigned int transport;
+  // One counter per signal, same numbering as the semaphores. Only
+  // one end ever posts to and only one end ever waits on each.
+  unsigned int posted[4];
+  unsigned int waiting[4];
+};
+
+// State buffer, then sync counters, then the batch area
+#define IPC_SHMSIZE (IPC_BUFSIZE + sizeof(struct ipc_sync) + \
+                     sizeof(struct vicii_batch))
+
 static int v(struct vicii_ipc* ipc, int semaphore) {
   ipc->operation[semaphore][0].sem_num = semaphore;
   ipc->operation[semaphore][0].sem_op = 1;
@@ -56,24 +84,111 @@ static int p(struct vicii_ipc* ipc, int semaphore) {
   return 0;
 }
 
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+static int futex_wait(unsigned int* addr, unsigned int val) {
+#ifdef __linux__
+  if (syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0) != 0 &&
+         errno != EAGAIN && errno != EINTR) {
+    fprintf(stderr, "%s: futex wait failed\n", MODULE_NAME);
+    perror("REASON");
+    return 1;
+  }
+#else
+  sched_yield();
+#endif
+  return 0;
+}
+
+static void futex_wake(unsigned int* addr) {
+#ifdef __linux__
+  syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+// Shared memory versions of v and p
+static int shm_v(struct vicii_ipc* ipc, int signal) {
+  __atomic_add_fetch(&ipc->sync->posted[signal], 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ipc->sync->waiting[signal], __ATOMIC_SEQ_CST))
+    futex_wake(&ipc->sync->posted[signal]);
+  return 0;
+}
+
+static int shm_p(struct vicii_ipc* ipc, int signal) {
+  unsigned int* posted = &ipc->sync->posted[signal];
+  unsigned int* waiting = &ipc->sync->waiting[signal];
+  unsigned int taken = ipc->taken[signal];
+  int spins = 0;
+
+  while (__atomic_load_n(posted, __ATOMIC_ACQUIRE) == taken) {
+    if (spins < ipc->spinLimit) {
+      spins++;
+      cpu_relax();
+      continue;
+    }
+    // Announce we are about to sleep then look again, so a post that
+    // raced with us either sees the flag or is seen by us.
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(posted, __ATOMIC_SEQ_CST) == taken) {
+      if (futex_wait(posted, taken))
+        return 1;
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+    spins++;
+  }
+  ipc->taken[signal] = taken + 1;
+
+  // Spin longer if the other end tends to answer quickly, less if we
+  // end up sleeping anyway.
+  if (ipc->spinLimit == 0) {
+    ;
+  } else if (spins <= ipc->spinLimit) {
+    if (ipc->spinLimit < SPIN_MAX) ipc->spinLimit *= 2;
+  } else {
+    if (ipc->spinLimit > SPIN_MIN) ipc->spinLimit /= 2;
+  }
+  return 0;
+}
+
+static int sig_post(struct vicii_ipc* ipc, int signal) {
+  if (ipc->transport == IPC_TRANSPORT_SHM)
+    return shm_v(ipc, signal);
+  return v(ipc, signal);
+}
+
+static int sig_wait(struct vicii_ipc* ipc, int signal) {
+  if (ipc->transport == IPC_TRANSPORT_SHM)
+    return shm_p(ipc, signal);
+  return p(ipc, signal);
+}
+
 struct vicii_ipc* ipc_init(int endPoint) {
    struct vicii_ipc* ipc = (struct vicii_ipc*)
        malloc(sizeof(struct vicii_ipc));
    ipc->endPoint = endPoint;
-   ipc->semsKey = 1240;
-   ipc->bufKey = 1241;
-   return ipc;
-}
 
-int ipc_open(struct vicii_ipc* ipc) {
-  int mode;
+   const char* session = getenv("VICII_IPC_SESSION");
+   ipc_set_session(ipc, session ? atoi(session) : 0);
+   ipc->transport = IPC_TRANSPORT_SHM;
+   ipc->sync = NULL;
+   ipc->batch = NULL;
+   memset(ipc->taken, 0, sizeof(ipc->taken));
+   ipc->spinLimit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_START : 0;
 
-  if (ipc->endPoint == IPC_RECEIVER) {
-    mode = IPC_CREAT;
-  } else {
-    mode = 0;
-  }
+   // Only matters for the receiver. The sender uses what it finds.
+   const char* transport = getenv("VICII_IPC_TRANSPORT");
+   if (transport && strcmp(transport, "sem") == 0)
+      ipc->transport = IPC_TRANSPORT_SEM;
+   return ipc;
+}
 
+static int open_sems(struct vicii_ipc* ipc, int mode) {
   ipc->semsId = semget(ipc->semsKey, 4, mode | 0666);
   if (ipc->semsId < 0) {
     fprintf(stderr, "%s: can't create semaphore\n", MODULE_NAME);
@@ -91,26 +206,89 @@ int ipc_open(struct vicii_ipc* ipc) {
       }
     }
   }
+  return 0;
+}
+
+void ipc_set_session(struct vicii_ipc* ipc, int session) {
+   ipc->session = session;
+   ipc->semsKey = IPC_BASE_KEY + session * 2;
+   ipc->bufKey = IPC_BASE_KEY + session * 2 + 1;
+}
+
+// Receiver only. Removes segments and semaphores a previous receiver
+// on this session left behind, unless that receiver is still running.
+static int remove_stale(struct vicii_ipc* ipc) {
+  int shmId = shmget(ipc->bufKey, 0, 0);
+  if (shmId >= 0) {
+    struct shmid_ds ds;
+    if (shmctl(shmId, IPC_STAT, &ds) == 0 && ds.shm_nattch > 0 &&
+           kill(ds.shm_cpid, 0) == 0) {
+      fprintf(stderr, "%s: session %d is in use by pid %d\n",
+              MODULE_NAME, ipc->session, (int)ds.shm_cpid);
+      return -1;
+    }
+    shmctl(shmId, IPC_RMID, NULL);
+  }
+
+  int semsId = semget(ipc->semsKey, 0, 0);
+  if (semsId >= 0)
+    semctl(semsId, 0, IPC_RMID);
+  return 0;
+}
+
+int ipc_open(struct vicii_ipc* ipc) {
+  int mode;
+
+  if (ipc->endPoint == IPC_RECEIVER) {
+    mode = IPC_CREAT;
+    if (remove_stale(ipc))
+      return -1;
+  } else {
+    mode = 0;
+  }
 
-  ipc->bufShmId = shmget(ipc->bufKey, IPC_BUFSIZE, mode | 0644);
+  ipc->bufShmId = shmget(ipc->bufKey, IPC_SHMSIZE, mode | 0644);
   if (ipc->bufShmId < 0) {
     fprintf(stderr, "%s: can't allocate shared memory segment for outbuf %d\n",
-            MODULE_NAME, IPC_BUFSIZE);
+            MODULE_NAME, (int)IPC_SHMSIZE);
     perror("REASON");
     return -1;
   }
 
   ipc->state = (struct vicii_state*)shmat(ipc->bufShmId, NULL, 0);
+  if (ipc->state == (void*)-1) {
+    ipc->state = NULL;
+    fprintf(stderr, "%s: can't allocate dsp buffer\n", MODULE_NAME);
+    return -1;
+  }
   memset(ipc->state, 0, IPC_BUFSIZE);
   ipc->state->enabled = 1;
   ipc->state->rw = 1;
   ipc->state->ce = 1;
 
-  if (ipc->state == NULL) {
-    fprintf(stderr, "%s: can't allocate dsp buffer\n", MODULE_NAME);
-    return -1;
+  ipc->sync = (struct ipc_sync*)((char*)ipc->state + IPC_BUFSIZE);
+  ipc->batch = (struct vicii_batch*)(ipc->sync + 1);
+  if (ipc->endPoint == IPC_RECEIVER) {
+    memset(ipc->sync, 0, sizeof(struct ipc_sync));
+    ipc->batch->count = 0;
+    ipc->batch->done = 0;
+    ipc->sync->transport = ipc->transport;
+    __atomic_store_n(&ipc->sync->magic, IPC_SYNC_MAGIC, __ATOMIC_RELEASE);
+  } else {
+    if (__atomic_load_n(&ipc->sync->magic, __ATOMIC_ACQUIRE) !=
+           IPC_SYNC_MAGIC) {
+      fprintf(stderr, "%s: receiver has not opened the channel\n",
+              MODULE_NAME);
+      return -1;
+    }
+    ipc->transport = ipc->sync->transport;
+    for (int i = 0; i < 4; i++)
+      ipc->taken[i] = ipc->sync->posted[i];
   }
 
+  if (ipc->transport == IPC_TRANSPORT_SEM)
+    return open_sems(ipc, mode);
+
   return 0;
 }
 
@@ -118,19 +296,34 @@ void ipc_close(struct vicii_ipc* ipc) {
   // Now free up all the memory and close handles
   shmdt(ipc->state);
   ipc->state = NULL;
+
+  // The receiver created the channel so it takes it down. The segment
+  // goes away once the sender detaches too.
+  if (ipc->endPoint == IPC_RECEIVER) {
+    shmctl(ipc->bufShmId, IPC_RMID, NULL);
+    if (ipc->transport == IPC_TRANSPORT_SEM)
+      semctl(ipc->semsId, 0, IPC_RMID);
+  }
   free(ipc);
 }
 
+int ipc_peer_attached(struct vicii_ipc* ipc) {
+  struct shmid_ds ds;
+  if (shmctl(ipc->bufShmId, IPC_STAT, &ds) != 0)
+    return 0;
+  return ds.shm_nattch > 1;
+}
+
 int ipc_send(struct vicii_ipc* ipc) {
   if (ipc->endPoint == IPC_RECEIVER) {
-    if (v(ipc, END1_PRODUCER_SIG_END2_CONSUME_OK))
+    if (sig_post(ipc, END1_PRODUCER_SIG_END2_CONSUME_OK))
        return 1;
-    if (p(ipc, END2_CONSUMER_SIG_END1_PRODUCE_OK))
+    if (sig_wait(ipc, END2_CONSUMER_SIG_END1_PRODUCE_OK))
        return 1;
   } else {
-    if (v(ipc, END2_PRODUCER_SIG_END1_CONSUME_OK))
+    if (sig_post(ipc, END2_PRODUCER_SIG_END1_CONSUME_OK))
        return 1;
-    if (p(ipc, END1_CONSUMER_SIG_END2_PRODUCE_OK))
+    if (sig_wait(ipc, END1_CONSUMER_SIG_END2_PRODUCE_OK))
        return 1;
   }
   return 0;
@@ -138,21 +331,35 @@ int ipc_send(struct vicii_ipc* ipc) {
 
 int ipc_receive(struct vicii_ipc* ipc) {
     if (ipc->endPoint == IPC_SENDER) {
-      if (p(ipc, END1_PRODUCER_SIG_END2_CONSUME_OK))
+      if (sig_wait(ipc, END1_PRODUCER_SIG_END2_CONSUME_OK))
          return 1;
     } else {
-      if (p(ipc, END2_PRODUCER_SIG_END1_CONSUME_OK))
+      if (sig_wait(ipc, END2_PRODUCER_SIG_END1_CONSUME_OK))
          return 1;
     }
+    return 0;
 }
 
 int ipc_receive_done(struct vicii_ipc* ipc) {
     if (ipc->endPoint == IPC_SENDER) {
-      if (v(ipc, END2_CONSUMER_SIG_END1_PRODUCE_OK))
+      if (sig_post(ipc, END2_CONSUMER_SIG_END1_PRODUCE_OK))
          return 1;
     } else {
-      if (v(ipc, END1_CONSUMER_SIG_END2_PRODUCE_OK))
+      if (sig_post(ipc, END1_CONSUMER_SIG_END2_PRODUCE_OK))
          return 1;
     }
     return 0;
 }
+
+int ipc_send_batch(struct vicii_ipc* ipc, int count) {
+  if (count < 1 || count > IPC_BATCH_MAX) {
+    fprintf(stderr, "%s: bad batch size %d\n", MODULE_NAME, count);
+    return 1;
+  }
+  ipc->batch->count = count;
+  ipc->batch->done = 0;
+  ipc->state->flags |= VICII_OP_BATCH;
+  int rc = ipc_send(ipc);
+  ipc->state->flags &= ~VICII_OP_BATCH;
+  return rc;
+}
@@ -25,6 +25,20 @@
 // initialized as the IPC_SENDER.  Then either side
 // can coordinate request/responses using ipc_receive()
 // or ipc_send() functions.
+//
+// Two transports carry the handshakes. IPC_TRANSPORT_SHM (default)
+// keeps a sequence counter per signal in the shared segment and
+// waits by spinning briefly, then sleeping on a futex, so a round
+// trip normally needs no system call. IPC_TRANSPORT_SEM uses SysV
+// semaphores, one semop() per signal. The receiver picks the
+// transport (VICII_IPC_TRANSPORT=shm|sem in the environment) and
+// the sender follows whatever the receiver chose.
+//
+// Several receiver/sender pairs can run at once on different sessions.
+// Session n uses keys IPC_BASE_KEY + 2n and + 2n + 1. Both ends take
+// the session from VICII_IPC_SESSION (default 0) unless
+// ipc_set_session() is called before ipc_open(). Opening a receiver
+// clears out whatever a dead receiver left on its session.
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -50,6 +64,14 @@ union semun {
 #define VICII_OP_CAPTURE_ONE_FRAME 16
 // Abort
 #define VICII_OP_CAPTURE_ABORT   32
+// This exchange carries a batch of steps (see struct vicii_batch)
+#define VICII_OP_BATCH           64
+
+// vicii_state.dirty bits
+#define VICII_DIRTY_CHAR_BUF     1  // fpga_char_buf
+#define VICII_DIRTY_SPRITES      2  // mc, mcbase, ye_ff, sprite_dma
+#define VICII_DIRTY_COUNTERS     4  // vc_base, vc, rc
+#define VICII_DIRTY_ALL          7
 
 // Must not exceed IPC_BUFSIZE
 struct vicii_state {
@@ -116,6 +138,52 @@ struct vicii_state {
   // Used to adjust our address on bmm transition glitch
   int vice_vbank_phi1;
   int vice_vbank_phi2;
+
+  // What the simulator changed since the state was last handed back
+  // to VICE. dirty has VICII_DIRTY_* bits for the bulky groups below,
+  // dirty_regs one bit per fpga_reg entry. A sync marks everything.
+  // The single byte/int fields are always current.
+  unsigned int dirty;
+  unsigned long long dirty_regs;
+};
+
+// Batch mode. Instead of one handshake per step (4 dot4x ticks), the
+// sender queues up to IPC_BATCH_MAX steps of bus inputs and the
+// receiver runs them all before answering with one result per step.
+// The sender compares results after the fact. Sync requests
+// (VICII_OP_SYNC_STATE) still go through a normal single exchange.
+
+#define IPC_BATCH_MAX 4096
+
+// Bus inputs for one step, same meaning as the fields in vicii_state
+struct vicii_bus_in {
+  unsigned short addr_to_sim;
+  unsigned short data_to_sim;
+  unsigned char ce;
+  unsigned char rw;
+  unsigned char lp;
+  unsigned char flags;  // VICII_OP_BUS_ACCESS or 0
+};
+
+#define IPC_BATCH_MAX_REG_DELTAS 8
+
+// Outputs at the end of one step. Only fpga_reg entries that changed
+// since the previous step are listed.
+struct vicii_bus_out {
+  unsigned char irq;
+  unsigned char ba;
+  unsigned char aec;
+  unsigned char num_reg_deltas;  // > IPC_BATCH_MAX_REG_DELTAS on overflow
+  unsigned short addr_from_sim;
+  unsigned short data_from_sim;
+  unsigned char reg_delta[IPC_BATCH_MAX_REG_DELTAS][2];  // reg, value
+};
+
+struct vicii_batch {
+  unsigned int count;  // steps queued by sender
+  unsigned int done;   // steps run by receiver
+  struct vicii_bus_in in[IPC_BATCH_MAX];
+  struct vicii_bus_out out[IPC_BATCH_MAX];
 };
 
 #define END1_PRODUCER_SIG_END2_CONSUME_OK 0
@@ -128,8 +196,17 @@ struct vicii_state {
 
 #define IPC_BUFSIZE  1024
 
+#define IPC_BASE_KEY 1240
+
+#define IPC_TRANSPORT_SEM 1
+#define IPC_TRANSPORT_SHM 2
+
+// Lives in the shared segment right after the state buffer
+struct ipc_sync;
+
 struct vicii_ipc {
   int endPoint;
+  int session;
   int semsKey;
   int semsId;
   struct sembuf operation[4][1];
@@ -138,6 +215,12 @@ struct vicii_ipc {
   int bufShmId;
 
   struct vicii_state* state;
+  struct vicii_batch* batch;
+
+  int transport;
+  struct ipc_sync* sync;
+  unsigned int taken[4];  // signals consumed so far (shm transport)
+  int spinLimit;
 };
 
 // IPC_RECEIVER must init first
@@ -145,6 +228,10 @@ struct vicii_ipc {
 // IPC_RECEIVER receives a request and sends a response
 struct vicii_ipc* ipc_init(int endPoint);
 
+// Call before ipc_open() to override VICII_IPC_SESSION
+void ipc_set_session(struct vicii_ipc* ipc, int session);
+
+// Return 0 on success
 int ipc_open(struct vicii_ipc* ipc);
 
 void ipc_close(struct vicii_ipc* ipc);
@@ -157,4 +244,12 @@ int ipc_receive(struct vicii_ipc* ipc);
 
 int ipc_receive_done(struct vicii_ipc* ipc);
 
+// Return 1 once the other end has opened the channel too
+int ipc_peer_attached(struct vicii_ipc* ipc);
+
+// Sender side of batch mode. Fill ipc->batch->in[0..count-1] first.
+// Results are in ipc->batch->out[0..done-1] when this returns.
+// Return 1 on error, 0 success
+int ipc_send_batch(struct vicii_ipc* ipc, int count);
+
 #endif
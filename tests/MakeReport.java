@@ -3,7 +3,29 @@ import java.util.*;
 
 public class MakeReport
 {
+     // test path -> status and seconds from test_all.sh
+     static Map<String,String> loadResults() throws Exception {
+        Map<String,String> results = new HashMap<String,String>();
+        File f = new File("results.tsv");
+        if (!f.exists()) return results;
+        BufferedReader br = new BufferedReader(new FileReader(f));
+        br.readLine();
+        while (true) {
+                String l = br.readLine();
+                if (l == null) break;
+                String cols[] = l.split("\t");
+                if (cols.length < 4) continue;
+                String r = cols[2] + " " + cols[3] + "s";
+                if (cols.length >= 7)
+                   r += " hash " + cols[5] + " verdict " + cols[6];
+                results.put(cols[0], r);
+        }
+        br.close();
+        return results;
+     }
+
      public static void main(String args[]) throws Exception {
+        Map<String,String> results = loadResults();
         File f = new File("list.txt");
         FileInputStream fis = new FileInputStream(f);
         InputStreamReader ir = new InputStreamReader(fis);
@@ -22,6 +44,8 @@ public class MakeReport
 		System.out.println("<tr>");
 		System.out.println("<td>");
 		System.out.println(l);
+		if (results.containsKey(l))
+		   System.out.println(" - " + results.get(l));
 		System.out.println("</td>");
 		System.out.println("</tr>");
 
@@ -32,6 +56,11 @@ public class MakeReport
 		System.out.println("<td>");
 		System.out.println("<a target=_blank href=\""+web_dir+"/fpga_"+fn+".png\"><img src=\""+web_dir+"/fpga_"+fn+".png\"></img></a>");
 		System.out.println("</td>");
+		if (new File(d+"/diff_"+fn+".png").exists()) {
+		   System.out.println("<td>");
+		   System.out.println("<a target=_blank href=\""+web_dir+"/diff_"+fn+".png\"><img src=\""+web_dir+"/diff_"+fn+".png\"></img></a>");
+		   System.out.println("</td>");
+		}
 		System.out.println("<td>");
 		System.out.println("<textarea rows=\"10\" cols=\"50\">");
 
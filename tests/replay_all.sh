@@ -0,0 +1,48 @@
+#!/bin/bash
+# Usage
+# ./replay_all.sh
+#
+# Re-runs every test that has a bus recording (bus_<prg>.rec, made by
+# test_all.sh) without VICE and reports the ones whose answers no
+# longer match the recording.
+
+input="tests.txt"
+pass=0
+fail=0
+while read -r line
+do
+	stringarray=($line)
+
+	i=${stringarray[0]}
+
+	j=`basename $i`
+	k=`dirname $i`
+
+	if [ ! -f $k/bus_$j.rec ]
+	then
+		continue
+	fi
+
+	if [ "${stringarray[1]}" == "NTSC" ]
+	then
+		chip="0"
+	elif [ "${stringarray[1]}" == "NTSCOLD" ]
+	then
+		chip="2"
+	else
+		chip="1"
+	fi
+
+	if ../simulator/obj_dir/Vtop -q -c $chip --replay $k/bus_$j.rec \
+		-o $k/replay_$j.png > $k/replay_$j.log
+	then
+		pass=$((pass+1))
+	else
+		fail=$((fail+1))
+		echo "FAIL $i (see $k/replay_$j.log)"
+	fi
+
+done < "$input"
+
+echo "$pass passed, $fail failed"
+[ $fail -eq 0 ]
@@ -1,79 +1,223 @@
 #!/bin/bash
 # Usage
-# ./test_all [prg]
+# ./test_all.sh [-j jobs] [-t timeout] [-b] [pattern]
 #
-# If prg omitted, all tests run.
+# Runs every test in tests.txt (or the ones whose path matches pattern)
+# against VICE, up to one test per cpu at a time.
+#
+# Each worker has its own IPC session (VICII_IPC_SESSION / -K) and its
+# own scratch directory under work/. The simulator is started first and
+# VICE only once the simulator says its IPC session is open. That part
+# is a handshake. What follows is not: the simulator waits for VICE to
+# attach and then for the test's settle time (--capture-after) before
+# it raises the capture flag. The settle time is still a fixed guess
+# per test, the same delays this script used to sleep for, only
+# counted from when VICE attached instead of from when it was
+# launched. VICE shares nothing with the simulator before the capture
+# starts, so there is no earlier point to tell that a test program has
+# finished setting up its screen.
+#
+# The simulator checks its own frame. If golden_<prg>.hash exists next
+# to the test, the frame's hash must match it. Otherwise, if
+# golden_<prg>.png exists, the frame must match it pixel for pixel
+# (differences go to diff_<prg>.png). -b stores this run's hashes as
+# the new golden ones.
+#
+# Results go to results.tsv (read by MakeReport.java):
+#    test  standard  status  seconds  exit  hash  verdict
+# status is pass, fail or timeout. verdict is pass/fail against the
+# golden hash or image, or - if there is none.
 
-VICII_PARENT=/shared/Vivado
+VICII_PARENT=${VICII_PARENT:-/shared/Vivado}
+VICE_DIR=${VICE_DIR:-${VICII_PARENT}/vicii-vice-3.4}
+VTOP=`pwd`/../simulator/obj_dir/Vtop
 
-input="tests.txt"
-while read -r line
+jobs=`nproc`
+timeout=300
+bless=0
+while getopts "j:t:b" opt
 do
-   stringarray=($line)
+	case $opt in
+		j) jobs=$OPTARG ;;
+		t) timeout=$OPTARG ;;
+		b) bless=1 ;;
+		*) echo "usage: $0 [-j jobs] [-t timeout] [-b] [pattern]"; exit 1 ;;
+	esac
+done
+shift $((OPTIND-1))
+pattern=$1
 
-   #if [ "${stringarray[2]}" == "screenshot" ]
-   #then
+results=results.tsv
+work=`pwd`/work
 
-	i=${stringarray[0]}
+# How long the test program needs to set up its screen, in ms. A fixed
+# delay, not a readiness signal, so a slow machine can still capture
+# too early.
+settle_time() {
+	case $1 in
+		*spritecrunch*) echo 8000 ;;
+		*reg_timing*) echo 14000 ;;
+		*lightpen*) echo 16000 ;;
+		*lft-safe-vsp*|*spritescan*|*sprite0move*|*spritevssprite*)
+			echo 19000 ;;
+		*) echo 6000 ;;
+	esac
+}
+
+# Run one test on worker slot $1. Appends one line to $results.
+run_test() {
+	slot=$1
+	i=$2
+	std=$3
 
 	j=`basename $i`
 	k=`dirname $i`
+	dir=$work/$slot
 
-	if [ "${stringarray[1]}" == "NTSC" ]
+	if [ "$std" == "NTSC" ]
 	then
 		standard="-ntsc"
 		model="6567"
 		chip="0"
-		resolution="520x263"
-	elif [ "${stringarray[1]}" == "NTSCOLD" ]
+	elif [ "$std" == "NTSCOLD" ]
 	then
 		standard="-ntsc"
 		model="6567r56a"
 		chip="2"
-		resolution="512x262"
 	else
 		standard="-pal"
 		model="6569"
 		chip="1"
-		resolution="512x312"
 	fi
 
-	delay="6"
-	if [[ $i == +(*spritecrunch*) ]]
+	rm -rf $dir
+	mkdir -p $dir
+	start=`date +%s.%N`
+
+	check=
+	if [ $bless -eq 0 ] && [ -f $k/golden_$j.hash ]
 	then
-		delay="8"
-	elif [[ $i == +(*reg_timing*) ]]
+		check="--expect-hash `cat $k/golden_$j.hash`"
+	elif [ $bless -eq 0 ] && [ -f $k/golden_$j.png ]
 	then
-		delay="14"
-	elif [[ $i == +(*lightpen*) ]]
+		check="--ref-image $k/golden_$j.png --diff-image $k/diff_$j.png"
+	fi
+
+	# Simulator first, it owns the session
+	timeout $timeout $VTOP -k -q -z -x -c $chip -K $slot \
+		--restore reset_$chip.ckpt --capture-after `settle_time $i` \
+		--record-bus $k/bus_$j.rec --native -o $k/fpga_$j.png $check \
+		> $dir/sim.log 2>&1 &
+	sim=$!
+
+	# Wait for it to open the session (or die trying)
+	ready=0
+	while kill -0 $sim 2> /dev/null
+	do
+		if grep -qs "IPC session $slot open" $dir/sim.log
+		then
+			ready=1
+			break
+		fi
+		sleep 0.1
+	done
+
+	vice=
+	if [ $ready -eq 1 ]
 	then
-		delay="16"
-	elif [[ $i == +(*lft-safe-vsp*) ]]
+		# VICE writes screenshot.png to its working directory
+		( cd $dir && VICII_IPC_SESSION=$slot exec $VICE_DIR/src/x64sc \
+			-sounddev dummy $standard -VICIImodel $model \
+			"${VICII_PARENT}/vicii-kawari/tests/$i" 2> vice.log ) &
+		vice=$!
+	fi
+
+	wait $sim
+	rc=$?
+	end=`date +%s.%N`
+
+	# VICE saves its screenshot and quits once the capture is over.
+	# Give it a few seconds to do that, then make sure of it.
+	if [ -n "$vice" ]
 	then
-		delay="19"
-	elif [[ $i == +(*spritescan*) ]]
+		for ((n = 0; n < 50; n++))
+		do
+			kill -0 $vice 2> /dev/null || break
+			sleep 0.1
+		done
+		kill $vice 2> /dev/null
+		wait $vice 2> /dev/null
+	fi
+
+	status=fail
+	if [ $rc -eq 124 ]
 	then
-		delay="19"
-	elif [[ $i == +(*sprite0move*) ]]
+		status=timeout
+	elif [ $rc -eq 0 ]
 	then
-		delay="19"
-	elif [[ $i == +(*spritevssprite*) ]]
+		status=pass
+	fi
+
+	hash=`sed -n 's/^frame hash //p' $dir/sim.log`
+	verdict=`sed -n 's/^verdict: //p' $dir/sim.log`
+	if [ -n "$hash" ]
 	then
-		delay="19"
+		echo $hash > $k/fpga_$j.hash
+		[ $bless -eq 1 ] && cp $k/fpga_$j.hash $k/golden_$j.hash
 	fi
 
-	pushd ${VICII_PARENT}/vicii-vice-3.4
-        ./src/x64sc -sounddev dummy $standard -VICIImodel $model \
-		"${VICII_PARENT}/vicii-kawari/tests/$i" 2> stderr &
-	popd
-	sleep $delay
-	rm -f screenshot.bmp
-	../simulator/obj_dir/Vtop -k -q -w -z -x -c $chip
-	sleep 1
-
-	mv ${VICII_PARENT}/vicii-vice-3.4/stderr $k/vice_$j.log
-	convert screenshot.bmp -interpolate Integer -filter point -resize $resolution $k/fpga_$j.png
-	mv ${VICII_PARENT}/vicii-vice-3.4/screenshot.png $k/vice_$j.png
-   #fi
-
-done < "$input"
+	[ -f $dir/vice.log ] && mv $dir/vice.log $k/vice_$j.log
+	[ -f $dir/screenshot.png ] && mv $dir/screenshot.png $k/vice_$j.png
+
+	awk -v t=$i -v s=$std -v st=$status -v a=$start -v b=$end -v rc=$rc \
+		-v h=${hash:--} -v v=${verdict:--} \
+		'BEGIN { printf "%s\t%s\t%s\t%.1f\t%d\t%s\t%s\n", t, s, st, b - a, rc, h, v }' \
+		>> $results
+	echo "$status $i"
+}
+
+# Post reset checkpoints, one per chip, made fresh for each run. Done
+# up front so workers never race to create them.
+rm -f reset_*.ckpt
+for chip in 0 1 2
+do
+	$VTOP -c $chip -d 0 --save-at reset:reset_$chip.ckpt > /dev/null || exit 1
+done
+
+printf "test\tstandard\tstatus\tseconds\texit\thash\tverdict\n" > $results
+suite_start=`date +%s`
+
+# Worker pool. Slot n runs on IPC session n.
+declare -a pids
+while read -r line
+do
+	stringarray=($line)
+	i=${stringarray[0]}
+	if [ -n "$pattern" ] && [[ $i != *$pattern* ]]
+	then
+		continue
+	fi
+
+	slot=-1
+	while [ $slot -lt 0 ]
+	do
+		for ((s = 0; s < jobs; s++))
+		do
+			if [ -z "${pids[$s]}" ] || ! kill -0 ${pids[$s]} 2> /dev/null
+			then
+				slot=$s
+				break
+			fi
+		done
+		[ $slot -lt 0 ] && wait -n
+	done
+
+	run_test $slot $i ${stringarray[1]} &
+	pids[$slot]=$!
+done < "tests.txt"
+wait
+
+rm -rf $work
+pass=`awk -F'\t' '$3 == "pass"' $results | wc -l`
+total=$((`wc -l < $results` - 1))
+echo "$pass of $total passed in $((`date +%s` - suite_start))s with $jobs jobs"